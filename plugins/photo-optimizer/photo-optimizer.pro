@@ -9,7 +9,7 @@ TEMPLATE        = lib
 CONFIG         += plugin
 QMAKE_CXXFLAGS  = -std=c++11
 QMAKE_LFLAGS   += -s
-LIBS           +=
+LIBS           += -ljpeg
 QT             += widgets
 
 BUILD_DIR =   ../../build
@@ -9,9 +9,19 @@
 #include <QGroupBox>
 #include <QPushButton>
 #include <QFileDialog>
-#include <QThreadPool>
+#include <QThread>
 #include <QMouseEvent>
 #include <QMimeData>
+#include <QImageReader>
+#include <QSettings>
+#include <QPainter>
+#include <QDoubleSpinBox>
+#include <QDateTime>
+#include <QTextStream>
+#include <climits>
+#include <vector>
+#include <csetjmp>
+#include <jpeglib.h>
 #include <QUrl>
 #include <QDebug>
 
@@ -27,9 +37,13 @@
 
 // ********************** Photo Optimizer Dialog ******************** //
 
-QImage loadImage(QString fileName);
-bool saveJpegWithExif(QImage img, int quality, QString out_filename, QString exif_filename);
-bool add_thumbnail_to_jpg(QImage thumbnail, QString filename, QString out_filename);
+QImage orientImage(QImage img, int orientation);
+QSize scaledDecodeSize(QSize size, QSize target);
+bool saveJpegWithExif(QByteArray jpg, QByteArray thumbnail, int pixels,
+                        QString out_filename, QString exif_filename, bool rotated=true);
+bool optimizeJpegLossless(const QByteArray &jpg, QByteArray &out, bool progressive);
+bool add_thumbnail_to_jpg(QByteArray thumbnail, QString filename, QString out_filename);
+static bool copyJpeg(QString filename, QString out_filename, QString tmp_name, QByteArray thumbnail);
 FILE* qfopen(QString filename, const char *mode);
 
 PhotoOptimizerDialog:: PhotoOptimizerDialog(QWidget *parent) : QDialog(parent)
@@ -42,9 +56,12 @@ PhotoOptimizerDialog:: PhotoOptimizerDialog(QWidget *parent) : QDialog(parent)
     QGroupBox *groupBox1 = new QGroupBox("Drag && Drop Photos or a Folder", this);
     selectedPhotosLabel = new QLabel("0 Photos in current folder", groupBox1);
     selectDirBtn = new QPushButton("Choose Folder", groupBox1);
+    checkWatch = new QCheckBox("Watch", groupBox1);
+    checkWatch->setToolTip("Keep running and compress new photos added to this folder");
 
     QHBoxLayout *hLayout1 = new QHBoxLayout(groupBox1);
     hLayout1->addWidget(selectedPhotosLabel);
+    hLayout1->addWidget(checkWatch);
     hLayout1->addWidget(selectDirBtn);
     hLayout1->setStretch(0,1);
 
@@ -83,6 +100,41 @@ PhotoOptimizerDialog:: PhotoOptimizerDialog(QWidget *parent) : QDialog(parent)
     gridLayout->addWidget(longEdgeEdit, 2, 1, 1, 1);
     gridLayout->setColumnStretch(0,1);
 
+    QWidget *memoryWidget = new QWidget(this);
+    checkLossless = new QCheckBox("Lossless", memoryWidget);
+    checkLossless->setToolTip("Only optimize JPEG encoding, without changing image quality");
+    QLabel *memoryLabel = new QLabel("Memory Limit :", memoryWidget);
+    memoryLimitSpin = new QSpinBox(memoryWidget);
+    memoryLimitSpin->setRange(256, 65536);
+    memoryLimitSpin->setSingleStep(256);
+    memoryLimitSpin->setSuffix(" MB");
+    QSettings settings;
+    memoryLimitSpin->setValue(settings.value("PhotoOptimizer/MemoryLimit", 1024).toInt());
+
+    QHBoxLayout *hLayout4 = new QHBoxLayout(memoryWidget);
+    hLayout4->setContentsMargins(6,0,6,0);
+    hLayout4->addWidget(checkLossless);
+    hLayout4->addWidget(memoryLabel);
+    hLayout4->addWidget(memoryLimitSpin);
+    hLayout4->setStretch(1,1);
+    memoryLabel->setAlignment(Qt::AlignRight | Qt::AlignVCenter);
+
+    QWidget *qualityWidget = new QWidget(this);
+    checkSsim = new QCheckBox("Perceptual Quality, Target SSIM :", qualityWidget);
+    checkSsim->setToolTip("Use lowest JPEG quality at which structural similarity is above target");
+    ssimSpin = new QDoubleSpinBox(qualityWidget);
+    ssimSpin->setDecimals(3);
+    ssimSpin->setRange(0.9, 0.999);
+    ssimSpin->setSingleStep(0.005);
+    ssimSpin->setValue(settings.value("PhotoOptimizer/TargetSSIM", 0.98).toDouble());
+    ssimSpin->setEnabled(false);
+
+    QHBoxLayout *hLayout5 = new QHBoxLayout(qualityWidget);
+    hLayout5->setContentsMargins(6,0,6,0);
+    hLayout5->addWidget(checkSsim);
+    hLayout5->addWidget(ssimSpin);
+    hLayout5->setStretch(0,1);
+
     QWidget *widget = new QWidget(this);
     statusbar = new QLabel(widget);
     closeBtn = new QPushButton("Close", widget);
@@ -98,6 +150,8 @@ PhotoOptimizerDialog:: PhotoOptimizerDialog(QWidget *parent) : QDialog(parent)
     dialogLayout->addWidget(groupBox1);
     dialogLayout->addWidget(groupBox2);
     dialogLayout->addWidget(groupBox3);
+    dialogLayout->addWidget(qualityWidget);
+    dialogLayout->addWidget(memoryWidget);
     dialogLayout->addWidget(widget);
 
     // connect signals
@@ -105,6 +159,9 @@ PhotoOptimizerDialog:: PhotoOptimizerDialog(QWidget *parent) : QDialog(parent)
     connect(changeOutDirBtn, SIGNAL(clicked()), this, SLOT(chooseTargetDir()));
     connect(checkMegaPixel, SIGNAL(toggled(bool)), this, SLOT(toggleMaxResolution(bool)));
     connect(checkResolution, SIGNAL(toggled(bool)), this, SLOT(toggleResizeTo(bool)));
+    connect(checkLossless, SIGNAL(toggled(bool)), groupBox3, SLOT(setDisabled(bool)));
+    connect(checkLossless, SIGNAL(toggled(bool)), qualityWidget, SLOT(setDisabled(bool)));
+    connect(checkSsim, SIGNAL(toggled(bool)), ssimSpin, SLOT(setEnabled(bool)));
     connect(closeBtn, SIGNAL(clicked()), this, SLOT(reject()));
     connect(optimizeBtn, SIGNAL(clicked()), this, SLOT(optimize()));
 
@@ -136,6 +193,7 @@ PhotoOptimizerDialog:: setPhotos(QStringList files, QString dir)
     selected_files = files;
     if (dir.isEmpty())
         dir = QFileInfo(selected_files[0]).dir().path();
+    source_dir = dir;
     selectedPhotosLabel->setText(QString("%1 photos in \"%2\"").arg(
                                 selected_files.count()).arg(QDir(dir).dirName()));
     target_dir = dir + "-compressed";
@@ -193,9 +251,21 @@ PhotoOptimizerDialog:: optimize()
         statusbar->setText("Can not save to target folder");
         return;
     }
+    if (checkWatch->isChecked()) {
+        // saved photos would be found as new photos, and compressed again
+        QString src = QDir(source_dir).canonicalPath();
+        QString dst = QDir(target_dir).canonicalPath();
+        if (dst==src || dst.startsWith(src + "/")) {
+            statusbar->setText("Target folder must be outside of watched folder");
+            return;
+        }
+    }
     short_edge = 0;
     long_edge = 0;
-    if (checkMegaPixel->isChecked()){
+    if (checkLossless->isChecked()) {
+        // image is not resized
+    }
+    else if (checkMegaPixel->isChecked()){
         switch (megaPixelCombo->currentIndex()) {
         case 0:
             short_edge = 3000;// 12M, Redmi Note 5 pro
@@ -226,17 +296,42 @@ PhotoOptimizerDialog:: optimize()
         long_edge = longEdgeEdit->text().toInt();
     }
     optimizeBtn->setEnabled(false);
-    QThreadPool *pool = QThreadPool::globalInstance();
     finished_count = 0;
     failed_count = 0;
-    for (task_index=0; task_index<selected_files.count() &&
-                        task_index<pool->maxThreadCount(); task_index++) {
-        CompressTask *task = new CompressTask(selected_files[task_index], target_dir,
-                                            short_edge, long_edge);
-        connect(task, SIGNAL(compressFinished(bool)), this, SLOT(onCompressFinish(bool)));
-        pool->start(task);
+    QSettings settings;
+    settings.setValue("PhotoOptimizer/MemoryLimit", memoryLimitSpin->value());
+    bool watch = checkWatch->isChecked();
+    // in watch mode, all files in folder (including selected) are sent by watcher
+    pipeline = new CompressPipeline(watch ? QStringList() : selected_files,
+                                    target_dir, short_edge, long_edge);
+    pipeline->watch = watch;
+    pipeline->memory_limit = memoryLimitSpin->value()*1048576LL;
+    pipeline->lossless = checkLossless->isChecked();
+    if (checkSsim->isChecked()) {
+        pipeline->target_ssim = ssimSpin->value();
+        settings.setValue("PhotoOptimizer/TargetSSIM", ssimSpin->value());
     }
+    connect(pipeline, SIGNAL(compressFinished(bool, QString)), this, SLOT(onCompressFinish(bool)));
+    connect(pipeline, SIGNAL(finished()), pipeline, SLOT(deleteLater()));
+    connect(pipeline, SIGNAL(finished()), this, SLOT(onPipelineFinish()));
+    pipeline->start();
     statusbar->setText("Compressing...");
+    if (watch) {
+        checkWatch->setEnabled(false);
+        watcher = new FolderWatcher(source_dir, target_dir, this);
+        connect(watcher, SIGNAL(fileReady(QString)), this, SLOT(onFileReady(QString)));
+        connect(pipeline, SIGNAL(compressFinished(bool, QString)),
+                watcher, SLOT(onFileFinished(bool, QString)));
+        watcher->scan();
+        statusbar->setText("Watching folder...");
+    }
+}
+
+void
+PhotoOptimizerDialog:: onFileReady(QString filename)
+{
+    if (pipeline)
+        pipeline->addFile(filename);
 }
 
 void
@@ -247,20 +342,29 @@ PhotoOptimizerDialog:: onCompressFinish(bool success)
     finished_count++;
     if (not success)
         failed_count++;
+    if (watcher) {
+        statusbar->setText(QString("Watching... %1 successful, %2 failed").arg(
+                            finished_count-failed_count).arg(failed_count));
+        return;
+    }
     if (finished_count==selected_files.count()){
         statusbar->setText(QString("Finished : %1 successful, %2 failed").arg(
                             finished_count-failed_count).arg(failed_count));
-        optimizeBtn->setEnabled(true);
         return;
     }
     statusbar->setText(QString("Compressing... %1/%2").arg(finished_count).arg(selected_files.count()));
-    if (task_index<selected_files.count()){
-        CompressTask *task = new CompressTask(selected_files[task_index], target_dir,
-                                                short_edge, long_edge);
-        connect(task, SIGNAL(compressFinished(bool)), this, SLOT(onCompressFinish(bool)));
-        QThreadPool::globalInstance()->start(task);
-        task_index++;
-    }
+}
+
+// all workers have exited, and pipeline deletes itself
+void
+PhotoOptimizerDialog:: onPipelineFinish()
+{
+    pipeline = NULL;
+    if (cancel)
+        return;
+    if (finished_count==0)
+        statusbar->setText("No photos to compress");
+    optimizeBtn->setEnabled(true);
 }
 
 void
@@ -303,13 +407,280 @@ void
 PhotoOptimizerDialog:: reject()
 {
     cancel = true;
+    // stop watching first, so that no more files are sent to pipeline
+    delete watcher;
+    watcher = NULL;
+    if (pipeline)
+        pipeline->stop();
     QDialog::reject();
 }
 
 
 
-CompressTask:: CompressTask(QString file_name, QString out_dir,
-                            int short_edge_len, int long_edge_len) : QObject()
+// ********************** Compress Pipeline ******************** //
+
+CompressPipeline:: CompressPipeline(QStringList files, QString dst_dir,
+                                    int short_edge, int long_edge) : QObject()
+{
+    this->files = files;
+    this->dst_dir = dst_dir;
+    this->short_edge = short_edge;
+    this->long_edge = long_edge;
+    io_threads = 2;
+    cpu_threads = qMax(QThread::idealThreadCount(), 1);
+    memory_limit = 1024*1048576LL;
+    lossless = false;
+    target_ssim = 0;
+    watch = false;
+    budget = NULL;
+    cancel = false;
+    file_queue = new BoundedQueue<QString>(INT_MAX);
+    // a few jobs are kept ready for each worker of next stage
+    decode_queue = new BoundedQueue<CompressJob*>(2*cpu_threads);
+    write_queue = new BoundedQueue<CompressJob*>(2*io_threads);
+    pool = new QThreadPool(this);
+    pool->setMaxThreadCount(2*io_threads + cpu_threads);
+}
+
+CompressPipeline:: ~CompressPipeline()
+{
+    pool->waitForDone();
+    delete file_queue;
+    delete decode_queue;
+    delete write_queue;
+    delete budget;
+}
+
+void
+CompressPipeline:: start()
+{
+    budget = new MemoryBudget(memory_limit);
+    for (QString filename : files)
+        file_queue->push(filename);
+    if (not watch)
+        file_queue->close();
+    readers_running = io_threads;
+    encoders_running = cpu_threads;
+    writers_running = io_threads;
+    for (int i=0; i<io_threads; i++)
+        pool->start(new PipelineWorker(this, &CompressPipeline::readLoop));
+    for (int i=0; i<cpu_threads; i++)
+        pool->start(new PipelineWorker(this, &CompressPipeline::encodeLoop));
+    for (int i=0; i<io_threads; i++)
+        pool->start(new PipelineWorker(this, &CompressPipeline::writeLoop));
+}
+
+// remaining jobs are discarded, and finished() is emitted when all workers exit
+void
+CompressPipeline:: stop()
+{
+    cancel = true;
+    file_queue->close();
+}
+
+// add a file to process, in watch mode
+void
+CompressPipeline:: addFile(QString filename)
+{
+    file_queue->push(filename);
+}
+
+void
+CompressPipeline:: readLoop()
+{
+    QString filename;
+    while (!cancel && file_queue->pop(filename)) {
+        CompressJob *job = new CompressJob(filename, dst_dir, short_edge, long_edge);
+        job->lossless = lossless;
+        job->target_ssim = target_ssim;
+        if (not job->readHeader()) {
+            delete job;
+            emit compressFinished(false, filename);
+            continue;
+        }
+        // wait until other jobs release enough memory
+        budget->acquire(job->memory);
+        if (job->pass_through && !job->need_thumbnail) {
+            write_queue->push(job);
+            continue;
+        }
+        if (!cancel && job->read()) {
+            decode_queue->push(job);
+            continue;
+        }
+        finishJob(job, false);
+    }
+    if (--readers_running == 0)
+        decode_queue->close();
+}
+
+void
+CompressPipeline:: encodeLoop()
+{
+    CompressJob *job;
+    while (decode_queue->pop(job)) {
+        if (!cancel && job->pass_through) {
+            if (job->makeThumbnail()) {
+                write_queue->push(job);
+                continue;
+            }
+        }
+        else if (!cancel && job->lossless) {
+            if (job->optimize()) {
+                write_queue->push(job);
+                continue;
+            }
+        }
+        else if (!cancel && job->decode()) {
+            job->resize();
+            if (job->encode()) {
+                write_queue->push(job);
+                continue;
+            }
+        }
+        finishJob(job, false);
+    }
+    if (--encoders_running == 0)
+        write_queue->close();
+}
+
+void
+CompressPipeline:: writeLoop()
+{
+    CompressJob *job;
+    while (write_queue->pop(job)) {
+        bool ok = !cancel && job->write();
+        finishJob(job, ok);
+    }
+    if (--writers_running == 0)
+        emit finished();
+}
+
+void
+CompressPipeline:: finishJob(CompressJob *job, bool success)
+{
+    budget->release(job->memory);
+    QString filename = job->filename;
+    delete job;
+    emit compressFinished(success, filename);
+}
+
+
+
+// ********************** Folder Watcher ******************** //
+
+FolderWatcher:: FolderWatcher(QString dir, QString out_dir, QObject *parent) : QObject(parent)
+{
+    this->dir = dir;
+    journal_path = out_dir + "/" + WATCH_JOURNAL_NAME;
+    QFile file(journal_path);
+    if (file.open(QIODevice::ReadOnly)) {
+        QTextStream stream(&file);
+        while (not stream.atEnd()) {
+            // each line is "done\t<key>" or "failed\t<key>"
+            QString line = stream.readLine();
+            QString status = line.section('\t', 0, 0);
+            QString key = line.section('\t', 1);
+            if (status=="done")
+                journal.insert(key);
+            else if (status=="failed")
+                failed.insert(key);
+        }
+        file.close();
+    }
+    watcher = new QFileSystemWatcher(this);
+    watcher->addPath(dir);
+    poll_timer = new QTimer(this);
+    poll_timer->setInterval(WATCH_POLL_INTERVAL);
+    rescan_timer = new QTimer(this);
+    rescan_timer->setInterval(WATCH_RESCAN_INTERVAL);
+    connect(watcher, SIGNAL(directoryChanged(QString)), this, SLOT(scan()));
+    connect(poll_timer, SIGNAL(timeout()), this, SLOT(checkPending()));
+    connect(rescan_timer, SIGNAL(timeout()), this, SLOT(scan()));
+    rescan_timer->start();
+}
+
+// file name, size and modification time, so that a replaced file is processed again
+QString
+FolderWatcher:: journalKey(QString filename)
+{
+    QFileInfo fi(filename);
+    return QString("%1\t%2\t%3").arg(fi.fileName()).arg(fi.size()).arg(
+                                        fi.lastModified().toMSecsSinceEpoch()/1000);
+}
+
+// find new files, which are checked until they stop growing
+void
+FolderWatcher:: scan()
+{
+    QStringList filenames = QDir(dir).entryList({"*.jpg", "*.jpeg"}, QDir::Files);
+    for (QString name : filenames) {
+        QString path = dir + "/" + name;
+        if (pending.contains(path) || running.contains(path))
+            continue;
+        QString key = journalKey(path);
+        if (journal.contains(key) || failed.contains(key))
+            continue;
+        pending[path] = -1;
+    }
+    if (not pending.isEmpty() && not poll_timer->isActive()) {
+        checkPending();
+        poll_timer->start();
+    }
+}
+
+void
+FolderWatcher:: checkPending()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (QString path : pending.keys()) {
+        QFileInfo fi(path);
+        if (not fi.exists()) {// deleted or renamed
+            pending.remove(path);
+            continue;
+        }
+        qint64 age = now - fi.lastModified().toMSecsSinceEpoch();
+        if (fi.size()==pending[path] && age >= WATCH_SETTLE_TIME) {
+            pending.remove(path);
+            running.insert(path);
+            emit fileReady(path);
+        }
+        else
+            pending[path] = fi.size();
+    }
+    if (pending.isEmpty())
+        poll_timer->stop();
+}
+
+// Failed files are saved separately, so that a corrupt file is not tried again
+// and again, but it is tried if modified (the key changes).
+// The watcher is deleted before the pipeline is stopped, so jobs discarded
+// while closing never reach here, and are processed again after restart.
+void
+FolderWatcher:: onFileFinished(bool success, QString filename)
+{
+    if (not running.remove(filename))
+        return;
+    QString key = journalKey(filename);
+    if (success)
+        journal.insert(key);
+    else
+        failed.insert(key);
+    writeJournal(success ? "done" : "failed", key);
+}
+
+void
+FolderWatcher:: writeJournal(QString status, QString key)
+{
+    QFile file(journal_path);
+    if (file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        file.write((status + "\t" + key + "\n").toUtf8());
+        file.close();
+    }
+}
+
+CompressJob:: CompressJob(QString file_name, QString out_dir,
+                            int short_edge_len, int long_edge_len)
 {
     filename = file_name;
     dst_dir = out_dir;
@@ -317,57 +688,336 @@ CompressTask:: CompressTask(QString file_name, QString out_dir,
     long_edge = long_edge_len;
 }
 
-/* Actually we dont do any compression. As mobile and digital cameras
-   save photos unoptimized, so if we load and save photos with default
-   quality, file size is greatly reduced (becomes 1/3 or 1/4 of original).
-*/
-void
-CompressTask:: run()
+// size of image after resize()
+QSize
+CompressJob:: outputSize(QSize size)
 {
-    QImage img = loadImage(filename);
-    if (img.isNull()) {// failed
-        emit compressFinished(false);
-        return;
-    }
-    if (short_edge | long_edge) {// need to resize
+    if (short_edge | long_edge) {
         int w = short_edge;// portrait
         int h = long_edge;
-        if (img.width()>img.height()) {// landscape
+        if (size.width()>size.height()) {// landscape
             w = long_edge;
             h = short_edge;
         }
         if (w && !h){
-            h = w * img.height()/img.width();
+            h = w * size.height()/size.width();
         }
         else if (h && !w) {
-            w = h * img.width()/img.height();
+            w = h * size.width()/size.height();
         }
         // to prevent quality loss, dont resize if source image is not
         // 20% larger than result image
-        if (img.width()*img.height() > 1.2*w*h)
-            img = img.scaled(w, h, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        if (size.width()*size.height() > 1.2*w*h)
+            return size.scaled(w, h, Qt::KeepAspectRatio);
+    }
+    return size;
+}
+
+// read orientation and image size from file header, and estimate peak memory
+// usage of this job. runs in I/O worker
+bool
+CompressJob:: readHeader()
+{
+    FILE *f = qfopen(filename, "rb");
+    if (!f)
+        return false;
+    orientation = getOrientation(f);
+    JpegInfo info;
+    bool is_jpeg = jpeg_read_info(f, info);
+    fclose(f);
+    orig_size = QFileInfo(filename).size();
+    if (lossless) {
+        if (not is_jpeg)
+            return false;
+        // file is copied if it is already progressive with optimized huffman tables
+        pass_through = info.progressive && info.optimized_huffman;
+        pixels = info.width*info.height;
+        // writing exif does not keep old thumbnail, so a new one is created
+        need_thumbnail = pixels >= 1000000 && (!pass_through || !info.has_thumbnail);
+        // input, output, and DCT coefficients (2 bytes each) of all components
+        memory = pass_through ? 0 : 2*orig_size + 2LL*info.components*pixels;
+        if (need_thumbnail)
+            memory += orig_size + 4LL*pixels/64;
+        return true;
+    }
+    QSize size = is_jpeg ? QSize(info.width, info.height) : QImageReader(filename).size();
+    if (not size.isValid()) {
+        // most photos are compressed less than 1:10
+        memory = 2*10*orig_size;
+        return true;
+    }
+    if (orientation==6 || orientation==8)
+        size.transpose();
+    out_size = outputSize(size);
+    // re-encoding a photo which is already compressed at or below the quality
+    // we save with, does not reduce size much, but loses quality. with target
+    // SSIM, the quality is not known before encoding, so it is not compared.
+    pass_through = is_jpeg && out_size==size && target_ssim<=0 && info.quality>0 &&
+                    info.quality<=DEFAULT_JPEG_QUALITY && (info.subsampled || info.components==1);
+    if (pass_through) {
+        // only the thumbnail is decoded, at 1/8 scale
+        need_thumbnail = !info.has_thumbnail && size.width()*size.height() >= 1000000;
+        QSize thumb_size = scaledDecodeSize(size, size.scaled(160, 160, Qt::KeepAspectRatio));
+        memory = need_thumbnail ? orig_size + 4LL*thumb_size.width()*thumb_size.height() : 0;
+        return true;
+    }
+    // image is decoded at reduced scale if possible
+    size = scaledDecodeSize(size, out_size);
+    qint64 src = 4LL*size.width()*size.height();
+    qint64 dst = 4LL*out_size.width()*out_size.height();
+    // file content and decoded image, then decoded and rotated or resized image
+    memory = qMax(orig_size + src, src + dst);
+    if (orientation==3 || orientation==6 || orientation==8)
+        memory = qMax(memory, 2*src);
+    return true;
+}
+
+// read the file content, runs in I/O worker
+bool
+CompressJob:: read()
+{
+    QFile file(filename);
+    if (not file.open(QIODevice::ReadOnly))
+        return false;
+    data = file.readAll();
+    file.close();
+    orig_size = data.size();
+    return orig_size > 0;
+}
+
+// when image will be downsized, jpeg is decoded by libjpeg at 1/2, 1/4 or 1/8
+// scale, which is much faster and takes less memory
+bool
+CompressJob:: decode()
+{
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer);
+    QSize size = reader.size();
+    if (size.isValid()) {
+        if (orientation==6 || orientation==8)
+            size.transpose();
+        out_size = outputSize(size);
+        QSize decode_size = scaledDecodeSize(size, out_size);
+        if (decode_size != size && reader.supportsOption(QImageIOHandler::ScaledSize)) {
+            if (orientation==6 || orientation==8)
+                decode_size.transpose();// size before rotation
+            reader.setScaledSize(decode_size);
+        }
+    }
+    image = reader.read();
+    buffer.close();
+    data.clear();// free memory
+    if (image.isNull())
+        return false;
+    image = orientImage(image, orientation);
+    if (not size.isValid())
+        out_size = outputSize(image.size());
+    return true;
+}
+
+// final resample of the decoded image to output size
+void
+CompressJob:: resize()
+{
+    if (image.size() != out_size)
+        image = image.scaled(out_size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+}
+
+// recommended thumbnail resolution is 160x120, also used by filemanager
+static QByteArray encodeThumbnail(QImage img)
+{
+    QImage thumb = img.width()>img.height() ? img.scaledToWidth(160) : img.scaledToHeight(160);
+    QByteArray data;
+    QBuffer buff(&data);
+    buff.open(QIODevice::WriteOnly);
+    thumb.save(&buff, "JPEG");
+    buff.close();
+    return data;
+}
+
+// luminance of image, as a float plane
+static std::vector<float> getLuma(QImage img)
+{
+    int w = img.width(), h = img.height();
+    std::vector<float> luma(w*h);
+    for (int y=0; y<h; y++) {
+        const QRgb *row = (const QRgb*) img.constScanLine(y);
+        float *out = luma.data() + y*w;
+        for (int x=0; x<w; x++)
+            out[x] = 0.299f*qRed(row[x]) + 0.587f*qGreen(row[x]) + 0.114f*qBlue(row[x]);
+    }
+    return luma;
+}
+
+// mean SSIM of two luma planes, over 8x8 windows moved by 4 pixels
+static float calcSSIM(const float *a, const float *b, int w, int h)
+{
+    const float C1 = 6.5025f, C2 = 58.5225f;// (0.01*255)^2, (0.03*255)^2
+    double sum = 0;
+    int count = 0;
+    for (int by=0; by+8<=h; by+=4) {
+        for (int bx=0; bx+8<=w; bx+=4) {
+            float sa=0, sb=0, saa=0, sbb=0, sab=0;
+            for (int y=0; y<8; y++) {
+                const float *pa = a + (by+y)*w + bx;
+                const float *pb = b + (by+y)*w + bx;
+                for (int x=0; x<8; x++) {
+                    sa += pa[x];
+                    sb += pb[x];
+                    saa += pa[x]*pa[x];
+                    sbb += pb[x]*pb[x];
+                    sab += pa[x]*pb[x];
+                }
+            }
+            float ma = sa/64, mb = sb/64;
+            float va = saa/64 - ma*ma, vb = sbb/64 - mb*mb, cov = sab/64 - ma*mb;
+            sum += ((2*ma*mb + C1)*(2*cov + C2)) / ((ma*ma + mb*mb + C1)*(va + vb + C2));
+            count++;
+        }
     }
+    return count ? sum/count : 1.0;
+}
+
+// Binary search the lowest quality at which SSIM is not below target.
+// SSIM is calculated on a few tiles of image, instead of whole image. Tiles
+// keep the texture of image unchanged, which downscaling would not.
+int
+CompressJob:: searchQuality()
+{
+    QImage proxy;
+    int tile = SSIM_TILE_SIZE, n = SSIM_TILE_COUNT;
+    if (image.width() <= tile*n || image.height() <= tile*n)
+        proxy = image.convertToFormat(QImage::Format_RGB32);
+    else {
+        proxy = QImage(tile*n, tile*n, QImage::Format_RGB32);
+        QPainter painter(&proxy);
+        for (int j=0; j<n; j++) {
+            for (int i=0; i<n; i++) {
+                // evenly spaced tiles, aligned to jpeg MCU
+                int x = ((image.width()-tile)*i/(n-1)) & ~15;
+                int y = ((image.height()-tile)*j/(n-1)) & ~15;
+                painter.drawImage(i*tile, j*tile, image, x, y, tile, tile);
+            }
+        }
+        painter.end();
+    }
+    std::vector<float> ref = getLuma(proxy);
+    int lo = SSIM_MIN_QUALITY, hi = SSIM_MAX_QUALITY;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        QByteArray encoded;
+        QBuffer buff(&encoded);
+        buff.open(QIODevice::WriteOnly);
+        proxy.save(&buff, "JPEG", mid);
+        buff.close();
+        QImage decoded = QImage::fromData(encoded, "JPEG").convertToFormat(QImage::Format_RGB32);
+        std::vector<float> luma = getLuma(decoded);
+        if (calcSSIM(ref.data(), luma.data(), proxy.width(), proxy.height()) >= target_ssim)
+            hi = mid;
+        else
+            lo = mid+1;
+    }
+    return hi;
+}
+
+/* Actually we dont do any compression. As mobile and digital cameras
+   save photos unoptimized, so if we load and save photos with default
+   quality, file size is greatly reduced (becomes 1/3 or 1/4 of original).
+*/
+bool
+CompressJob:: encode()
+{
+    pixels = image.width()*image.height();
+    int quality = target_ssim > 0 ? searchQuality() : -1;
+    QBuffer buff(&data);
+    buff.open(QIODevice::WriteOnly);
+    bool ok = image.save(&buff, "JPEG", quality);
+    buff.close();
+    if (ok && pixels >= 1000000)
+        thumbnail = encodeThumbnail(image);
+    image = QImage();// free memory
+    return ok;
+}
+
+// decode the photo at reduced scale and create a thumbnail of it
+bool
+CompressJob:: makeThumbnail()
+{
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer);
+    QSize size = reader.size();
+    if (size.isValid() && reader.supportsOption(QImageIOHandler::ScaledSize))
+        reader.setScaledSize(scaledDecodeSize(size, size.scaled(160, 160, Qt::KeepAspectRatio)));
+    QImage img = reader.read();
+    buffer.close();
+    if (img.isNull())
+        return false;
+    thumbnail = encodeThumbnail(orientImage(img, orientation));
+    return true;
+}
+
+// rewrite entropy coding from DCT coefficients, without decoding pixels
+bool
+CompressJob:: optimize()
+{
+    if (need_thumbnail && not makeThumbnail())
+        return false;
+    QByteArray out;
+    if (not optimizeJpegLossless(data, out, true))
+        return false;
+    data = out;
+    return true;
+}
+
+// save encoded jpeg with exif, runs in I/O worker
+bool
+CompressJob:: write()
+{
     QString out_filename = dst_dir + "/" + QFileInfo(filename).fileName();
     QString tmp_name = out_filename + ".txt";
-    bool ok = saveJpegWithExif(img, -1, tmp_name, filename);
+    if (pass_through)
+        return copyJpeg(filename, out_filename, tmp_name, thumbnail);
+    bool ok = saveJpegWithExif(data, thumbnail, pixels, tmp_name, filename, !lossless);
     if (ok) {
-        if (QFileInfo(out_filename).exists())// copy/move fails if file already exists
-            QFile(out_filename).remove();
-        if (QFileInfo(tmp_name).size()<QFileInfo(filename).size()) {
+        if (QFileInfo(tmp_name).size()<orig_size) {
+            if (QFileInfo(out_filename).exists())// copy/move fails if file already exists
+                QFile(out_filename).remove();
             QFile(tmp_name).rename(out_filename);
         }
         else {// already compressed, add a thumbnail so filemanager can display very fast
-            if (img.width()*img.height() >= 1000000) {
-                QImage thumb = img.width()>img.height() ? img.scaledToWidth(160) : img.scaledToHeight(160);
-                img = QImage();// free memory
-                ok = add_thumbnail_to_jpg(thumb, filename, out_filename);
-            }
-            else QFile(filename).copy(out_filename);
+            QFile(tmp_name).remove();
+            ok = copyJpeg(filename, out_filename, tmp_name, thumbnail);
         }
         if (QFileInfo(tmp_name).exists())
             QFile(tmp_name).remove();
     }
-    emit compressFinished(ok);
+    return ok;
+}
+
+// copy jpeg to out_filename, with thumbnail added if it is not empty.
+// target folder may be the source folder, then out_filename is the input
+// file itself, so it must not be removed before it is read.
+static bool
+copyJpeg(QString filename, QString out_filename, QString tmp_name, QByteArray thumbnail)
+{
+    if (thumbnail.isEmpty()) {
+        if (QFileInfo(filename).canonicalFilePath()==QFileInfo(out_filename).canonicalFilePath())
+            return true;// nothing to change
+        if (QFileInfo(out_filename).exists())
+            QFile(out_filename).remove();
+        return QFile(filename).copy(out_filename);
+    }
+    bool ok = add_thumbnail_to_jpg(thumbnail, filename, tmp_name);
+    if (ok) {
+        if (QFileInfo(out_filename).exists())
+            QFile(out_filename).remove();
+        ok = QFile(tmp_name).rename(out_filename);
+    }
+    if (QFileInfo(tmp_name).exists())
+        QFile(tmp_name).remove();
+    return ok;
 }
 
 
@@ -390,20 +1040,14 @@ FILE* qfopen(QString filename, const char *mode)
     return f;
 }
 
-// load an image from file
-QImage loadImage(QString fileName)
+// rotate image according to jpg orientation
+QImage orientImage(QImage img, int orientation)
 {
-    QImage img(fileName);
-    if (img.isNull()) return img;
     // Converted because filters can only be applied to RGB32 or ARGB32 image
     if (img.hasAlphaChannel() && img.format()!=QImage::Format_ARGB32)
         img = img.convertToFormat(QImage::Format_ARGB32);
     else if (!img.hasAlphaChannel() and img.format()!=QImage::Format_RGB32)
         img = img.convertToFormat(QImage::Format_RGB32);
-    // Get jpg orientation
-    FILE *f = qfopen(fileName, "rb");
-    int orientation = getOrientation(f);
-    fclose(f);
     // rotate if required
     QTransform transform;
     switch (orientation) {
@@ -417,55 +1061,126 @@ QImage loadImage(QString fileName)
     return img;
 }
 
+// the largest of 1/1, 1/2, 1/4 and 1/8 scaled size, which is not smaller than target
+QSize scaledDecodeSize(QSize size, QSize target)
+{
+    int denom = 1;
+    while (denom < 8 && size.width()/(2*denom) >= target.width()
+                    && size.height()/(2*denom) >= target.height())
+        denom *= 2;
+    return QSize((size.width()+denom-1)/denom, (size.height()+denom-1)/denom);
+}
+
+static bool writeFile(QString filename, QByteArray data)
+{
+    QFile file(filename);
+    if (not file.open(QIODevice::WriteOnly))
+        return false;
+    bool ok = file.write(data)==data.size();
+    file.close();
+    return ok;
+}
 
-bool saveJpegWithExif(QImage img, int quality, QString out_filename, QString exif_filename)
+// write encoded jpeg, with exif of exif_filename and the encoded thumbnail.
+// if image was not rotated according to exif orientation, orientation is kept
+bool saveJpegWithExif(QByteArray jpg, QByteArray thumbnail, int pixels,
+                        QString out_filename, QString exif_filename, bool rotated)
 {
     // image too small, do not add thumbnail
-    if (img.width()*img.height()<300000)
-        return img.save(out_filename, "JPEG", quality);
+    if (pixels<300000 && rotated)
+        return writeFile(out_filename, jpg);
 
     FILE *infile = qfopen(exif_filename, "r");
     if (!infile)
-        return img.save(out_filename, "JPEG", quality);
+        return writeFile(out_filename, jpg);
     ExifInfo exif;
     exif_read(exif, infile);
-    if (exif.count(0x0112)>0) {//fix Tag_Orientation
+    if (rotated && exif.count(0x0112)>0) {//fix Tag_Orientation
         exif[0x0112].integer = 1;
     }
     fclose(infile);
     // if image is >1M, even if exif empty, we add exif to add thumbnail
-    if (exif.empty() && (img.width()*img.height()<1000000))
-        return img.save(out_filename, "JPEG", quality);
+    if (exif.empty() && thumbnail.isEmpty())
+        return writeFile(out_filename, jpg);
 
     FILE *out = qfopen(out_filename, "w");
     if (!out) {
         exif_free(exif);
         return false;
     }
-    QBuffer buff;
-    buff.open(QIODevice::WriteOnly);
-    img.save(&buff, "JPEG", quality);
-    bool ok;
-    if (img.width()*img.height()>=1000000){// add a thumbnail
-        QBuffer thumb_buff;
-        thumb_buff.open(QIODevice::WriteOnly);
-        // recommended thumbnail resolution is 160x120
-        QImage thumb = img.width()>img.height() ? img.scaledToWidth(160) : img.scaledToHeight(160);
-        thumb.save(&thumb_buff, "JPEG");
-        ok = write_jpeg_with_exif(buff.buffer().data(), buff.size(),
-                                thumb_buff.buffer().data(), thumb_buff.size(), exif, out);
-        thumb_buff.buffer().clear();
-    }
-    else {
-        ok = write_jpeg_with_exif(buff.buffer().data(), buff.size(), NULL, 0, exif, out);
-    }
+    bool ok = write_jpeg_with_exif(jpg.data(), jpg.size(),
+                    thumbnail.isEmpty() ? NULL : thumbnail.data(), thumbnail.size(), exif, out);
     fclose(out);
-    buff.buffer().clear();
     exif_free(exif);
     return ok;
 }
 
-bool add_thumbnail_to_jpg(QImage thumbnail, QString filename, QString out_filename)
+// libjpeg calls exit() on error by default, we jump back instead
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+    // kept here, so that these are valid after longjmp()
+    unsigned char *buffer;
+    unsigned long size;
+} JpegContext;
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+    JpegContext *ctx = (JpegContext*) cinfo->err;
+    longjmp(ctx->setjmp_buffer, 1);
+}
+
+static void jpegOutputMessage(j_common_ptr) {}
+
+// Transcode jpeg using optimized huffman tables, and progressive scans if required.
+// DCT coefficients are copied, so this is lossless. ICC profile (App2) is copied,
+// other markers are not, as exif is added later by write_jpeg_with_exif().
+bool optimizeJpegLossless(const QByteArray &jpg, QByteArray &out, bool progressive)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    JpegContext ctx;
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    ctx.buffer = NULL;
+    ctx.size = 0;
+    src.err = jpeg_std_error(&ctx.pub);
+    dst.err = &ctx.pub;
+    ctx.pub.error_exit = jpegErrorExit;
+    ctx.pub.output_message = jpegOutputMessage;
+    if (setjmp(ctx.setjmp_buffer)) {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        free(ctx.buffer);
+        return false;
+    }
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    jpeg_mem_src(&src, (unsigned char*)jpg.constData(), jpg.size());
+    jpeg_save_markers(&src, JPEG_APP0+2, 0xffff);
+    jpeg_read_header(&src, TRUE);
+    jvirt_barray_ptr *coefs = jpeg_read_coefficients(&src);
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.optimize_coding = TRUE;
+    if (progressive)
+        jpeg_simple_progression(&dst);
+    jpeg_mem_dest(&dst, &ctx.buffer, &ctx.size);
+    jpeg_write_coefficients(&dst, coefs);
+    // written after JFIF App0, so these are kept by write_jpeg_with_exif(),
+    // which only replaces App0 and App1 segments at the beginning
+    for (jpeg_saved_marker_ptr m=src.marker_list; m!=NULL; m=m->next) {
+        jpeg_write_marker(&dst, m->marker, m->data, m->data_length);
+    }
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+    out = QByteArray((const char*)ctx.buffer, ctx.size);
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+    free(ctx.buffer);
+    return true;
+}
+
+bool add_thumbnail_to_jpg(QByteArray thumbnail, QString filename, QString out_filename)
 {
     // read exif from infile
     FILE *infile = qfopen(filename, "r");
@@ -480,18 +1195,13 @@ bool add_thumbnail_to_jpg(QImage thumbnail, QString filename, QString out_filena
     if (!out) {
         return false;
     }
-    // create thumbnail
-    QBuffer thumb_buff;
-    thumb_buff.open(QIODevice::WriteOnly);
-    thumbnail.save(&thumb_buff, "JPEG");
     // read main image
     QFile file(filename);
     file.open(QIODevice::ReadOnly);
     QByteArray bArr = file.readAll();
     file.close();
     bool ok = write_jpeg_with_exif(bArr.data(), bArr.size(),
-                            thumb_buff.buffer().data(), thumb_buff.size(), exif, out);
-    thumb_buff.buffer().clear();
+                            thumbnail.data(), thumbnail.size(), exif, out);
     bArr.clear();
     fclose(out);
     exif_free(exif);
@@ -508,5 +1218,6 @@ QString ToolPlugin:: menuItem()
 void ToolPlugin:: onMenuClick()
 {
     PhotoOptimizerDialog *dialog = new PhotoOptimizerDialog(data->window);
+    dialog->setAttribute(Qt::WA_DeleteOnClose);
     dialog->exec();
 }
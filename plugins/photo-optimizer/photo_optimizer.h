@@ -5,7 +5,18 @@
 #include <QLineEdit>
 #include <QComboBox>
 #include <QCheckBox>
+#include <QSpinBox>
+#include <QDoubleSpinBox>
 #include <QRunnable>
+#include <QThreadPool>
+#include <QQueue>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QFileSystemWatcher>
+#include <QTimer>
+#include <QSet>
+#include <QMap>
+#include <atomic>
 
 
 class ToolPlugin : public QObject, Plugin
@@ -29,6 +40,9 @@ signals:
 };
 
 
+class CompressPipeline;
+class FolderWatcher;
+
 class PhotoOptimizerDialog : public QDialog
 {
     Q_OBJECT
@@ -42,6 +56,11 @@ public:
     QCheckBox *checkResolution;
     QLineEdit *shortEdgeEdit;
     QLineEdit *longEdgeEdit;
+    QSpinBox *memoryLimitSpin;
+    QCheckBox *checkLossless;
+    QCheckBox *checkWatch;
+    QCheckBox *checkSsim;
+    QDoubleSpinBox *ssimSpin;
     QLabel *statusbar;
     QPushButton *closeBtn;
     QPushButton *optimizeBtn;
@@ -49,11 +68,13 @@ public:
     int short_edge;
     int long_edge;
     QStringList selected_files;
+    QString source_dir;
     QString target_dir;
-    int task_index;
     int finished_count;
     int failed_count;
     bool cancel = false;
+    CompressPipeline *pipeline = NULL;
+    FolderWatcher *watcher = NULL;
 
     PhotoOptimizerDialog(QWidget *parent);
     void dragEnterEvent(QDragEnterEvent *ev);
@@ -69,19 +90,203 @@ public slots:
     void chooseTargetDir();
     void optimize();
     void onCompressFinish(bool success);
+    void onPipelineFinish();
+    void onFileReady(QString filename);
 };
 
-class CompressTask : public QObject, public QRunnable
+// a queue between two stages of pipeline. push() blocks while it is full,
+// so that a fast stage can not fill the memory with its output
+template <typename T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(int capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        QMutexLocker locker(&mutex);
+        while (queue.count() >= capacity && !closed)
+            not_full.wait(&mutex);
+        queue.enqueue(item);
+        not_empty.wakeOne();
+    }
+    // returns false when queue is closed and empty
+    bool pop(T &item) {
+        QMutexLocker locker(&mutex);
+        while (queue.isEmpty() && !closed)
+            not_empty.wait(&mutex);
+        if (queue.isEmpty())
+            return false;
+        item = queue.dequeue();
+        not_full.wakeOne();
+        return true;
+    }
+    // called when no more items will be pushed
+    void close() {
+        QMutexLocker locker(&mutex);
+        closed = true;
+        not_empty.wakeAll();
+        not_full.wakeAll();
+    }
+private:
+    QQueue<T> queue;
+    QMutex mutex;
+    QWaitCondition not_empty, not_full;
+    int capacity;
+    bool closed = false;
+};
+
+// Limits the total estimated memory of the jobs being processed.
+// A job larger than the limit is admitted only when no other job is running.
+class MemoryBudget
+{
+public:
+    MemoryBudget(qint64 limit) : limit(limit) {}
+
+    void acquire(qint64 bytes) {
+        QMutexLocker locker(&mutex);
+        while (used > 0 && used + bytes > limit)
+            released.wait(&mutex);
+        used += bytes;
+    }
+    void release(qint64 bytes) {
+        QMutexLocker locker(&mutex);
+        used -= bytes;
+        released.wakeAll();
+    }
+private:
+    QMutex mutex;
+    QWaitCondition released;
+    qint64 limit;
+    qint64 used = 0;
+};
+
+// Qt saves jpeg with this quality, when quality is -1
+#define DEFAULT_JPEG_QUALITY 75
+
+// range of quality searched for target SSIM
+#define SSIM_MIN_QUALITY 30
+#define SSIM_MAX_QUALITY 95
+// size and count of tiles in each direction, used to calculate SSIM
+#define SSIM_TILE_SIZE 256
+#define SSIM_TILE_COUNT 3
+
+// a photo passing through the stages of CompressPipeline
+class CompressJob
 {
-    Q_OBJECT
 public:
     QString filename;
     QString dst_dir;
     int short_edge;
     int long_edge;
+    bool lossless = false;  // only re-optimize entropy coding, pixels are unchanged
+    float target_ssim = 0;  // if > 0, the lowest quality that gives this SSIM is used
+    int orientation = 0;
+    QByteArray data;        // file content, replaced by encoded jpeg
+    QByteArray thumbnail;   // encoded thumbnail, if image is >= 1M
+    QImage image;
+    QSize out_size;         // size of image after resize()
+    int pixels = 0;         // width*height of output image
+    qint64 orig_size = 0;
+    qint64 memory = 0;      // estimated peak memory usage
+    // already compressed photo, which is copied without decoding
+    bool pass_through = false;
+    bool need_thumbnail = false;
+
+    CompressJob(QString filename, QString dst_dir, int short_edge, int long_edge);
+    QSize outputSize(QSize size);
+    bool readHeader();
+    bool read();
+    bool decode();
+    void resize();
+    int searchQuality();
+    bool encode();
+    bool makeThumbnail();
+    bool optimize();
+    bool write();
+};
+
+// Photos are read by I/O workers, decoded, resized and encoded by CPU workers,
+// then written by I/O workers. The stages are connected by bounded queues, so
+// that disk and cores are busy at the same time.
+class CompressPipeline : public QObject
+{
+    Q_OBJECT
+public:
+    QStringList files;
+    QString dst_dir;
+    int short_edge;
+    int long_edge;
+    int io_threads;
+    int cpu_threads;
+    qint64 memory_limit;
+    bool lossless;
+    float target_ssim;
+    bool watch;     // keep running, and accept files by addFile() until stop()
+    BoundedQueue<QString> *file_queue;
+    std::atomic<int> readers_running, encoders_running, writers_running;
+    std::atomic<bool> cancel;
+    BoundedQueue<CompressJob*> *decode_queue, *write_queue;
+    MemoryBudget *budget;
+    QThreadPool *pool;
+
+    CompressPipeline(QStringList files, QString dst_dir, int short_edge, int long_edge);
+    ~CompressPipeline();
+    void start();
+    void stop();
+    void addFile(QString filename);
+    void readLoop();
+    void encodeLoop();
+    void writeLoop();
+    void finishJob(CompressJob *job, bool success);
+signals:
+    void compressFinished(bool success, QString filename);
+    void finished();
+};
+
+// runs one of the loops of CompressPipeline in its thread pool
+class PipelineWorker : public QRunnable
+{
+public:
+    CompressPipeline *pipeline;
+    void (CompressPipeline::*loop)();
+    PipelineWorker(CompressPipeline *pipeline, void (CompressPipeline::*loop)()) :
+                                        pipeline(pipeline), loop(loop) {}
+    void run() { (pipeline->*loop)(); }
+};
 
-    CompressTask(QString filename, QString dst_dir, int short_edge, int long_edge);
-    void run();
+// time in ms between checks of file size, while a file is being copied
+#define WATCH_POLL_INTERVAL 1000
+// a file is ready when it is not modified for this time (ms)
+#define WATCH_SETTLE_TIME 2000
+// whole folder is scanned periodically, because network shares may not
+// notify changes
+#define WATCH_RESCAN_INTERVAL 30000
+#define WATCH_JOURNAL_NAME ".photo-optimizer-journal"
+
+// Watches a folder for new photos, and emits fileReady() when a file stops
+// growing. Compressed files are saved in a journal in output folder, so that
+// those are not processed again after restart. Failed files are saved as
+// failed, and are tried again only if the file is modified.
+class FolderWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    QString dir;
+    QString journal_path;
+    QFileSystemWatcher *watcher;
+    QTimer *poll_timer, *rescan_timer;
+    QSet<QString> journal;          // keys of compressed files
+    QSet<QString> failed;           // keys of files which could not be compressed
+    QMap<QString, qint64> pending;  // files being copied, and their last size
+    QSet<QString> running;          // files sent to pipeline
+
+    FolderWatcher(QString dir, QString out_dir, QObject *parent);
+    QString journalKey(QString filename);
+    void writeJournal(QString status, QString key);
+public slots:
+    void scan();
+    void checkPending();
+    void onFileFinished(bool success, QString filename);
 signals:
-    void compressFinished(bool success);
+    void fileReady(QString filename);
 };
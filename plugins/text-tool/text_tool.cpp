@@ -106,22 +106,28 @@ TextToolDialog:: scaleBy(float scale)
 {
     this->scale = scale;
     if (scale == 1.0)
-        image_scaled = image;
+        canvas->setImage(image);
     else {
         Qt::TransformationMode tfm_mode = scale<1.0? Qt::SmoothTransformation: Qt::FastTransformation;
-        image_scaled = image.scaled(scale*image.width(), scale*image.height(),
-                        Qt::IgnoreAspectRatio, tfm_mode);
+        canvas->setImage(image.scaled(scale*image.width(), scale*image.height(),
+                        Qt::IgnoreAspectRatio, tfm_mode));
     }
     redraw();
 }
 
+// draw textboxes on overlay layer, only within area if it is given
 void
-TextToolDialog:: redraw()
+TextToolDialog:: redraw(QRect area)
 {
-    QPixmap pm = QPixmap::fromImage(image_scaled).copy();
+    if (area.isNull())
+        area = canvas->overlay.rect();
+    painter.begin(&canvas->overlay);
+    painter.setClipRect(area);
+    painter.setCompositionMode(QPainter::CompositionMode_Clear);
+    painter.fillRect(area, Qt::transparent);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
     for (int i=0; i<textboxes.count(); i++) {
         TextBox &textbox = textboxes[i];
-        painter.begin(&pm);
         drawTextBox(painter, textbox, true);
         if (i == textbox_entered) {
             painter.drawImage(textbox.rect.bottomRight()-QPoint(15,15), drag_icon);
@@ -132,9 +138,9 @@ TextToolDialog:: redraw()
             painter.setBrush(Qt::NoBrush);
             painter.drawRect(textbox.rect);
         }
-        painter.end();
     }
-    canvas->setPixmap(pm);
+    painter.end();
+    canvas->updateArea(area);
 }
 
 void
@@ -157,7 +163,6 @@ TextToolDialog:: onMousePress(QPoint pos)
     mouse_pressed = true;
 
     if (new_textbox){
-        canvas_copy = canvas->pixmap()->copy();
         tmp_textbox.rect = QRect(pos,pos);
         return;
     }
@@ -189,8 +194,9 @@ TextToolDialog:: onMouseRelease(QPoint /*pos*/)
             tmp_textbox.rect.setHeight(tmp_textbox.font_size*2);
         }
         canvas->unsetCursor();
-        canvas_copy = QPixmap();// frees memory
+        canvas->clearBrush();
         textboxes.append(tmp_textbox);
+        redraw();
         deleteTextboxBtn->setEnabled(true);
         new_textbox = false;
         plainTextEdit->clear();
@@ -227,21 +233,20 @@ TextToolDialog:: onMouseMove(QPoint pos)
     }
     if (new_textbox) {
         tmp_textbox.rect = QRect(click_pos, pos).normalized();
-        QPixmap pm = canvas_copy.copy();
-        painter.begin(&pm);
+        canvas->clearBrush();
+        painter.begin(&canvas->brush);
         drawTextBox(painter, tmp_textbox, true);
         painter.end();
-        canvas->setPixmap(pm);
+        canvas->updateBrushArea(tmp_textbox.rect.adjusted(-1,-1,2,2));
     }
-    else {
-        if (click_mode==MODE_MOVE) {
+    else if (click_mode!=MODE_NONE) {
+        // only the area covered by old and new position is drawn again
+        QRect old_rect = textboxes.last().rect;
+        if (click_mode==MODE_MOVE)
             textboxes.last().rect.translate(pos-old_pos);
-            redraw();
-        }
-        else if (click_mode==MODE_RESIZE){
+        else
             textboxes.last().rect.adjust(0,0, pos.x()-old_pos.x(), pos.y()-old_pos.y());
-            redraw();
-        }
+        redraw((old_rect | textboxes.last().rect).adjusted(-2,-2,3,3));
     }
 end:
     old_pos = pos;
@@ -363,27 +368,113 @@ TextToolDialog:: keyPressEvent(QKeyEvent *ev)
 
 
 // ******************* Paint Canvas ******************
-PaintCanvas:: PaintCanvas(QWidget *parent) : QLabel(parent)
+PaintCanvas:: PaintCanvas(QWidget *parent) : QWidget(parent)
 {
     setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
     setMouseTracking(true);
+    // mouse moves are sent at most once per frame
+    frame_timer = new QTimer(this);
+    frame_timer->setSingleShot(true);
+    frame_timer->setInterval(16);
+    connect(frame_timer, SIGNAL(timeout()), this, SLOT(onFrameTimeout()));
+}
+
+void
+PaintCanvas:: setImage(QImage img)
+{
+    base = img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    if (overlay.size() != base.size()) {
+        overlay = QImage(base.size(), QImage::Format_ARGB32_Premultiplied);
+        overlay.fill(0);
+        brush = QImage(base.size(), QImage::Format_ARGB32_Premultiplied);
+        brush.fill(0);
+        brush_rect = QRect();
+        setFixedSize(base.size());
+    }
+    update();
+}
+
+void
+PaintCanvas:: clearBrush()
+{
+    if (brush_rect.isEmpty())
+        return;
+    QPainter painter(&brush);
+    painter.setCompositionMode(QPainter::CompositionMode_Clear);
+    painter.fillRect(brush_rect, Qt::transparent);
+    painter.end();
+    update(brush_rect);
+    brush_rect = QRect();
+}
+
+void
+PaintCanvas:: updateArea(QRect rect)
+{
+    update(rect);
+}
+
+void
+PaintCanvas:: updateBrushArea(QRect rect)
+{
+    rect &= brush.rect();
+    brush_rect |= rect;
+    update(rect);
+}
+
+void
+PaintCanvas:: paintEvent(QPaintEvent *ev)
+{
+    QRect rect = ev->rect() & base.rect();
+    if (rect.isEmpty())
+        return;
+    QPainter painter(this);
+    painter.drawImage(rect.topLeft(), base, rect);
+    painter.drawImage(rect.topLeft(), overlay, rect);
+    rect &= brush_rect;
+    if (not rect.isEmpty())
+        painter.drawImage(rect.topLeft(), brush, rect);
+}
+
+void
+PaintCanvas:: flushMouseMove()
+{
+    if (move_pending) {
+        move_pending = false;
+        emit mouseMoved(move_pos);
+    }
+}
+
+void
+PaintCanvas:: onFrameTimeout()
+{
+    if (not move_pending)
+        return;
+    flushMouseMove();
+    frame_timer->start();
 }
 
 void
 PaintCanvas:: mousePressEvent(QMouseEvent *ev)
 {
+    flushMouseMove();
     emit mousePressed(ev->pos());
 }
 
 void
 PaintCanvas:: mouseMoveEvent(QMouseEvent *ev)
 {
-    emit mouseMoved(ev->pos());
+    move_pos = ev->pos();
+    move_pending = true;
+    if (not frame_timer->isActive()) {
+        flushMouseMove();
+        frame_timer->start();
+    }
 }
 
 void
 PaintCanvas:: mouseReleaseEvent(QMouseEvent *ev)
 {
+    flushMouseMove();
     emit mouseReleased(ev->pos());
 }
 
@@ -3,6 +3,8 @@
 #include "ui_text_tool_dialog.h"
 #include <QPainter>
 #include <QMouseEvent>
+#include <QPaintEvent>
+#include <QTimer>
 #include <QSettings>
 
 class ToolPlugin : public QObject, Plugin
@@ -27,16 +29,34 @@ signals:
 
 
 
-// It is a drawing area
+// It is a drawing area, with base layer for image, overlay layer for
+// textboxes, and brush layer for the textbox being created.
+// only the area passed to updateArea() is repainted.
 
-class PaintCanvas : public QLabel
+class PaintCanvas : public QWidget
 {
     Q_OBJECT
 public:
     PaintCanvas(QWidget *parent);
+    QImage base;
+    QImage overlay; // ARGB32_Premultiplied
+    QImage brush;   // ARGB32_Premultiplied
+    void setImage(QImage image);
+    void clearBrush();
+    void updateArea(QRect rect);
+    void updateBrushArea(QRect rect);
+    void paintEvent(QPaintEvent *ev);
     void mousePressEvent(QMouseEvent *ev);
     void mouseMoveEvent(QMouseEvent *ev);
     void mouseReleaseEvent(QMouseEvent *ev);
+private:
+    QRect brush_rect;   // area of brush layer drawn since last clear
+    QTimer *frame_timer;
+    bool move_pending = false;
+    QPoint move_pos;
+    void flushMouseMove();
+private slots:
+    void onFrameTimeout();
 signals:
     void mousePressed(QPoint);
     void mouseMoved(QPoint);
@@ -64,8 +84,6 @@ class TextToolDialog : public QDialog, public Ui_TextToolDialog
     Q_OBJECT
 public:
     QImage image; // original unchanged image
-    QImage image_scaled;
-    QPixmap canvas_copy;
     QImage drag_icon;
     QPainter painter;
     PaintCanvas *canvas;
@@ -84,7 +102,7 @@ public:
 
     TextToolDialog(QWidget *parent, QImage img);
     void scaleBy(float scale);
-    void redraw();
+    void redraw(QRect area=QRect());
     void updateCurrentTextbox();
     void keyPressEvent(QKeyEvent *ev);
     void accept();
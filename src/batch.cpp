@@ -0,0 +1,376 @@
+/* This file is a part of photoquick program, which is GPLv3 licensed */
+
+#include "batch.h"
+#include "main.h" // getNewFileName(), savePdf()
+#include "strip_stream.h"
+#include <QImageWriter>
+#include <QThread>
+#include <cstring>
+#include <omp.h>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+#include <QGuiApplication>
+#else
+#include <QApplication>
+#endif
+
+// name, minimum and maximum number of arguments of each operation
+typedef struct {
+    const char *name;
+    int min_args, max_args;
+    const char *help;
+} BatchOpInfo;
+
+static BatchOpInfo batch_ops[] = {
+    {"resize",      2, 2, "resize:W:H      resize to WxH, 0 for W or H keeps aspect ratio"},
+    {"crop",        4, 4, "crop:X:Y:W:H    crop the rectangle"},
+    {"rotate",      1, 1, "rotate:DEG      rotate clockwise by DEG degrees"},
+    {"mirror",      0, 0, "mirror          mirror horizontally"},
+    {"grayscale",   0, 0, "grayscale       convert to grayscale"},
+    {"blur",        1, 1, "blur:R          gaussian blur of radius R"},
+    {"box",         1, 1, "box:R           box blur of radius R"},
+    {"median",      1, 1, "median:R        median filter of radius R (remove dust)"},
+    {"sharpen",     0, 1, "sharpen[:F]     unsharp mask by factor F (default 1.0)"},
+    {"despeckle",   0, 0, "despeckle       remove speckle noise"},
+    {"threshold",   0, 1, "threshold[:T]   adaptive threshold of scanned page (default T=0.15)"},
+    {"contrast",    0, 0, "contrast        stretch contrast"},
+    {"whitebalance",0, 0, "whitebalance    auto white balance"},
+};
+
+#define BATCH_OP_COUNT (int)(sizeof(batch_ops)/sizeof(BatchOpInfo))
+
+static QMutex filename_mutex;
+// PdfDocument calls setlocale(), which is not thread safe
+static QMutex pdf_mutex;
+
+BatchConfig:: BatchConfig()
+{
+    format = "jpg";
+    quality = -1;
+    dpi = 0;
+    threads = QThread::idealThreadCount();
+}
+
+// pipeline is comma separated operations, arguments of an operation are
+// separated by colon, e.g "resize:1200:0,sharpen,threshold:0.1"
+bool
+BatchConfig:: parseOps(QString pipeline, QString &error)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+    QStringList items = pipeline.split(",", Qt::SkipEmptyParts);
+#else
+    QStringList items = pipeline.split(",", QString::SkipEmptyParts);
+#endif
+    foreach (QString item, items) {
+        QStringList words = item.trimmed().split(":");
+        BatchOp op;
+        op.name = words.takeFirst().toLower();
+        int i;
+        for (i=0; i<BATCH_OP_COUNT; i++) {
+            if (op.name==batch_ops[i].name)
+                break;
+        }
+        if (i==BATCH_OP_COUNT) {
+            error = "unknown operation \"" + op.name + "\"";
+            return false;
+        }
+        if (words.count() < batch_ops[i].min_args || words.count() > batch_ops[i].max_args) {
+            error = QString("wrong number of arguments for \"%1\"").arg(op.name);
+            return false;
+        }
+        foreach (QString word, words) {
+            bool ok;
+            op.args << word.toFloat(&ok);
+            if (not ok) {
+                error = "invalid number \"" + word + "\" in \"" + item + "\"";
+                return false;
+            }
+        }
+        ops << op;
+    }
+    return true;
+}
+
+
+BatchTask:: BatchTask(QString filename, BatchConfig *config, std::atomic<int> *failed)
+{
+    this->filename = filename;
+    this->config = config;
+    this->failed = failed;
+}
+
+bool
+BatchTask:: applyOp(QImage &img, BatchOp &op)
+{
+    if (op.name=="resize") {
+        int w = op.args[0], h = op.args[1];
+        if (w<=0 and h<=0) return false;
+        if (w<=0)
+            img = img.scaledToHeight(h, Qt::SmoothTransformation);
+        else if (h<=0)
+            img = img.scaledToWidth(w, Qt::SmoothTransformation);
+        else
+            img = img.scaled(w, h, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+    else if (op.name=="crop") {
+        QRect rect = QRect(op.args[0], op.args[1], op.args[2], op.args[3]).intersected(img.rect());
+        if (rect.isEmpty()) return false;
+        img = img.copy(rect);
+    }
+    else if (op.name=="rotate") {
+        float angle = op.args[0];
+        QTransform transform;
+        transform.rotate(angle);
+        bool right_angle = fmodf(angle, 90)==0;
+        img = img.transformed(transform, right_angle ? Qt::FastTransformation : Qt::SmoothTransformation);
+    }
+    else if (op.name=="mirror")
+        img = img.mirrored(true, false);
+    else if (op.name=="grayscale")
+        grayScale(img);
+    else if (op.name=="blur")
+        gaussianBlur(img, op.args[0]);
+    else if (op.name=="box")
+        boxFilter(img, op.args[0]);
+    else if (op.name=="median")
+        medianFilter(img, op.args[0]);
+    else if (op.name=="sharpen")
+        unsharpMask(img, op.args.isEmpty() ? 1.0 : op.args[0]);
+    else if (op.name=="despeckle")
+        despeckle(img);
+    else if (op.name=="threshold")
+        adaptiveThreshold(img, op.args.isEmpty() ? 0.15 : op.args[0]);
+    else if (op.name=="contrast")
+        stretchContrast(img);
+    else if (op.name=="whitebalance")
+        autoWhiteBalance(img);
+    return not img.isNull();
+}
+
+// returns a new output filename, or empty string on failure.
+// the name is reserved by creating the file, so that parallel tasks
+// do not choose same name
+QString
+BatchTask:: newOutputFile()
+{
+    QFileInfo fi(filename);
+    QString dir = config->out_dir.isEmpty() ? fi.dir().path() : config->out_dir;
+    QString path = dir + "/" + fi.completeBaseName() + "." + config->format;
+    filename_mutex.lock();
+    path = getNewFileName(path);
+    QFile file(path);
+    bool ok = file.open(QIODevice::WriteOnly);
+    file.close();
+    filename_mutex.unlock();
+    return ok ? path : QString();
+}
+
+bool
+BatchTask:: save(QImage img, QString path)
+{
+    bool ok;
+    if (config->format=="pdf") {
+        int dpi = config->dpi>0 ? config->dpi : 300;
+        pdf_mutex.lock();
+        savePdf(img, path, round(img.width()*72.0/dpi), round(img.height()*72.0/dpi));
+        pdf_mutex.unlock();
+        ok = QFileInfo(path).size() > 0;
+    }
+    else if (config->format=="jpg" or config->format=="jpeg") {
+        if (img.hasAlphaChannel())
+            img = removeTransparency(img);
+        ExifInfo exif;
+        // same as saving from GUI, exif of small images are discarded
+        if (img.width()*img.height()>300000) {
+            FILE *infile = qfopen(filename, "r");
+            if (infile) {
+                exif_read(exif, infile);
+                fclose(infile);
+            }
+        }
+        if (config->dpi>0)
+            setExifDpi(exif, config->dpi);
+        ok = saveJpegWithExif(img, config->quality, path, exif);
+        exif_free(exif);
+    }
+    else {
+        ok = img.save(path, config->format.toUtf8().constData(), config->quality);
+    }
+    if (not ok)
+        QFile::remove(path);
+    return ok;
+}
+
+void
+BatchTask:: setExifDpi(ExifInfo &exif, int dpi)
+{
+    ExifTag xresolution = {Tag_XResolution, U_RATIONAL, 1, NULL, 0, 0.0, {dpi,1}};
+    ExifTag yresolution = {Tag_YResolution, U_RATIONAL, 1, NULL, 0, 0.0, {dpi,1}};
+    ExifTag resolution_unit = {Tag_ResolutionUnit, U_SHORT, 1, NULL, 2, 0.0, {0,1}};
+    exif[Tag_XResolution] = xresolution;
+    exif[Tag_YResolution] = yresolution;
+    exif[Tag_ResolutionUnit] = resolution_unit;
+}
+
+void
+BatchTask:: run()
+{
+    QElapsedTimer timer;
+    timer.start();
+    // files are processed in parallel, so filters must not use all cores each
+    omp_set_num_threads(MAX(QThread::idealThreadCount()/config->threads, 1));
+
+    QString out_filename, error;
+    QImage img;
+    // huge jpeg images are decoded, filtered and encoded in strips
+    if (StripStream::canStream(filename, config->format, config->ops)) {
+        StripStream stream(config->ops, config->quality, config->dpi);
+        out_filename = newOutputFile();
+        if (out_filename.isEmpty())
+            error = "could not create output file";
+        else if (not stream.run(filename, out_filename)) {
+            QFile::remove(out_filename);
+            error = "could not process image in strips";
+        }
+    }
+    else if ((img = loadImage(filename)).isNull())
+        error = "could not read image";
+    else {
+        if (img.format()!=QImage::Format_RGB32 and img.format()!=QImage::Format_ARGB32)
+            img = img.convertToFormat(img.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+        for (int i=0; i<config->ops.count(); i++) {
+            if (not applyOp(img, config->ops[i])) {
+                error = "failed to apply \"" + config->ops[i].name + "\"";
+                break;
+            }
+        }
+        if (error.isEmpty()) {
+            out_filename = newOutputFile();
+            if (out_filename.isEmpty() or not save(img, out_filename))
+                error = "could not save image";
+        }
+    }
+    long long ms = timer.elapsed();
+    if (error.isEmpty()) {
+        fprintf(stdout, "ok\t%lld ms\t%s -> %s\n", ms, filename.toUtf8().constData(),
+                                                    out_filename.toUtf8().constData());
+        fflush(stdout);
+    }
+    else {
+        (*failed)++;
+        fprintf(stderr, "failed\t%lld ms\t%s : %s\n", ms, filename.toUtf8().constData(),
+                                                    error.toUtf8().constData());
+    }
+}
+
+
+bool isBatchMode(int argc, char *argv[])
+{
+    return argc>1 and strcmp(argv[1], "--batch")==0;
+}
+
+static void printUsage()
+{
+    fprintf(stderr,
+        "Usage : photoquick --batch [options] file1 [file2 ...]\n"
+        "Options :\n"
+        "  -p, --pipeline OPS  comma separated operations, applied in order\n"
+        "  -o, --output DIR    output directory (default : directory of input)\n"
+        "  -f, --format FMT    output format, jpg, png, pdf etc. (default : jpg)\n"
+        "  -q, --quality N     jpg quality 1-100\n"
+        "  -d, --dpi N         dpi saved in jpg, and page size of pdf (default : 300)\n"
+        "  -j, --jobs N        number of files processed in parallel\n"
+        "Operations :\n");
+    for (int i=0; i<BATCH_OP_COUNT; i++)
+        fprintf(stderr, "  %s\n", batch_ops[i].help);
+    fprintf(stderr,
+        "Example :\n"
+        "  photoquick --batch -p resize:1200:0,sharpen -q 85 -o out *.jpg\n");
+}
+
+int batchMain(int argc, char *argv[])
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+    // QPainter and image plugins need a gui application, but no display
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty())
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+#else
+    QApplication app(argc, argv, false);
+#endif
+    app.setOrganizationName("photoquick");
+    app.setApplicationName("photoquick");
+
+    BatchConfig config;
+    QStringList files;
+    QStringList args = app.arguments();
+    args.removeFirst();// program name
+    args.removeFirst();// --batch
+    QString error;
+    while (not args.isEmpty()) {
+        QString arg = args.takeFirst();
+        if (arg=="-h" or arg=="--help") {
+            printUsage();
+            return BATCH_OK;
+        }
+        if (not arg.startsWith("-")) {
+            files << arg;
+            continue;
+        }
+        if (args.isEmpty()) {
+            error = "missing value of " + arg;
+            break;
+        }
+        QString val = args.takeFirst();
+        bool ok = true;
+        if (arg=="-p" or arg=="--pipeline")
+            ok = config.parseOps(val, error);
+        else if (arg=="-o" or arg=="--output")
+            config.out_dir = val;
+        else if (arg=="-f" or arg=="--format")
+            config.format = val.toLower();
+        else if (arg=="-q" or arg=="--quality") {
+            config.quality = val.toInt(&ok);
+            ok = ok and config.quality>=1 and config.quality<=100;
+        }
+        else if (arg=="-d" or arg=="--dpi") {
+            config.dpi = val.toInt(&ok);
+            ok = ok and config.dpi>0;
+        }
+        else if (arg=="-j" or arg=="--jobs") {
+            config.threads = val.toInt(&ok);
+            ok = ok and config.threads>0;
+        }
+        else
+            error = "unknown option " + arg;
+        if (not ok and error.isEmpty())
+            error = "invalid value of " + arg + " : " + val;
+        if (not error.isEmpty())
+            break;
+    }
+    if (error.isEmpty() and files.isEmpty())
+        error = "no input file";
+    if (error.isEmpty() and config.format!="pdf" and
+        not QImageWriter::supportedImageFormats().contains(config.format.toUtf8()))
+        error = "unsupported output format " + config.format;
+    if (error.isEmpty() and not config.out_dir.isEmpty() and not QDir().mkpath(config.out_dir))
+        error = "could not create directory " + config.out_dir;
+    if (not error.isEmpty()) {
+        fprintf(stderr, "Error : %s\n\n", error.toUtf8().constData());
+        printUsage();
+        return BATCH_USAGE_ERROR;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    std::atomic<int> failed(0);
+    QThreadPool pool;
+    config.threads = MIN(config.threads, files.count());
+    pool.setMaxThreadCount(config.threads);
+    foreach (QString filename, files) {
+        pool.start(new BatchTask(filename, &config, &failed));
+    }
+    pool.waitForDone();
+    fprintf(stderr, "%d files processed, %d failed, in %lld ms\n", files.count(),
+                                        failed.load(), (long long)timer.elapsed());
+    return failed ? BATCH_FILE_FAILED : BATCH_OK;
+}
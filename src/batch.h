@@ -0,0 +1,68 @@
+#pragma once
+/* Headless batch processing of image files from command line */
+#include <QCoreApplication>
+#include <QStringList>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QDir>
+#include <atomic>
+#include "common.h"
+#include "filters.h"
+
+#ifndef __PHOTOQUICK_BATCH
+#define __PHOTOQUICK_BATCH
+
+// exit codes of batch mode
+enum {
+    BATCH_OK,
+    BATCH_FILE_FAILED,  // one or more files could not be processed
+    BATCH_USAGE_ERROR
+};
+
+// an operation of pipeline, e.g "blur:2" is {"blur", [2]}
+typedef struct {
+    QString name;
+    QList<float> args;
+} BatchOp;
+
+// options shared by all files
+class BatchConfig
+{
+public:
+    QList<BatchOp> ops;
+    QString out_dir;    // empty means same directory as input
+    QString format;     // jpg, png, pdf etc.
+    int quality;
+    int dpi;            // used by pdf output and saved in jpg if > 0
+    int threads;
+
+    BatchConfig();
+    bool parseOps(QString pipeline, QString &error);
+};
+
+// processes a single file, and prints result and time taken
+class BatchTask : public QRunnable
+{
+public:
+    QString filename;
+    BatchConfig *config;
+    std::atomic<int> *failed;
+
+    BatchTask(QString filename, BatchConfig *config, std::atomic<int> *failed);
+    static bool applyOp(QImage &img, BatchOp &op);
+    static void setExifDpi(ExifInfo &exif, int dpi);
+    QString newOutputFile();
+    bool save(QImage img, QString out_filename);
+    void run();
+};
+
+// returns true if command line arguments ask for batch mode
+bool isBatchMode(int argc, char *argv[]);
+
+// entry point of batch mode, returns exit code
+int batchMain(int argc, char *argv[]);
+
+#endif /* __PHOTOQUICK_BATCH */
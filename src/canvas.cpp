@@ -1,6 +1,12 @@
 /* This file is a part of photoquick program, which is GPLv3 licensed */
 
 #include "canvas.h"
+#include "common.h"
+#include "distance_transform.h"
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+#include <QScreen>
+#include <QGuiApplication>
+#endif
 
 Canvas:: Canvas(QScrollArea *scrollArea, ImageData *img_dat) : QLabel(scrollArea)
 {
@@ -66,6 +72,22 @@ Canvas:: clearMask()
     showScaled();
 }
 
+void
+Canvas:: growMask(int radius)
+{
+    ::growMask(mask, radius);
+    tmp_image = data->image;// prevents restoring of previously masked areas
+    showScaled();
+}
+
+void
+Canvas:: shrinkMask(int radius)
+{
+    ::shrinkMask(mask, radius);
+    tmp_image = data->image;
+    showScaled();
+}
+
 void
 Canvas:: invertMask()
 {
@@ -120,6 +142,34 @@ Canvas:: rotate(int degree, Qt::Axis axis)
     showScaled();
 }
 
+// overlay is drawn until it is set NULL
+void
+Canvas:: setOverlay(CanvasOverlay *overlay)
+{
+    this->overlay = overlay;
+    overlay_rect = QRect();
+    update();
+}
+
+// overlay is changed, and now it is within rect. only the area covered
+// by previous and current overlay is repainted
+void
+Canvas:: updateOverlay(QRect rect)
+{
+    update(overlay_rect | rect);
+    overlay_rect = rect;
+}
+
+void
+Canvas:: paintEvent(QPaintEvent *ev)
+{
+    QLabel::paintEvent(ev);
+    if (overlay==NULL)
+        return;
+    QPainter painter(this);
+    overlay->drawOverlay(painter);
+}
+
 void
 Canvas:: mousePressEvent(QMouseEvent *ev)
 {
@@ -150,36 +200,143 @@ Canvas:: mouseMoveEvent(QMouseEvent *ev)
 
 
 // ******************* Paint Canvas ******************
-PaintCanvas:: PaintCanvas(QWidget *parent) : QLabel(parent)
+PaintCanvas:: PaintCanvas(QWidget *parent) : QWidget(parent)
 {
     setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
     setMouseTracking(true);
+    // mouse moves are coalesced to display refresh rate
+    int frame_ms = 16;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+    QScreen *screen = QGuiApplication::primaryScreen();
+    if (screen and screen->refreshRate() > 0)
+        frame_ms = MAX(int(1000/screen->refreshRate()), 4);
+#endif
+    frame_timer = new QTimer(this);
+    frame_timer->setSingleShot(true);
+    frame_timer->setInterval(frame_ms);
+    connect(frame_timer, SIGNAL(timeout()), this, SLOT(onFrameTimeout()));
+}
+
+// replace base layer. other layers are cleared if size is changed
+void
+PaintCanvas:: setImage(QImage img)
+{
+    if (img.hasAlphaChannel())
+        base = img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    else
+        base = img.convertToFormat(QImage::Format_RGB32);
+    if (overlay.size() != base.size()) {
+        overlay = QImage(base.size(), QImage::Format_ARGB32_Premultiplied);
+        overlay.fill(0);
+        overlay_used = false;
+        brush = QImage(base.size(), QImage::Format_ARGB32_Premultiplied);
+        brush.fill(0);
+        brush_rect = QRect();
+        setFixedSize(base.size());
+    }
+    update();
+}
+
+void
+PaintCanvas:: clearOverlay()
+{
+    if (not overlay_used)
+        return;
+    overlay.fill(0);
+    overlay_used = false;
+    update();
+}
+
+// clear only the area drawn since last clear
+void
+PaintCanvas:: clearBrush()
+{
+    if (brush_rect.isEmpty())
+        return;
+    QPainter painter(&brush);
+    painter.setCompositionMode(QPainter::CompositionMode_Clear);
+    painter.fillRect(brush_rect, Qt::transparent);
+    painter.end();
+    update(brush_rect);
+    brush_rect = QRect();
+}
+
+// area of base or overlay layer is changed
+void
+PaintCanvas:: updateArea(QRect rect)
+{
+    overlay_used = true;
+    update(rect);
+}
+
+// area of brush layer is changed
+void
+PaintCanvas:: updateBrushArea(QRect rect)
+{
+    rect &= brush.rect();
+    brush_rect |= rect;
+    update(rect);
+}
+
+void
+PaintCanvas:: paintEvent(QPaintEvent *ev)
+{
+    QRect rect = ev->rect() & base.rect();
+    if (rect.isEmpty())
+        return;
+    QPainter painter(this);
+    painter.drawImage(rect.topLeft(), base, rect);
+    if (overlay_used)
+        painter.drawImage(rect.topLeft(), overlay, rect);
+    rect &= brush_rect;
+    if (not rect.isEmpty())
+        painter.drawImage(rect.topLeft(), brush, rect);
+}
+
+void
+PaintCanvas:: flushMouseMove()
+{
+    if (move_pending) {
+        move_pending = false;
+        emit mouseMoved(move_pos);
+    }
+}
+
+void
+PaintCanvas:: onFrameTimeout()
+{
+    if (not move_pending)
+        return;
+    flushMouseMove();
+    frame_timer->start();
 }
 
 void
 PaintCanvas:: mousePressEvent(QMouseEvent *ev)
 {
+    flushMouseMove();
     emit mousePressed(ev->pos());
 }
 
 void
 PaintCanvas:: mouseMoveEvent(QMouseEvent *ev)
 {
-    emit mouseMoved(ev->pos());
+    move_pos = ev->pos();
+    move_pending = true;
+    // first move in a frame is sent at once, later ones at end of the frame
+    if (not frame_timer->isActive()) {
+        flushMouseMove();
+        frame_timer->start();
+    }
 }
 
 void
 PaintCanvas:: mouseReleaseEvent(QMouseEvent *ev)
 {
+    flushMouseMove();
     emit mouseReleased(ev->pos());
 }
 
-void
-PaintCanvas:: setImage(QImage img)
-{
-    setPixmap(QPixmap::fromImage(img));
-}
-
 
 QCursor roundCursor(int width)
 {
@@ -10,12 +10,25 @@
 #include <QSizePolicy>
 #include <QTransform>
 #include <QPainter>
+#include <QPaintEvent>
+#include <QTimer>
 #include <cmath>
 #include "plugin.h"
 
 #ifndef __PHOTOQUICK_CANVAS
 #define __PHOTOQUICK_CANVAS
 
+// premultiplied semi-transperant green, to show mask in overlay layer
+#define MASK_COLOR qRgba(0,127,0,127)
+
+// vector drawing shown over the Canvas image, e.g handles of crop box.
+// it is painted in paintEvent, so the image pixmap is never copied.
+class CanvasOverlay
+{
+public:
+    virtual void drawOverlay(QPainter &painter) = 0;
+};
+
 //This is the widget responsible for displaying image
 class Canvas : public QLabel
 {
@@ -26,7 +39,11 @@ public:
     void setImage(QImage img);
     void setMask(QImage mask);
     void clearMask();
+    void growMask(int radius);
+    void shrinkMask(int radius);
     void rotate(int degree, Qt::Axis axis=Qt::ZAxis);
+    void setOverlay(CanvasOverlay *overlay);
+    void updateOverlay(QRect rect);
     // Variables
     ImageData *data;
     QImage mask;// 1 bpp binary mask image of format MonoLSB, 0=unmasked, 1=masked
@@ -35,6 +52,9 @@ public:
     float scale;
     bool drag_to_scroll;    // if click and drag moves image
 private:
+    CanvasOverlay *overlay = NULL;
+    QRect overlay_rect;     // area covered by overlay when last drawn
+    void paintEvent(QPaintEvent *ev);
     void mousePressEvent(QMouseEvent *ev);
     void mouseReleaseEvent(QMouseEvent *ev);
     void mouseMoveEvent(QMouseEvent *ev);
@@ -53,17 +73,39 @@ signals:
     void imageUpdated();
 };
 
-// It is a drawing area for some dialogs
-
-class PaintCanvas : public QLabel
+// It is a drawing area for some dialogs.
+// It shows three layers; base is the image being edited, overlay is for
+// marks that stay over the image (mask, paths), and brush is for temporary
+// drawing (cursor path, preview) which is cleared before drawing again.
+// Draw directly on a layer, then call updateArea() with the changed area,
+// so that only that area is repainted. Mouse moves are sent at most once
+// per frame of the display.
+class PaintCanvas : public QWidget
 {
     Q_OBJECT
 public:
     PaintCanvas(QWidget *parent);
+    QImage base;    // RGB32 or ARGB32_Premultiplied
+    QImage overlay; // ARGB32_Premultiplied, transperant where nothing is drawn
+    QImage brush;   // ARGB32_Premultiplied
+    void setImage(QImage image);
+    void clearOverlay();
+    void clearBrush();
+    void updateArea(QRect rect);
+    void updateBrushArea(QRect rect);
+    void paintEvent(QPaintEvent *ev);
     void mousePressEvent(QMouseEvent *ev);
     void mouseMoveEvent(QMouseEvent *ev);
     void mouseReleaseEvent(QMouseEvent *ev);
-    void setImage(QImage image);
+private:
+    QRect brush_rect;   // area of brush layer drawn since last clear
+    bool overlay_used = false;
+    QTimer *frame_timer;
+    bool move_pending = false;
+    QPoint move_pos;
+    void flushMouseMove();
+private slots:
+    void onFrameTimeout();
 signals:
     void mousePressed(QPoint);
     void mouseMoved(QPoint);
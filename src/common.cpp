@@ -81,27 +81,24 @@ QImage removeTransparency(QImage img)
     return opaque_img;
 }
 
-// load an image from file
-QImage loadImage(QString fileName)
+static int getOrientation(QString fileName)
+{
+    FILE *f = qfopen(fileName, "rb");
+    if (!f)
+        return 0;
+    int orientation = getOrientation(f);
+    fclose(f);
+    return orientation;
+}
+
+// convert to RGB32 or ARGB32, and rotate according to jpg orientation
+static QImage orientImage(QImage img, int orientation)
 {
-    QImage img(fileName);
-    if (img.isNull()){
-        // may be file extension is wrong, ignore extension and read again
-        QImageReader reader(fileName);
-        reader.setDecideFormatFromContent(true);
-        reader.read(&img);
-        if (img.isNull())
-            return img;
-    }
     // Converted because filters can only be applied to RGB32 or ARGB32 image
     if (img.hasAlphaChannel() && img.format()!=QImage::Format_ARGB32)
         img = img.convertToFormat(QImage::Format_ARGB32);
     else if (!img.hasAlphaChannel() and img.format()!=QImage::Format_RGB32)
         img = img.convertToFormat(QImage::Format_RGB32);
-    // Get jpg orientation
-    FILE *f = qfopen(fileName, "rb");
-    int orientation = getOrientation(f);
-    fclose(f);
     // rotate if required
     QTransform transform;
     switch (orientation) {
@@ -115,6 +112,64 @@ QImage loadImage(QString fileName)
     return img;
 }
 
+// load an image from file
+QImage loadImage(QString fileName)
+{
+    QImage img(fileName);
+    if (img.isNull()){
+        // may be file extension is wrong, ignore extension and read again
+        QImageReader reader(fileName);
+        reader.setDecideFormatFromContent(true);
+        reader.read(&img);
+        if (img.isNull())
+            return img;
+    }
+    return orientImage(img, getOrientation(fileName));
+}
+
+QSize getImageSize(QString fileName)
+{
+    QImageReader reader(fileName);
+    reader.setDecideFormatFromContent(true);
+    QSize size = reader.size();
+    int orientation = getOrientation(fileName);
+    if (orientation==6 || orientation==8)
+        size.transpose();
+    return size;
+}
+
+// the largest of 1/1, 1/2, 1/4 and 1/8 scaled size, which is not smaller than target
+QSize scaledDecodeSize(QSize size, QSize target)
+{
+    int denom = 1;
+    while (denom < 8 && size.width()/(2*denom) >= target.width()
+                    && size.height()/(2*denom) >= target.height())
+        denom *= 2;
+    return QSize((size.width()+denom-1)/denom, (size.height()+denom-1)/denom);
+}
+
+QImage loadImage(QString fileName, QSize max_size)
+{
+    QImageReader reader(fileName);
+    reader.setDecideFormatFromContent(true);
+    QSize size = reader.size();
+    int orientation = getOrientation(fileName);
+    if (orientation==6 || orientation==8)
+        max_size.transpose();// size of image before rotation
+    if (not size.isValid() or (size.width()<=max_size.width() and size.height()<=max_size.height()))
+        return loadImage(fileName);
+    QSize target = size.scaled(max_size, Qt::KeepAspectRatio);
+    // jpeg is decoded by libjpeg at reduced scale, others are decoded at full size
+    if (reader.supportsOption(QImageIOHandler::ScaledSize))
+        reader.setScaledSize(scaledDecodeSize(size, target));
+    QImage img = reader.read();
+    if (img.isNull())
+        return img;
+    if (img.size() != target)
+        img = img.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    return orientImage(img, orientation);
+}
+
 /* When we add exif ?
   Exif is added if either the passed Exif is not empty or resolution is > 1MP.
   If image is >1M, even if exif empty, we add exif to add thumbnail.
@@ -176,6 +231,91 @@ int getJpgFileSize(QImage image, int quality)
     return filesize;
 }
 
+static int encodedSize(QImage img, int quality)
+{
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    img.save(&buffer, "JPG", quality);
+    return buffer.size();
+}
+
+JpegSizeModel:: JpegSizeModel(QImage img) : image(img), thumbnail_size(-1)
+{
+}
+
+int
+JpegSizeModel:: predict(float scale, int quality)
+{
+    if (image.isNull()) return 0;
+    QPair<int,int> key(roundf(scale*1000), quality);
+    if (cache.contains(key))
+        return cache[key];
+
+    int out_w = roundf(image.width()*scale);
+    int out_h = roundf(image.height()*scale);
+    int tile = SIZE_MODEL_TILE_SIZE, n = SIZE_MODEL_TILE_COUNT;
+    int filesize;
+    if (out_w <= tile*n || out_h <= tile*n) {
+        // small enough to encode whole image
+        QImage scaled = image.scaled(MAX(out_w,1), MAX(out_h,1),
+                            Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        filesize = encodedSize(scaled, quality);
+    }
+    else {
+        // mosaic of evenly spaced tiles, each tile scaled like the whole image
+        int src_tile = ceilf(tile/scale);
+        QImage mosaic(tile*n, tile*n, QImage::Format_RGB32);
+        QPainter painter(&mosaic);
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        for (int j=0; j<n; j++) {
+            for (int i=0; i<n; i++) {
+                int x = (image.width()-src_tile)*i/(n-1);
+                int y = (image.height()-src_tile)*j/(n-1);
+                painter.drawImage(QRect(i*tile, j*tile, tile, tile), image,
+                                  QRect(x, y, src_tile, src_tile));
+            }
+        }
+        painter.end();
+        // headers and tables do not grow with image size
+        // size of headers and tables, measured by encoding a blank 8x8 block
+        if (not header_size.contains(quality)) {
+            QImage blank(8, 8, QImage::Format_RGB32);
+            blank.fill(0);
+            header_size[quality] = encodedSize(blank, quality);
+        }
+        int header = header_size[quality];
+        int data = encodedSize(mosaic, quality) - header;
+        filesize = header + (double)data * out_w*out_h / (tile*n*tile*n);
+    }
+    if (out_w*out_h >= 1000000) {// getJpgFileSize() adds a thumbnail
+        if (thumbnail_size < 0) {
+            QImage thumbnail = image.width()>image.height() ?
+                            image.scaledToWidth(160) : image.scaledToHeight(160);
+            thumbnail_size = encodedSize(thumbnail, -1);
+        }
+        filesize += thumbnail_size;
+    }
+    cache[key] = filesize;
+    return filesize;
+}
+
+float
+JpegSizeModel:: fitScale(int max_size, int quality)
+{
+    if (predict(1.0, quality) <= max_size)
+        return 1.0;
+    // file size is roughly proportional to pixel count
+    float lo = 0, hi = 1.0;
+    for (int i=0; i<12 && hi-lo > 0.002; i++) {
+        float mid = (lo+hi)/2;
+        if (predict(mid, quality) <= max_size)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return MAX(lo, 0.001f);
+}
+
 
 /* On linux we can simply do,
     char *filename = fileName.toUtf8().data();
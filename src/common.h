@@ -11,6 +11,7 @@
 #include <QImageReader>
 #include <QPainter>
 #include <QDesktopServices>
+#include <QMap>
 #include <cmath>
 #include <unistd.h> // dup()
 #include "exif.h"
@@ -86,12 +87,44 @@ QImage removeTransparency(QImage img);
 // Returns an autorotated image according to exif data
 QImage loadImage(QString filename);
 
+// load an image scaled down to fit in max_size, keeping aspect ratio.
+// jpeg is decoded at 1/2, 1/4 or 1/8 scale, which is faster and takes less memory
+QImage loadImage(QString filename, QSize max_size);
+
+// size of autorotated image, read from file header without decoding
+QSize getImageSize(QString filename);
+
+// the largest of 1/1, 1/2, 1/4 and 1/8 scaled size, which is not smaller than target
+QSize scaledDecodeSize(QSize size, QSize target);
+
 // saves img as jpeg with that exif
 bool saveJpegWithExif(QImage img, int quality, QString filename, ExifInfo &exif);
 
 // get filesize in bytes when a QImage is saved as jpeg
 int getJpgFileSize(QImage img, int quality=-1);
 
+// size and count of tiles in each direction, encoded by JpegSizeModel
+#define SIZE_MODEL_TILE_SIZE 128
+#define SIZE_MODEL_TILE_COUNT 4
+
+// Predicts the jpeg file size of an image at any scale and quality, without
+// encoding whole image. A few tiles sampled from image are scaled and encoded,
+// and the bits per pixel of those are used for whole image.
+class JpegSizeModel
+{
+public:
+    JpegSizeModel(QImage img);
+    // predicted value of getJpgFileSize(img scaled by scale, quality)
+    int predict(float scale, int quality=-1);
+    // find largest scale (<= 1.0) at which file size is below max_size
+    float fitScale(int max_size, int quality=-1);
+private:
+    QImage image;
+    int thumbnail_size;
+    QMap<QPair<int,int>, int> cache; // {scale*1000, quality} -> predicted size
+    QMap<int, int> header_size;     // quality -> size of jpeg with no image data
+};
+
 
 // creates a FILE* from QString filename
 FILE* qfopen(QString filename, const char *mode);
@@ -3,12 +3,13 @@
 
 // ------------ Dialog to set JPG Options for saving ------------
 
-JpegDialog:: JpegDialog(QWidget *parent, QImage &img) : QDialog(parent), image(img)
+JpegDialog:: JpegDialog(QWidget *parent, QImage &img) : QDialog(parent), image(img),
+                                                        size_model(img)
 {
     setWindowTitle("JPEG Options");
     timer = new QTimer(this);
     timer->setSingleShot(true);
-    timer->setInterval(800);
+    timer->setInterval(200);
     qualityLabel = new QLabel("Compression Level :", this);
     qualitySpin = new QSpinBox(this);
     qualitySpin->setAlignment(Qt::AlignHCenter);
@@ -63,8 +64,9 @@ JpegDialog:: toggleCheckSize(bool checked)
 void
 JpegDialog:: checkFileSize()
 {
-    int filesize = getJpgFileSize(image, qualitySpin->value());
-    QString text = "%1 KB";
+    // predicted size is shown, encoding whole image is slow for large images
+    int filesize = size_model.predict(1.0, qualitySpin->value());
+    QString text = "~%1 KB";
     sizeLabel->setText(text.arg(QString::number(filesize/1024.0, 'f', 1)));
 }
 
@@ -148,37 +150,123 @@ ExpandBorderDialog:: toggleAllSides(bool checked)
 
 //------------------ PreviewDialog for Filters ------------------
 
+PreviewTask:: PreviewTask(PreviewDialog *dialog, QImage image, QList<float> params,
+                                                int id) : QRunnable()
+{
+    this->dialog = dialog;
+    this->image = image;
+    this->params = params;
+    this->id = id;
+}
+
+void
+PreviewTask:: run()
+{
+    QStringList key;
+    for (float param : params)
+        key << QString::number(param);
+    QImage result = dialog->applyFilter(image, params);
+    emit previewFinished(id, key.join(","), result);
+}
+
 PreviewDialog:: PreviewDialog(QLabel *canvas, QImage img, float scale) : QDialog(canvas)
 {
     this->canvas = canvas;
     this->image = img;
     this->scale = scale;
-    timer = new QTimer(this);
-    timer->setSingleShot(true);
-    timer->setInterval(800);
-    connect(timer, SIGNAL(timeout()), this, SLOT(preview()));
+    // when zoomed in, the image is larger than the visible area
+    QSize viewport = canvas->parentWidget()->size() / scale;
+    if (img.width() > viewport.width() or img.height() > viewport.height())
+        proxy = img.scaled(viewport, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    else
+        proxy = img;
+    proxy_scale = float(img.width())/proxy.width();
+    cache.setMaxCost(PREVIEW_CACHE_SIZE);
+    pool = new QThreadPool(this);
+    pool->setMaxThreadCount(1);
+}
+
+QImage
+PreviewDialog:: getResult(QImage img)
+{
+    return applyFilter(img, getParams());
 }
 
 void
 PreviewDialog:: triggerPreview()
 {
-    timer->start();
+    preview();
 }
 
+// previews are computed in background. If parameters change while a preview
+// is being computed, only the latest parameters are computed next.
 void
 PreviewDialog:: preview()
 {
-    QImage img = getResult(image);
+    request_params = getParams();
+    request_id++;
+    QStringList key;
+    for (float param : request_params)
+        key << QString::number(param);
+    QImage *cached = cache.object(key.join(","));
+    if (cached) {
+        pending = false;
+        showPreview(*cached);
+        return;
+    }
+    if (busy) {
+        pending = true;
+        return;
+    }
+    startTask();
+}
+
+void
+PreviewDialog:: startTask()
+{
+    busy = true;
+    pending = false;
+    PreviewTask *task = new PreviewTask(this, proxy, request_params, request_id);
+    connect(task, SIGNAL(previewFinished(int, QString, QImage)),
+            this, SLOT(onPreviewFinish(int, QString, QImage)));
+    pool->start(task);
+}
+
+void
+PreviewDialog:: onPreviewFinish(int id, QString key, QImage result)
+{
+    busy = false;
+    cache.insert(key, new QImage(result));
+    // dialog is closed, and canvas shows the final image
+    if (not isVisible())
+        return;
+    if (id == request_id)
+        showPreview(result);
+    else if (pending)
+        startTask();
+}
 
+void
+PreviewDialog:: showPreview(QImage img)
+{
     QPixmap pm = QPixmap::fromImage(img);
-    if (scale != 1.0) {
-        Qt::TransformationMode mode = floorf(scale) == ceilf(scale)? // integer scale
+    float display_scale = scale * proxy_scale;
+    if (display_scale != 1.0) {
+        Qt::TransformationMode mode = floorf(display_scale) == ceilf(display_scale)? // integer scale
                                     Qt::FastTransformation : Qt::SmoothTransformation;
-        pm = pm.scaledToHeight(scale*pm.height(), mode);
+        pm = pm.scaledToHeight(display_scale*pm.height(), mode);
     }
     canvas->setPixmap(pm);
 }
 
+void
+PreviewDialog:: done(int r)
+{
+    // running task must not use this dialog after it is closed
+    pool->waitForDone();
+    QDialog::done(r);
+}
+
 
 // ----------- Preview Dialog for Rotate Any Degree --------- //
 
@@ -200,13 +288,18 @@ RotateDialog:: RotateDialog(QLabel *canvas, QImage img, float scale) : PreviewDi
     connect(btnBox, SIGNAL(rejected()), this, SLOT(reject()));
 }
 
-QImage
-RotateDialog:: getResult(QImage img)
+QList<float>
+RotateDialog:: getParams()
 {
     angle = angleSpin->value();
+    return QList<float>() << angle;
+}
 
+QImage
+RotateDialog:: applyFilter(QImage img, QList<float> params)
+{
     QTransform transform;
-    transform.rotate(angle, Qt::ZAxis);
+    transform.rotate(params[0], Qt::ZAxis);
     return img.transformed(transform, Qt::SmoothTransformation);
 }
 
@@ -251,14 +344,19 @@ LensDialog:: LensDialog(QLabel *canvas, QImage img, float scale) : PreviewDialog
     triggerPreview();
 }
 
-QImage
-LensDialog:: getResult(QImage img)
+QList<float>
+LensDialog:: getParams()
 {
     main = mainSpin->value();
     edge = edgeSpin->value();
     zoom = zoomSpin->value();
+    return QList<float>() << main << edge << zoom;
+}
 
-    lensDistortion(img, main, edge, zoom);
+QImage
+LensDialog:: applyFilter(QImage img, QList<float> params)
+{
+    lensDistortion(img, params[0], params[1], params[2]);
     return img;
 }
 
@@ -286,12 +384,17 @@ ThresholdDialog:: ThresholdDialog(QLabel *canvas, QImage img, float scale) : Pre
     triggerPreview();
 }
 
-QImage
-ThresholdDialog:: getResult(QImage img)
+QList<float>
+ThresholdDialog:: getParams()
 {
     thresh = thresholdSpin->value();
+    return QList<float>() << thresh;
+}
 
-    threshold(img, thresh);
+QImage
+ThresholdDialog:: applyFilter(QImage img, QList<float> params)
+{
+    threshold(img, params[0]);
     return img;
 }
 
@@ -320,12 +423,17 @@ GammaDialog:: GammaDialog(QLabel *canvas, QImage img, float scale) : PreviewDial
     triggerPreview();
 }
 
-QImage
-GammaDialog:: getResult(QImage img)
+QList<float>
+GammaDialog:: getParams()
 {
     gamma = gammaSpin->value();
+    return QList<float>() << gamma;
+}
 
-    applyGamma(img, gamma);
+QImage
+GammaDialog:: applyFilter(QImage img, QList<float> params)
+{
+    applyGamma(img, params[0]);
     return img;
 }
 
@@ -454,15 +562,23 @@ LevelsDialog:: LevelsDialog(QLabel *canvas, QImage img, float scale) : PreviewDi
     connect(btnBox, SIGNAL(rejected()), this, SLOT(reject()));
 }
 
+QList<float>
+LevelsDialog:: getParams()
+{
+    return QList<float>() << inputRSlider->left_val << inputRSlider->right_val
+                        << outputRSlider->left_val << outputRSlider->right_val
+                        << inputGSlider->left_val << inputGSlider->right_val
+                        << outputGSlider->left_val << outputGSlider->right_val
+                        << inputBSlider->left_val << inputBSlider->right_val
+                        << outputBSlider->left_val << outputBSlider->right_val;
+}
+
 QImage
-LevelsDialog:: getResult(QImage img)
-{
-    levelImageChannel(img, CHANNEL_R, inputRSlider->left_val, inputRSlider->right_val,
-                                    outputRSlider->left_val, outputRSlider->right_val);
-    levelImageChannel(img, CHANNEL_G, inputGSlider->left_val, inputGSlider->right_val,
-                                    outputGSlider->left_val, outputGSlider->right_val);
-    levelImageChannel(img, CHANNEL_B, inputBSlider->left_val, inputBSlider->right_val,
-                                    outputBSlider->left_val, outputBSlider->right_val);
+LevelsDialog:: applyFilter(QImage img, QList<float> params)
+{
+    levelImageChannel(img, CHANNEL_R, params[0], params[1], params[2], params[3]);
+    levelImageChannel(img, CHANNEL_G, params[4], params[5], params[6], params[7]);
+    levelImageChannel(img, CHANNEL_B, params[8], params[9], params[10], params[11]);
     return img;
 }
 
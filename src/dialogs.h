@@ -13,6 +13,9 @@
 #include <QDesktopServices>
 #include <QUrl>
 #include <QProcess>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QCache>
 #include <cmath>
 #include "common.h"
 #include "filters.h"
@@ -27,6 +30,7 @@ class JpegDialog : public QDialog
 public:
     JpegDialog(QWidget *parent, QImage &img);
     QImage image;
+    JpegSizeModel size_model;
     QSpinBox *qualitySpin;
     QLabel *qualityLabel, *sizeLabel;
     QCheckBox *showSizeCheck, *saveDpiCheck;
@@ -62,6 +66,27 @@ public slots:
     void toggleAllSides(bool checked);
 };
 
+class PreviewDialog;
+
+// applies the filter of a PreviewDialog on its proxy image in a worker thread
+class PreviewTask : public QObject, public QRunnable
+{
+    Q_OBJECT
+public:
+    PreviewDialog *dialog;
+    QImage image;
+    QList<float> params;
+    int id;
+
+    PreviewTask(PreviewDialog *dialog, QImage image, QList<float> params, int id);
+    void run();
+signals:
+    void previewFinished(int id, QString key, QImage result);
+};
+
+// number of previews kept for recently used parameters
+#define PREVIEW_CACHE_SIZE 16
+
 // Preview Dialog for filter functions.
 // This is Abstract and must be reimplemented
 class PreviewDialog : public QDialog
@@ -70,17 +95,32 @@ class PreviewDialog : public QDialog
 public:
     QLabel *canvas;
     QImage image;
+    QImage proxy;   // image scaled down to fit the viewport, previews are made from it
     float scale;
-    QTimer *timer;
+    float proxy_scale;  // size of image / size of proxy
+    QThreadPool *pool;  // single thread, runs one PreviewTask at a time
+    QCache<QString, QImage> cache;
+    int request_id = 0;
+    QList<float> request_params;
+    bool busy = false;      // a PreviewTask is running
+    bool pending = false;   // parameters changed while busy
     // if the filter applied on scaled image looks same, then image from
     // canvas pixmap is passed, and scale is set 1.0
     // else, the original image is passed, and scale is set to canvas->scale
     PreviewDialog(QLabel *parent, QImage img, float scale);
-    // implement getResult() in subclass. which apply filter on input image and returns output
-    virtual QImage getResult(QImage img) = 0;
+    // implement getParams() in subclass, which reads the current parameters from widgets
+    virtual QList<float> getParams() = 0;
+    // implement applyFilter() in subclass, which apply filter on input image and returns output.
+    // it is called from worker thread, so it must not access widgets
+    virtual QImage applyFilter(QImage img, QList<float> params) = 0;
+    QImage getResult(QImage img);
+    void showPreview(QImage img);
+    void startTask();
+    void done(int r);
 public slots:
     void triggerPreview();
     void preview();
+    void onPreviewFinish(int id, QString key, QImage result);
 };
 
 
@@ -91,7 +131,8 @@ public:
     QSpinBox *angleSpin;
 
     RotateDialog(QLabel *parent, QImage img, float scale);
-    QImage getResult(QImage img);
+    QList<float> getParams();
+    QImage applyFilter(QImage img, QList<float> params);
 };
 
 
@@ -106,7 +147,8 @@ public:
     QDoubleSpinBox *zoomSpin;
 
     LensDialog(QLabel *parent, QImage img, float scale);
-    QImage getResult(QImage img);
+    QList<float> getParams();
+    QImage applyFilter(QImage img, QList<float> params);
 };
 
 
@@ -117,7 +159,8 @@ public:
     QSpinBox *thresholdSpin;
 
     ThresholdDialog(QLabel *parent, QImage img, float scale);
-    QImage getResult(QImage img);
+    QList<float> getParams();
+    QImage applyFilter(QImage img, QList<float> params);
 };
 
 
@@ -128,7 +171,8 @@ public:
     QDoubleSpinBox *gammaSpin;
 
     GammaDialog(QLabel *parent, QImage img, float scale);
-    QImage getResult(QImage img);
+    QList<float> getParams();
+    QImage applyFilter(QImage img, QList<float> params);
 };
 
 
@@ -158,7 +202,8 @@ public:
     LevelsWidget *outputRSlider, *outputGSlider, *outputBSlider;
 
     LevelsDialog(QLabel *parent, QImage img, float scale);
-    QImage getResult(QImage img);
+    QList<float> getParams();
+    QImage applyFilter(QImage img, QList<float> params);
     void run();
 };
 
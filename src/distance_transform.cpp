@@ -0,0 +1,186 @@
+/* This file is a part of photoquick program, which is GPLv3 licensed */
+#include "distance_transform.h"
+#include <cmath>
+
+// Reference :
+// Felzenszwalb & Huttenlocher, "Distance Transforms of Sampled Functions" (2012)
+
+// distance to a pixel which does not exist
+#define DT_INF 1e20f
+
+// distance along a row to nearest set pixel, squared.
+// row_mask has 1 byte per pixel, 1 = set
+static void
+rowDistance(const uchar *row_mask, int w, float *out)
+{
+    // distance to nearest set pixel on left side
+    float d = DT_INF;
+    for (int x=0; x<w; x++) {
+        d = row_mask[x] ? 0 : d+1;
+        out[x] = d;
+    }
+    // and on right side
+    d = DT_INF;
+    for (int x=w-1; x>=0; x--) {
+        d = row_mask[x] ? 0 : d+1;
+        if (d < out[x])
+            out[x] = d;
+        out[x] = out[x]<DT_INF ? out[x]*out[x] : DT_INF;
+    }
+}
+
+// 1D distance transform of sampled function f, using lower envelope of
+// parabolas rooted at each sample. v and z are temporary arrays of size n and n+1
+static void
+distanceTransform1D(const float *f, int n, float *d, int *v, float *z)
+{
+    int k = 0;
+    v[0] = 0;
+    z[0] = -DT_INF;
+    z[1] = DT_INF;
+    for (int q=1; q<n; q++) {
+        // intersection of parabolas from q and from last one in envelope
+        float s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2*q - 2*v[k]);
+        // z[0] is -DT_INF, so k never becomes negative
+        while (s <= z[k]) {
+            k--;
+            s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2*q - 2*v[k]);
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k+1] = DT_INF;
+    }
+    k = 0;
+    for (int q=0; q<n; q++) {
+        while (z[k+1] < q)
+            k++;
+        int p = v[k];
+        d[q] = (q-p)*(q-p) + f[p];
+    }
+}
+
+// transform columns of the row distances in out
+static void
+columnPass(float *out, int w, int h)
+{
+    #pragma omp parallel
+    {
+        std::vector<float> f(h), d(h), z(h+1);
+        std::vector<int> v(h);
+        #pragma omp for
+        for (int x=0; x<w; x++) {
+            for (int y=0; y<h; y++)
+                f[y] = out[y*w + x];
+            distanceTransform1D(f.data(), h, d.data(), v.data(), z.data());
+            for (int y=0; y<h; y++)
+                out[y*w + x] = d[y];
+        }
+    }
+}
+
+void distanceTransform(const uchar *mask, int w, int h, float *out, bool invert)
+{
+    #pragma omp parallel
+    {
+        std::vector<uchar> row_mask(w);
+        #pragma omp for
+        for (int y=0; y<h; y++) {
+            const uchar *row = mask + y*w;
+            for (int x=0; x<w; x++)
+                row_mask[x] = (row[x] > 127) != invert;
+            rowDistance(row_mask.data(), w, out + y*w);
+        }
+    }
+    columnPass(out, w, h);
+}
+
+void distanceTransform(QImage mask, float *out, bool invert)
+{
+    int w = mask.width();
+    int h = mask.height();
+    #pragma omp parallel
+    {
+        std::vector<uchar> row_mask(w);
+        #pragma omp for
+        for (int y=0; y<h; y++) {
+            const uchar *row = mask.constScanLine(y);
+            for (int x=0; x<w; x++)
+                row_mask[x] = ((row[x/8] >> (x%8)) & 1) != invert;
+            rowDistance(row_mask.data(), w, out + y*w);
+        }
+    }
+    columnPass(out, w, h);
+}
+
+void growMask(uchar *mask, int w, int h, float radius)
+{
+    std::vector<float> dist(w*h);
+    distanceTransform(mask, w, h, dist.data());
+    float r2 = radius*radius;
+    #pragma omp parallel for
+    for (int i=0; i<w*h; i++) {
+        if (dist[i] <= r2)
+            mask[i] = 255;
+    }
+}
+
+void shrinkMask(uchar *mask, int w, int h, float radius)
+{
+    std::vector<float> dist(w*h);
+    distanceTransform(mask, w, h, dist.data(), true);
+    float r2 = radius*radius;
+    #pragma omp parallel for
+    for (int i=0; i<w*h; i++) {
+        if (dist[i] <= r2)
+            mask[i] = 0;
+    }
+}
+
+void featherMask(uchar *mask, int w, int h, float radius)
+{
+    if (radius <= 0)
+        return;
+    // distance of unset pixels to set pixels, and of set pixels to unset pixels
+    std::vector<float> dist_out(w*h), dist_in(w*h);
+    distanceTransform(mask, w, h, dist_out.data());
+    distanceTransform(mask, w, h, dist_in.data(), true);
+    #pragma omp parallel for
+    for (int i=0; i<w*h; i++) {
+        // signed distance from the edge, which lies between set and unset pixels
+        float d = mask[i] > 127 ? sqrtf(dist_in[i]) - 0.5f : 0.5f - sqrtf(dist_out[i]);
+        float val = 0.5f + d/(2*radius);
+        mask[i] = roundf(255*clamp(val, 0.0f, 1.0f));
+    }
+}
+
+// set or unset pixels of 1 bit mask, where dist <= radius^2
+static void
+setMaskBits(QImage &mask, std::vector<float> &dist, float radius, int val)
+{
+    int w = mask.width();
+    float r2 = radius*radius;
+    for (int y=0; y<mask.height(); y++) {
+        uchar *row = mask.scanLine(y);
+        for (int x=0; x<w; x++) {
+            if (dist[y*w + x] > r2)
+                continue;
+            int bitmask = 1 << (x%8);
+            row[x/8] = (row[x/8] & ~bitmask) | (val << (x%8));
+        }
+    }
+}
+
+void growMask(QImage &mask, float radius)
+{
+    std::vector<float> dist(mask.width()*mask.height());
+    distanceTransform(mask, dist.data());
+    setMaskBits(mask, dist, radius, 1);
+}
+
+void shrinkMask(QImage &mask, float radius)
+{
+    std::vector<float> dist(mask.width()*mask.height());
+    distanceTransform(mask, dist.data(), true);
+    setMaskBits(mask, dist, radius, 0);
+}
@@ -0,0 +1,31 @@
+#pragma once
+/* Exact Euclidean distance transform, and mask operations built on it */
+
+#include <QImage>
+#include <vector>
+#include "common.h"
+
+#ifndef __PHOTOQUICK_DISTANCE_TRANSFORM
+#define __PHOTOQUICK_DISTANCE_TRANSFORM
+
+// Squared distance from each pixel to the nearest set pixel of mask.
+// mask has 1 byte per pixel, value >= 128 is set.
+// if invert is true, distance to the nearest unset pixel is calculated.
+void distanceTransform(const uchar *mask, int w, int h, float *out, bool invert=false);
+
+// same for 1 bit per pixel mask (Format_MonoLSB), 1 is set
+void distanceTransform(QImage mask, float *out, bool invert=false);
+
+// Mask operations on 8 bit masks. These take same time for any radius.
+// set pixels within radius of any set pixel
+void growMask(uchar *mask, int w, int h, float radius);
+// unset pixels within radius of any unset pixel
+void shrinkMask(uchar *mask, int w, int h, float radius);
+// smooth the edge of mask into a linear ramp of width 2*radius
+void featherMask(uchar *mask, int w, int h, float radius);
+
+// grow and shrink 1 bit per pixel mask (Format_MonoLSB)
+void growMask(QImage &mask, float radius);
+void shrinkMask(QImage &mask, float radius);
+
+#endif /* __PHOTOQUICK_DISTANCE_TRANSFORM */
@@ -98,6 +98,154 @@ int getOrientation(FILE *f)
     return 0;
 }
 
+//------------************ JPEG Header Reader ************--------------
+
+// luminance quantization table of IJG for quality 50, from JPEG spec Annex K
+static const int std_luminance_quant_tbl[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+// number of codes of each length in standard luminance huffman tables
+static const unsigned char std_dc_luminance_bits[16] = {0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
+static const unsigned char std_ac_luminance_bits[16] = {0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
+
+// read 2 bytes of jpeg segment (always big-endian)
+static int jpeg_read16(FILE *f)
+{
+    int a = getc(f);
+    int b = getc(f);
+    if (a==EOF || b==EOF)
+        return -1;
+    return (a<<8) | b;
+}
+
+static unsigned int tiff_get(const unsigned char *ptr, int len, bool intel)
+{
+    unsigned int val = 0;
+    for (int i=0; i<len; i++)
+        val |= ptr[i] << (8*(intel ? i : len-1-i));
+    return val;
+}
+
+// checks if IFD0 of exif segment is followed by IFD1, which contains thumbnail
+static bool exif_has_thumbnail(const unsigned char *data, int size)
+{
+    if (size < 14 || memcmp(data, "Exif\0\0", 6)!=0)
+        return false;
+    const unsigned char *tiff = data + 6;
+    size -= 6;
+    bool intel = tiff[0]=='I';
+    unsigned int ifd0 = tiff_get(tiff+4, 4, intel);
+    // offsets are checked before adding, so that those can not overflow
+    if (ifd0 > (unsigned)size-2)
+        return false;
+    unsigned int count = tiff_get(tiff+ifd0, 2, intel);
+    if (count > ((unsigned)size-ifd0-2)/12)
+        return false;
+    unsigned int next = ifd0 + 2 + 12*count;
+    if (next > (unsigned)size-4)
+        return false;
+    return tiff_get(tiff+next, 4, intel) != 0;
+}
+
+bool jpeg_read_info(FILE *f, JpegInfo &info)
+{
+    info = JpegInfo();
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_SET);
+    if (getc(f)!=0xFF || getc(f)!=0xD8)
+        return false;
+    bool has_sof = false, std_huffman = true;
+    long quant_sum = 0;
+    std::string seg;
+    while (true) {
+        if (getc(f)!=0xFF)
+            return false;
+        int marker = getc(f);
+        while (marker==0xFF)// fill bytes
+            marker = getc(f);
+        if (marker==EOF || marker==0xD9)// EOI
+            return false;
+        if (marker==0x01 || (marker>=0xD0 && marker<=0xD7))// no length
+            continue;
+        int len = jpeg_read16(f) - 2;
+        if (len < 0)
+            return false;
+        if (marker==0xDA)// start of scan, header is finished
+            break;
+        seg.resize(len);
+        if (len>0 && fread(&seg[0], len, 1, f)!=1)
+            return false;
+        const unsigned char *p = (const unsigned char*) seg.data();
+        int pos = 0;
+        switch (marker) {
+        case 0xDB:// DQT
+            while (pos < len) {
+                int precision = p[pos]>>4, id = p[pos]&15;
+                pos++;
+                for (int i=0; i<64 && pos+precision<len; i++) {
+                    int val = precision ? (p[pos]<<8)|p[pos+1] : p[pos];
+                    pos += precision ? 2 : 1;
+                    if (id==0)
+                        quant_sum += val;
+                }
+            }
+            break;
+        case 0xC4:// DHT
+            while (pos+17 <= len) {
+                int cls = p[pos]>>4, id = p[pos]&15;
+                const unsigned char *bits = p+pos+1;
+                int count = 0;
+                for (int i=0; i<16; i++)
+                    count += bits[i];
+                if (id==0 && memcmp(bits, cls ? std_ac_luminance_bits : std_dc_luminance_bits, 16)!=0)
+                    std_huffman = false;
+                pos += 17 + count;
+            }
+            break;
+        case 0xE1:// APP1, may be exif or xmp
+            if (exif_has_thumbnail(p, len))
+                info.has_thumbnail = true;
+            break;
+        default:
+            // SOF markers, except DHT, JPG and DAC
+            if (marker>=0xC0 && marker<=0xCF && marker!=0xC8 && marker!=0xCC && len>=6) {
+                has_sof = true;
+                info.progressive = (marker==0xC2 || marker==0xC6 || marker==0xCA || marker==0xCE);
+                info.height = (p[1]<<8) | p[2];
+                info.width = (p[3]<<8) | p[4];
+                info.components = p[5];
+                // luma and chroma have different sampling factors
+                if (info.components>=3 && len>=6+3*info.components)
+                    info.subsampled = p[7]!=p[10];
+            }
+        }
+    }
+    if (not has_sof)
+        return false;
+    // progressive jpeg huffman tables are optimized, and are defined between scans
+    info.optimized_huffman = info.progressive || !std_huffman;
+    if (quant_sum > 0) {
+        // IJG scales the standard table by this percentage to get a quality
+        long std_sum = 0;
+        for (int i=0; i<64; i++)
+            std_sum += std_luminance_quant_tbl[i];
+        float scale = 100.0f*quant_sum/std_sum;
+        float quality = scale<=100 ? (200-scale)/2 : 5000/scale;
+        int q = (int)roundf(quality);
+        info.quality = q<1 ? 1 : (q>100 ? 100 : q);
+    }
+    return true;
+}
+
 //------------************ Image Exif Reader ************--------------
 
 // known tags that will be read
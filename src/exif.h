@@ -33,9 +33,26 @@ std::string exif_to_string(ExifInfo &exif);
 
 void exif_free(ExifInfo &exif);
 
+// data of App1 segment, thumbnail is optional
+std::string create_exif_data(ExifInfo exif, const char *thumbnail, int thumb_size);
+
 bool write_jpeg_with_exif(const char *jpg, int jpg_size,
                         const char *thumbnail, int thumb_size, ExifInfo exif, FILE *out);
 
+// jpeg properties read from segments before the first scan
+typedef struct {
+    int width, height;
+    int components;
+    int quality;        // estimated from luminance quantization table, 0 if unknown
+    bool subsampled;    // chroma is subsampled, e.g 4:2:0
+    bool progressive;
+    bool optimized_huffman; // huffman tables are not the standard tables
+    bool has_thumbnail; // exif contains a thumbnail
+} JpegInfo;
+
+// read jpeg header without decoding image. returns false if not a valid jpeg
+bool jpeg_read_info(FILE *f, JpegInfo &info);
+
 // Known exif tags ids
 enum {
     Tag_Compression       = 0x0103,// U_SHORT
@@ -1,6 +1,7 @@
 /* This file is a part of photoquick program, which is GPLv3 licensed */
 
 #include "inpaint.h"
+#include <QThreadPool>
 
 #define TIME_START auto start = std::chrono::steady_clock::now();
 #define TIME_STOP auto end = std::chrono::steady_clock::now();\
@@ -33,6 +34,13 @@ static int initSim = 0;
 }*/
 Inpaint:: Inpaint()
 {
+    vote = NULL;
+    vote_capacity = 0;
+    cancel = NULL;
+    pyramid_cache = NULL;
+    use_patch_index = false;
+    patch_index = NULL;
+    setQuality(INPAINT_BALANCED);
     // initialize similarity if not initialized before
     if (!initSim) {
         double base[11] = {1.0, 0.99, 0.96, 0.83, 0.38, 0.11, 0.02, 0.005, 0.0006, 0.0001, 0};
@@ -50,6 +58,26 @@ Inpaint:: Inpaint()
     }
 }
 
+// Iterations stop early when the NNF energy or the filled pixels
+// stop improving by more than the tolerance of the preset.
+// INPAINT_BEST never stops early, and runs the full number of iterations.
+void
+Inpaint:: setQuality(int quality)
+{
+    switch (quality) {
+    case INPAINT_FAST:
+        nnf_tolerance = 0.01;
+        em_tolerance = 1.5;
+        break;
+    case INPAINT_BEST:
+        nnf_tolerance = 0;
+        em_tolerance = 0;
+        break;
+    default:
+        nnf_tolerance = 0.002;
+        em_tolerance = 0.5;
+    }
+}
 
 QImage
 Inpaint:: inpaint(QImage input, QImage mask_img, int radius)
@@ -67,7 +95,11 @@ Inpaint:: inpaint(QImage input, QImage mask_img, int radius)
     // build pyramid of downscaled images
     pyramid.append(source);
     while (source->width>radius && source->height>radius) {
-        source = source->downsample();
+        int level = pyramid.size();
+        if (pyramid_cache && pyramid_cache->canCrop(cache_rect, level))
+            source = pyramid_cache->crop(cache_rect, level, source);
+        else
+            source = source->downsample();
         pyramid.append(source);
     }
     int maxlevel = pyramid.size();
@@ -79,6 +111,7 @@ Inpaint:: inpaint(QImage input, QImage mask_img, int radius)
         source = this->pyramid.at(level);
 
         debug("initialize NNF...\n");
+        findFixedLinks(source);
 
         if (level==maxlevel-1) {
             // at first, we use the same image for target and source
@@ -91,18 +124,26 @@ Inpaint:: inpaint(QImage input, QImage mask_img, int radius)
                     target->setMask(x, y, 0);
 
             nnf_SourceToTarget = new NNF(source, target, radius);
+            nnf_SourceToTarget->cancel = cancel;
+            nnf_SourceToTarget->fixed = fixed.data();
             nnf_SourceToTarget->randomize();
 
             nnf_TargetToSource = new NNF(target, source, radius);
+            nnf_TargetToSource->cancel = cancel;
+            nnf_TargetToSource->fixed = fixed.data();
             nnf_TargetToSource->randomize();
         }
         else {
             // then, we use the rebuilt (upscaled) target
             // and re-use the previous NNF as initial guess
             NNF* new_nnf = new NNF(source, target, radius);
+            new_nnf->cancel = cancel;
+            new_nnf->fixed = fixed.data();
             new_nnf->initializeNNF(nnf_SourceToTarget);
 
             NNF* new_nnf_rev = new NNF(target, source, radius);
+            new_nnf_rev->cancel = cancel;
+            new_nnf_rev->fixed = fixed.data();
             new_nnf_rev->initializeNNF(nnf_TargetToSource);
 
             delete nnf_TargetToSource->input; // delete previous target
@@ -112,40 +153,50 @@ Inpaint:: inpaint(QImage input, QImage mask_img, int radius)
             nnf_SourceToTarget = new_nnf;
             nnf_TargetToSource = new_nnf_rev;
         }
+        // links found in this area by previous calls are better initial guess
+        if (pyramid_cache)
+            pyramid_cache->seedLinks(nnf_TargetToSource, cache_rect, level, fixed.data());
+        // target is searched in source, which does not change in this level
+        if (use_patch_index) {
+            delete patch_index;
+            patch_index = new PatchIndex(source, radius);
+            nnf_TargetToSource->index = patch_index;
+        }
         target = this->ExpectationMaximization(level);
+        if (target==NULL) {
+            debug("inpaint cancelled\n");
+            break;
+        }
+        if (pyramid_cache)
+            pyramid_cache->saveLinks(nnf_TargetToSource, cache_rect, level, fixed.data());
+        // the result of last level is the final output, so not sent as preview
+        if (levelFinished && level>1)
+            levelFinished(target->image.copy());
     }
-    QImage output = target->image;
+    QImage output;
+    if (target!=NULL)
+        output = target->image;
 
     delete target;
+    free(vote);
+    vote = NULL;
+    vote_capacity = 0;
     delete nnf_TargetToSource->input;
     delete nnf_TargetToSource;
     delete nnf_SourceToTarget;
+    delete patch_index;
+    patch_index = NULL;
     while (!pyramid.isEmpty())
         delete pyramid.takeLast();
     return output;
 }
 
-double** allocVote(int w, int h)
-{
-    w *= 4;
-    int len = h * sizeof(double*) + w*h * sizeof(double);
-    double **arr = (double**) calloc(1,len);
-    if (arr==NULL){
-        printf("could not allocate enough memory for vote");
-        exit(1);
-    }
-    double *ptr = (double*)(arr + h);
-    for (int i = 0; i < h; i++)
-        arr[i] = (ptr + w*i);
-    return arr;
-}
 // EM-Like algorithm (see "PatchMatch" - page 6)
 // Returns a double sized target image
 MaskedImage*
 Inpaint:: ExpectationMaximization(int level)
 {
     int emloop, x, y, H, W;
-    double **vote;
 
     int iterEM = 1+2*level;
     int iterNNF = MIN(7,1+level);
@@ -172,7 +223,7 @@ Inpaint:: ExpectationMaximization(int level)
         // we force the link between unmasked patch in source/target
         for ( y=0 ; y<H ; ++y)
             for ( x=0 ; x<W; ++x)
-                if (!source->containsMasked(x, y, this->radius)) {
+                if (fixed[y*W+x]) {
                     this->nnf_SourceToTarget->field[y][x][0] = x;
                     this->nnf_SourceToTarget->field[y][x][1] = y;
                     this->nnf_SourceToTarget->field[y][x][2] = 0;
@@ -182,14 +233,17 @@ Inpaint:: ExpectationMaximization(int level)
         W = newtarget->width;
         for ( y=0 ; y<H ; ++y)
             for ( x=0 ; x<W ; ++x)
-                if (!source->containsMasked(x, y, this->radius)) {
+                if (fixed[y*W+x]) {
                     this->nnf_TargetToSource->field[y][x][0] = x;
                     this->nnf_TargetToSource->field[y][x][1] = y;
                     this->nnf_TargetToSource->field[y][x][2] = 0;
                 }
         // -- minimize the NNF
-        this->nnf_SourceToTarget->minimizeNNF(iterNNF);
-        this->nnf_TargetToSource->minimizeNNF(iterNNF);
+        this->nnf_SourceToTarget->minimizeNNF(iterNNF, nnf_tolerance);
+        this->nnf_TargetToSource->minimizeNNF(iterNNF, nnf_tolerance);
+        // newtarget is still owned by the NNFs, which are freed by inpaint()
+        if (isCancelled())
+            return NULL;
 
         // -- Now we rebuild the target using best patches from source
         upscaled = 0;
@@ -207,7 +261,7 @@ Inpaint:: ExpectationMaximization(int level)
         // --- EXPECTATION STEP ---
 
         // votes for best patch from NNF Source->Target (completeness) and Target->Source (coherence)
-        vote = allocVote(newtarget->width, newtarget->height);
+        clearVote(newtarget->width, newtarget->height);
 
         ExpectationStep(this->nnf_SourceToTarget, 1, vote, newsource, upscaled);
         ExpectationStep(this->nnf_TargetToSource, 0, vote, newsource, upscaled);
@@ -217,60 +271,185 @@ Inpaint:: ExpectationMaximization(int level)
         // compile votes and update pixel values
         MaximizationStep(newtarget, vote);
 
-        free(vote);
+        // if the filled area hardly changed, skip to the last iteration
+        // which builds the target for the next level
+        if (!upscaled && emloop < iterEM-1 && em_tolerance > 0) {
+            double change = pixelChange(nnf_TargetToSource->input, newtarget, source);
+            if (change < em_tolerance) {
+                debug("EM converged after %d of %d iterations\n", emloop, iterEM);
+                emloop = iterEM-1;
+            }
+        }
     }
     //printf("\n");
 
     return newtarget;
 }
 
-
-// Expectation Step : vote for best estimations of each pixel
+// mark the patches of source which do not contain any masked pixel.
+// these are linked to same position in both NNFs.
 void
-Inpaint:: ExpectationStep(NNF* nnf, int sourceToTarget, double** vote, MaskedImage* source, int upscale)
+Inpaint:: findFixedLinks(MaskedImage *source)
 {
-    int y, x, H, W, xp, yp, dp, dy, dx;
-    int xs,ys,xt,yt;
-    int*** field = nnf->field;
-    int R = nnf->S;
-    double w;
+    int W = source->width;
+    int H = source->height;
+    int S = radius;
+    std::vector<uchar> tmp(W*H);
+    fixed.resize(W*H);
+    // dilate mask horizontally, then vertically
+    #pragma omp parallel for
+    for (int y=0; y<H; y++) {
+        uchar *mask_row = source->mask[y];
+        for (int x=0; x<W; x++) {
+            uchar m = 0;
+            for (int dx=MAX(x-S,0); dx<=MIN(x+S,W-1); dx++)
+                m |= mask_row[dx];
+            tmp[y*W+x] = m;
+        }
+    }
+    #pragma omp parallel for
+    for (int y=0; y<H; y++) {
+        for (int x=0; x<W; x++) {
+            uchar m = 0;
+            for (int dy=MAX(y-S,0); dy<=MIN(y+S,H-1); dy++)
+                m |= tmp[dy*W+x];
+            fixed[y*W+x] = !m;
+        }
+    }
+}
 
-    H = nnf->input->height;
-    W = nnf->input->width;
-    for ( y=0 ; y<H ; ++y) {
-        for ( x=0 ; x<W; ++x) { // x,y = center pixel of patch in input
+bool
+Inpaint:: isCancelled()
+{
+    return cancel!=NULL && *cancel;
+}
 
-            // xp,yp = center pixel of best corresponding patch in output
-            xp=field[y][x][0];
-            yp=field[y][x][1];
-            dp=field[y][x][2];
+// mean absolute difference of channel values between two targets of
+// same size, calculated only over the pixels that are masked in source
+double pixelChange(MaskedImage *prev, MaskedImage *curr, MaskedImage *source)
+{
+    long long sum = 0, count = 0;
+    int len = curr->width*curr->height;
+    uchar *mask = source->mask[0];
 
-            // similarity measure between the two patches
-            w = similarity[dp];
+    #pragma omp parallel for reduction(+:sum,count)
+    for (int i=0; i<len; i++) {
+        if (!mask[i])
+            continue;
+        QRgb a = prev->data[i], b = curr->data[i];
+        sum += abs(qRed(a)-qRed(b)) + abs(qGreen(a)-qGreen(b)) + abs(qBlue(a)-qBlue(b));
+        count += 3;
+    }
+    return count ? double(sum)/count : 0;
+}
 
-            // vote for each pixel inside the input patch
-            for ( dy=-R ; dy<=R ; ++dy) {
-                for ( dx=-R ; dx<=R; ++dx) {
+// vote buffer holds {r, g, b, weight} for each pixel of the target.
+// it is allocated once and reused for each EM iteration and pyramid level
+void
+Inpaint:: clearVote(int w, int h)
+{
+    size_t len = (size_t)w*h*4;
+    if (len > vote_capacity) {
+        free(vote);
+        vote = (float*) malloc(len*sizeof(float));
+        if (vote==NULL){
+            printf("could not allocate enough memory for vote");
+            exit(1);
+        }
+        vote_capacity = len;
+    }
+    memset(vote, 0, len*sizeof(float));
+}
 
-                    // get corresponding pixel in output patch
-                    if (sourceToTarget)
-                    { xs=x+dx; ys=y+dy; xt=xp+dx; yt=yp+dy;}
-                    else
-                    { xs=xp+dx; ys=yp+dy; xt=x+dx; yt=y+dy; }
+// number of target rows processed by a thread at a time in ExpectationStep()
+#define VOTE_BAND_H 16
 
-                    if (xs<0 || xs>=W) continue;
+// Expectation Step : vote for best estimations of each pixel
+/* Patches are bucketed by the row of their center in the target, then each
+   thread gathers the votes for its own band of target rows. So the vote
+   buffer is written by one thread only, and no locking is required.
+*/
+void
+Inpaint:: ExpectationStep(NNF* nnf, int sourceToTarget, float* vote, MaskedImage* source, int upscale)
+{
+    int*** field = nnf->field;
+    int R = nnf->S;
+    int H = nnf->input->height;
+    int W = nnf->input->width;
+    int vote_w = source->width;// same as the new target width
+    // bucket key is target row of the patch center, shifted by R, so that
+    // patches lying partly above the first row are also kept
+    int nkeys = H + 2*R;
+    std::vector<int> bucket_start(nkeys+1, 0);
+    std::vector<int> bucket(W*H);
+
+    for (int y=0; y<H; ++y) {
+        for (int x=0; x<W; ++x) {
+            int yt = sourceToTarget ? field[y][x][1] : y;
+            if (yt < -R || yt >= H+R) continue;
+            bucket_start[yt+R+1]++;
+        }
+    }
+    for (int k=0; k<nkeys; k++)
+        bucket_start[k+1] += bucket_start[k];
+    std::vector<int> fill(bucket_start.begin(), bucket_start.end()-1);
+    for (int y=0; y<H; ++y) {
+        for (int x=0; x<W; ++x) {
+            int yt = sourceToTarget ? field[y][x][1] : y;
+            if (yt < -R || yt >= H+R) continue;
+            bucket[fill[yt+R]++] = y*W + x;
+        }
+    }
+
+    int band_h = MAX(VOTE_BAND_H, 2*R+1);
+    int bands = (H + band_h - 1)/band_h;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int band=0; band<bands; band++)
+    {
+        int y0 = band*band_h;
+        int y1 = MIN(y0+band_h, H);
+        // patches whose center row lies in [y0-R, y1+R) may vote inside this band
+        for (int k=y0; k<y1+2*R; k++)
+        {
+            for (int i=bucket_start[k]; i<bucket_start[k+1]; i++)
+            {
+                int x = bucket[i] % W;// x,y = center pixel of patch in input
+                int y = bucket[i] / W;
+                // xp,yp = center pixel of best corresponding patch in output
+                int xp = field[y][x][0];
+                int yp = field[y][x][1];
+                // similarity measure between the two patches
+                float w = similarity[field[y][x][2]];
+
+                int xs0, ys0, xt0, yt0;
+                if (sourceToTarget)
+                { xs0=x; ys0=y; xt0=xp; yt0=yp; }
+                else
+                { xs0=xp; ys0=yp; xt0=x; yt0=y; }
+
+                // vote for each pixel inside the input patch
+                for (int dy=-R ; dy<=R ; ++dy) {
+                    int ys = ys0+dy, yt = yt0+dy;
+                    if (yt<y0 || yt>=y1) continue;// belongs to other band
                     if (ys<0 || ys>=H) continue;
-                    if (xt<0 || xt>=W) continue;
-                    if (yt<0 || yt>=H) continue;
-
-                    // add vote for the value
-                    if (upscale) {
-                        weightedCopy(source, 2*xs,   2*ys,   vote, 2*xt,   2*yt,   w);
-                        weightedCopy(source, 2*xs+1, 2*ys,   vote, 2*xt+1, 2*yt,   w);
-                        weightedCopy(source, 2*xs,   2*ys+1, vote, 2*xt,   2*yt+1, w);
-                        weightedCopy(source, 2*xs+1, 2*ys+1, vote, 2*xt+1, 2*yt+1, w);
-                    } else {
-                        weightedCopy(source, xs, ys, vote, xt, yt, w);
+                    for (int dx=-R ; dx<=R; ++dx) {
+                        // get corresponding pixel in output patch
+                        int xs = xs0+dx, xt = xt0+dx;
+                        if (xs<0 || xs>=W) continue;
+                        if (xt<0 || xt>=W) continue;
+
+                        // add vote for the value
+                        if (upscale) {
+                            float *v0 = vote + 4*((2*yt)*vote_w + 2*xt);
+                            float *v1 = v0 + 4*vote_w;
+                            weightedCopy(source, 2*xs,   2*ys,   v0,   w);
+                            weightedCopy(source, 2*xs+1, 2*ys,   v0+4, w);
+                            weightedCopy(source, 2*xs,   2*ys+1, v1,   w);
+                            weightedCopy(source, 2*xs+1, 2*ys+1, v1+4, w);
+                        } else {
+                            weightedCopy(source, xs, ys, vote + 4*(yt*vote_w + xt), w);
+                        }
                     }
                 }
             }
@@ -278,35 +457,35 @@ Inpaint:: ExpectationStep(NNF* nnf, int sourceToTarget, double** vote, MaskedIma
     }
 }
 
-void weightedCopy(MaskedImage* src, int xs, int ys, double** vote, int xd,int yd, double w)
+void weightedCopy(MaskedImage* src, int xs, int ys, float* vote, float w)
 {
-    if (src->isMasked(xs, ys))
+    if (src->mask[ys][xs])
         return;
-
-    vote[yd][ 4*xd ] += w*src->getSample(xs, ys, 0);
-    vote[yd][4*xd+1] += w*src->getSample(xs, ys, 1);
-    vote[yd][4*xd+2] += w*src->getSample(xs, ys, 2);
-    vote[yd][4*xd+3] += w;
+    QRgb clr = src->data[ys*src->width + xs];
+    vote[0] += w*qRed(clr);
+    vote[1] += w*qGreen(clr);
+    vote[2] += w*qBlue(clr);
+    vote[3] += w;
 }
 
 
 // Maximization Step : Maximum likelihood of target pixel
-void MaximizationStep(MaskedImage* target, double** vote)
-{
-    int y, x, H, W, r, g, b;
-    H = target->height;
-    W = target->width;
-    for( y=0 ; y<H ; ++y){
-        for( x=0 ; x<W ; ++x){
-            if (vote[y][4*x+3]>0) {
-                r = (int) (vote[y][ 4*x ]/vote[y][4*x+3]);
-                g = (int) (vote[y][4*x+1]/vote[y][4*x+3]);
-                b = (int) (vote[y][4*x+2]/vote[y][4*x+3]);
-
-                target->setSample(x, y, 0, r );
-                target->setSample(x, y, 1, g );
-                target->setSample(x, y, 2, b );
-                target->setMask(x, y, 0);
+void MaximizationStep(MaskedImage* target, float* vote)
+{
+    int H = target->height;
+    int W = target->width;
+    #pragma omp parallel for
+    for (int y=0 ; y<H ; ++y) {
+        float *vote_row = vote + 4*y*W;
+        QRgb *row = target->data + y*W;
+        uchar *mask_row = target->mask[y];
+        #pragma omp simd
+        for (int x=0 ; x<W ; ++x) {
+            float *v = vote_row + 4*x;
+            if (v[3]>0) {
+                float inv = 1.0f/v[3];
+                row[x] = qRgb(v[0]*inv, v[1]*inv, v[2]*inv);
+                mask_row[x] = 0;
             }
         }
     }
@@ -322,6 +501,9 @@ NNF:: NNF(MaskedImage* input, MaskedImage* output, int patchsize)
     this->input = input;
     this->output= output;
     this->S = patchsize;
+    this->cancel = NULL;
+    this->fixed = NULL;
+    this->index = NULL;
     fieldW = input->width;
     fieldH = input->height;
     // allocate field
@@ -376,7 +558,13 @@ NNF:: initializeNNF()
     int iter=0, maxretry=20;
     for (int y=0;y<this->fieldH;++y) {
         for (int x=0;x<this->fieldW;++x) {
-
+            // no need to search for a link, if it is fixed
+            if (fixed!=NULL && fixed[y*fieldW+x]) {
+                this->field[y][x][0] = x;
+                this->field[y][x][1] = y;
+                this->field[y][x][2] = 0;
+                continue;
+            }
             this->field[y][x][2] = this->distance(x,y,  this->field[y][x][0],this->field[y][x][1]);
             // if the distance is INFINITY (all pixels masked ?), try to find a better link
             iter=0;
@@ -390,26 +578,53 @@ NNF:: initializeNNF()
     }
 }
 
+// sum of distances of all links in NN-field
+long long
+NNF:: energy()
+{
+    long long sum = 0;
+    for (int y=0; y<fieldH; y++)
+        for (int x=0; x<fieldW; x++)
+            sum += field[y][x][2];
+    return sum;
+}
+
 // multi-pass NN-field minimization (see "PatchMatch" - page 4)
+/* Stops before completing all passes if a pass reduces energy by less than
+   tolerance (fraction of current energy). tolerance=0 runs all passes.
+*/
 void
-NNF:: minimizeNNF(int pass)
+NNF:: minimizeNNF(int pass, double tolerance)
 {
     int min_x=0, min_y=0;
     int max_x=this->input->width-1;
     int max_y=this->input->height-1;
+    long long prev_energy = tolerance>0 ? energy() : 0;
     // multi-pass minimization
     for (int i=0;i<pass;i++) {
         // scanline order
-        for (int y=min_y;y<=max_y;++y)
+        for (int y=min_y;y<=max_y;++y) {
+            if (cancel!=NULL && *cancel)
+                return;
             for (int x=min_x;x<max_x;++x)
                 if (this->field[y][x][2]>0)
                     minimizeLinkNNF(x,y,+1);
-
+        }
         // reverse scanline order
-        for (int y=max_y;y>=min_y;y--)
+        for (int y=max_y;y>=min_y;y--) {
+            if (cancel!=NULL && *cancel)
+                return;
             for (int x=max_x;x>=min_x;x--)
                 if (this->field[y][x][2]>0)
                     minimizeLinkNNF(x,y,-1);
+        }
+
+        if (tolerance>0) {
+            long long curr_energy = energy();
+            if (prev_energy-curr_energy <= tolerance*prev_energy)
+                break;
+            prev_energy = curr_energy;
+        }
     }
 }
 
@@ -440,8 +655,21 @@ NNF:: minimizeLinkNNF(int x, int y, int dir)
             this->field[y][x][2] = dp;
         }
     }
+    //Search in index, then refine with random search in a small window
+    if (index!=NULL) {
+        int xs[PATCH_INDEX_MAX_K], ys[PATCH_INDEX_MAX_K];
+        int n = index->query(input, x, y, xs, ys, PATCH_INDEX_MAX_K);
+        for (int i=0; i<n; i++) {
+            dp = distance(x,y, xs[i],ys[i]);
+            if (dp<this->field[y][x][2]) {
+                this->field[y][x][0] = xs[i];
+                this->field[y][x][1] = ys[i];
+                this->field[y][x][2] = dp;
+            }
+        }
+    }
     //Random search
-    wi=this->output->width;
+    wi = index!=NULL ? MIN(4, this->output->width) : this->output->width;
     xpi=this->field[y][x][0];
     ypi=this->field[y][x][1];
     int r=0;
@@ -505,17 +733,20 @@ MaskedImage:: MaskedImage(int width, int height)
 {
     this->width = width;
     this->height = height;
-    this->image = QImage(width, height, QImage::Format_RGB888);
+    this->image = QImage(width, height, QImage::Format_RGB32);
+    this->data = (QRgb*) image.bits();
     this->mask = allocMask(width, height);
 }
 
 //create mask from an image
 MaskedImage:: MaskedImage(QImage image)
 {
-    if (image.format() != QImage::Format_RGB888) {
-        image = image.convertToFormat(QImage::Format_RGB888);
+    // 32 bit pixels are aligned, and rows of RGB32 image do not have padding
+    if (image.format() != QImage::Format_RGB32) {
+        image = image.convertToFormat(QImage::Format_RGB32);
     }
     this->image = image;
+    this->data = (QRgb*) this->image.bits();// detach from the source image
     this->width = image.width();
     this->height = image.height();
     this->mask = allocMask(width, height);
@@ -524,8 +755,7 @@ MaskedImage:: MaskedImage(QImage image)
 void
 MaskedImage:: copyMaskFrom(uchar **oldmask)
 {
-    for (int y=0; y<height; y++)
-        memcpy(mask[y], oldmask[y], width);
+    memcpy(mask[0], oldmask[0], width*height);
 }
 
 void
@@ -554,13 +784,13 @@ MaskedImage:: ~MaskedImage()
 int
 MaskedImage:: getSample(int x, int y, int band)
 {
-    return ((uchar*)image.constScanLine(y))[x*3+band];
+    return ((uchar*)(data + y*width + x))[band];
 }
 
 void
 MaskedImage:: setSample(int x, int y, int band, int value)
 {
-    ((uchar*)image.scanLine(y))[x*3+band] = value;
+    ((uchar*)(data + y*width + x))[band] = value;
 }
 
 int
@@ -599,7 +829,8 @@ MaskedImage:: containsMasked(int x, int y, int S)
 MaskedImage*
 MaskedImage:: copy()
 {
-    MaskedImage *newimg = new MaskedImage(image.copy());
+    MaskedImage *newimg = new MaskedImage(width, height);
+    memcpy(newimg->data, data, width*height*sizeof(QRgb));
     newimg->copyMaskFrom(mask);
     return newimg;
 }
@@ -609,57 +840,89 @@ MaskedImage:: copy()
 MaskedImage*
 MaskedImage:: downsample()
 {
-    int kernel[6] = {1,5,10,10,5,1};
-    int xk, yk, ky, k;
-    int r=0,g=0,b=0,m=0,ksum=0;
+    MaskedImage* newimage = new MaskedImage(width/2, height/2);
+    downsampleRect(newimage, 0, 0, newimage->width, newimage->height);
+    return newimage;
+}
+
+// compute pixels of the downsampled image out (half size of this image)
+// in the area x0 <= x < x1, y0 <= y < y1 of out.
+/* The 6x6 kernel {1,5,10,10,5,1} is applied separably. Masked pixels do not
+   contribute, which keeps the kernel separable as the mask is applied in the
+   horizontal pass, and the vertical pass simply sums the row results.
+*/
+void
+MaskedImage:: downsampleRect(MaskedImage *out, int x0, int y0, int x1, int y1)
+{
+    const int kernel[6] = {1,5,10,10,5,1};
     int H = height;
     int W = width;
-    int newW=W/2, newH=H/2;
+    int newW = x1-x0;
+    // input rows used by the kernel
+    int in_y0 = MAX(2*y0-2, 0);
+    int in_y1 = MIN(2*y1+2, H);
+    if (newW<=0 || y1<=y0)
+        return;
 
-    MaskedImage* newimage = new MaskedImage(newW, newH);
-    for (int y=0;y<H-1;y+=2) {
-        for (int x=0;x<W-1;x+=2) {
-            r=0; g=0; b=0; m=0; ksum=0;
+    // horizontal pass : {r, g, b, ksum, unmasked count} for each input row
+    int *hsum = (int*) malloc((in_y1-in_y0)*newW*5*sizeof(int));
 
-            for (int dy=-2;dy<=3;++dy) {
-                yk=y+dy;
-                if (yk<0 || yk>=H)
+    #pragma omp parallel for
+    for (int y=in_y0; y<in_y1; y++) {
+        QRgb *row = data + y*W;
+        uchar *mask_row = mask[y];
+        int *hrow = hsum + (y-in_y0)*newW*5;
+        for (int i=0; i<newW; i++) {
+            int x = 2*(x0+i);
+            int r=0, g=0, b=0, ksum=0, m=0;
+            for (int dx=-2; dx<=3; ++dx) {
+                int xk = x+dx;
+                if (xk<0 || xk>=W || mask_row[xk])
                     continue;
-                ky = kernel[2+dy];
-                for (int dx=-2;dx<=3;++dx) {
-                    xk = x+dx;
-                    if (xk<0 || xk>=W)
-                        continue;
-
-                    if (this->mask[yk][xk])
-                        continue;
-
-                    k = kernel[2+dx]*ky;
-                    r+= k*this->getSample(xk, yk, 0);
-                    g+= k*this->getSample(xk, yk, 1);
-                    b+= k*this->getSample(xk, yk, 2);
-                    ksum+=k;
-                    m++;
-                }
+                int k = kernel[2+dx];
+                r += k*qRed(row[xk]);
+                g += k*qGreen(row[xk]);
+                b += k*qBlue(row[xk]);
+                ksum += k;
+                m++;
             }
-            if (ksum>0) {
-                r/=ksum;
-                g/=ksum;
-                b/=ksum;
+            hrow[5*i] = r;
+            hrow[5*i+1] = g;
+            hrow[5*i+2] = b;
+            hrow[5*i+3] = ksum;
+            hrow[5*i+4] = m;
+        }
+    }
+    // vertical pass
+    #pragma omp parallel for
+    for (int j=y0; j<y1; j++) {
+        int y = 2*j;
+        QRgb *new_row = out->data + j*out->width;
+        uchar *new_mask_row = out->mask[j];
+        for (int i=0; i<newW; i++) {
+            int r=0, g=0, b=0, ksum=0, m=0;
+            for (int dy=-2; dy<=3; ++dy) {
+                int yk = y+dy;
+                if (yk<0 || yk>=H)
+                    continue;
+                int k = kernel[2+dy];
+                int *in = hsum + ((yk-in_y0)*newW + i)*5;
+                r += k*in[0];
+                g += k*in[1];
+                b += k*in[2];
+                ksum += k*in[3];
+                m += in[4];
             }
-
             if (m!=0) {
-                newimage->setSample(x/2, y/2, 0, r);
-                newimage->setSample(x/2, y/2, 1, g);
-                newimage->setSample(x/2, y/2, 2, b);
-                newimage->setMask(x/2, y/2, 0);
+                new_row[x0+i] = qRgb(r/ksum, g/ksum, b/ksum);
+                new_mask_row[x0+i] = 0;
             } else {
-                newimage->setMask(x/2, y/2, 1);
+                new_row[x0+i] = qRgb(0,0,0);
+                new_mask_row[x0+i] = 1;
             }
         }
     }
-
-    return newimage;
+    free(hsum);
 }
 
 // return an upscaled image
@@ -667,27 +930,453 @@ MaskedImage*
 MaskedImage:: upscale(int newW,int newH)
 {
     MaskedImage* newimage = new MaskedImage(newW, newH);
+    // source column of each pixel in a row is same for all rows
+    std::vector<int> xs_table(newW);
+    for (int x=0; x<newW; x++)
+        xs_table[x] = (x*width)/newW;
 
+    #pragma omp parallel for
     for (int y=0;y<newH;y++) {
         int ys = (y*height)/newH;
+        QRgb *row = data + ys*width;
+        uchar *mask_row = mask[ys];
+        QRgb *new_row = newimage->data + y*newW;
+        uchar *new_mask_row = newimage->mask[y];
         for (int x=0;x<newW;x++) {
-            // original pixel
-            int xs = (x*width)/newW;
-
-            // copy to new image
-            if (!this->mask[ys][xs]) {
-                newimage->setSample(x, y, 0, this->getSample(xs, ys, 0));
-                newimage->setSample(x, y, 1, this->getSample(xs, ys, 1));
-                newimage->setSample(x, y, 2, this->getSample(xs, ys, 2));
-                newimage->setMask(x, y, 0);
-            } else {
-                newimage->setMask(x, y, 1);
-            }
+            // copy original pixel to new image
+            int xs = xs_table[x];
+            new_row[x] = row[xs];
+            new_mask_row[x] = mask_row[xs];
         }
     }
     return newimage;
 }
 
+// ****************** Pyramid Cache ********************
+
+PyramidCache:: PyramidCache()
+{
+}
+
+// levels are built when first needed, as it takes a while for large image
+void
+PyramidCache:: build(QImage img)
+{
+    MaskedImage *source = new MaskedImage(img);
+    memset(source->mask[0], 0, source->width*source->height);
+    MaskedImage *base = source;
+    for (int i=0; i<PYRAMID_CACHE_LEVELS && source->width>1 && source->height>1; i++) {
+        source = source->downsample();
+        levels.append(source);
+        links.append(std::vector<int>());
+    }
+    delete base;
+}
+
+PyramidCache:: ~PyramidCache()
+{
+    while (!levels.isEmpty())
+        delete levels.takeLast();
+}
+
+// recompute the downsampled pixels affected by change of rect in image
+void
+PyramidCache:: update(QImage img, QRect rect)
+{
+    if (levels.isEmpty())
+        return;
+    // first level is made from a part of image, with a margin enough to
+    // exclude the pixels at its boundary, which lack some neighbours
+    int ex = MAX(rect.x()-8, 0) & ~1;
+    int ey = MAX(rect.y()-8, 0) & ~1;
+    int ex1 = MIN(rect.x()+rect.width()+8, img.width());
+    int ey1 = MIN(rect.y()+rect.height()+8, img.height());
+    MaskedImage *part = new MaskedImage(img.copy(ex, ey, ex1-ex, ey1-ey));
+    memset(part->mask[0], 0, part->width*part->height);
+    MaskedImage *part_small = part->downsample();
+    delete part;
+
+    MaskedImage *level1 = levels.at(0);
+    int x0 = MAX((rect.x()-3)/2, 0);
+    int y0 = MAX((rect.y()-3)/2, 0);
+    int x1 = MIN((rect.x()+rect.width()+1)/2+1, level1->width);
+    int y1 = MIN((rect.y()+rect.height()+1)/2+1, level1->height);
+    for (int y=y0; y<y1; y++) {
+        memcpy(level1->data + y*level1->width + x0,
+               part_small->data + (y-ey/2)*part_small->width + (x0-ex/2), (x1-x0)*sizeof(QRgb));
+    }
+    delete part_small;
+    // other levels are made from the previous level
+    for (int i=1; i<levels.size(); i++) {
+        MaskedImage *level = levels.at(i);
+        x0 = MAX((x0-3)/2, 0);
+        y0 = MAX((y0-3)/2, 0);
+        x1 = MIN((x1+1)/2+1, level->width);
+        y1 = MIN((y1+1)/2+1, level->height);
+        levels.at(i-1)->downsampleRect(level, x0, y0, x1, y1);
+    }
+}
+
+// check if a level of the pyramid of image part rect can be taken from cache
+bool
+PyramidCache:: canCrop(QRect rect, int level)
+{
+    if (level<1 || level>levels.size())
+        return false;
+    int align = 1<<level;
+    if (rect.x()%align!=0 || rect.y()%align!=0)
+        return false;
+    MaskedImage *cached = levels.at(level-1);
+    return ((rect.x()+rect.width())>>level) <= cached->width &&
+            ((rect.y()+rect.height())>>level) <= cached->height;
+}
+
+// store the links of nnf (target to source) of rect area of a level.
+// links of fixed patches are not stored, as those link to themselves.
+void
+PyramidCache:: saveLinks(NNF *nnf, QRect rect, int level, const uchar *fixed)
+{
+    if (!canCrop(rect, level))
+        return;
+    MaskedImage *cached = levels.at(level-1);
+    std::vector<int> &field = links[level-1];
+    if (field.empty())
+        field.assign(cached->width*cached->height, -1);
+    int ox = rect.x()>>level;
+    int oy = rect.y()>>level;
+    for (int y=0; y<nnf->fieldH; y++) {
+        for (int x=0; x<nnf->fieldW; x++) {
+            if (fixed[y*nnf->fieldW+x])
+                continue;
+            int xs = nnf->field[y][x][0];
+            int ys = nnf->field[y][x][1];
+            if (xs<0 || ys<0 || xs>=nnf->output->width || ys>=nnf->output->height)
+                continue;
+            field[(oy+y)*cached->width + ox+x] = (oy+ys)*cached->width + ox+xs;
+        }
+    }
+}
+
+// use the links stored by previous inpaint calls as initial guess of nnf,
+// where those are closer than current links. links pointing outside of rect
+// are dropped, and links to the masked (changed) area lose to the current
+// random or upscaled links, as masked pixels add to distance.
+void
+PyramidCache:: seedLinks(NNF *nnf, QRect rect, int level, const uchar *fixed)
+{
+    if (!canCrop(rect, level) || links[level-1].empty())
+        return;
+    int W = levels.at(level-1)->width;
+    const std::vector<int> &field = links[level-1];
+    int ox = rect.x()>>level;
+    int oy = rect.y()>>level;
+    #pragma omp parallel for
+    for (int y=0; y<nnf->fieldH; y++) {
+        for (int x=0; x<nnf->fieldW; x++) {
+            if (fixed[y*nnf->fieldW+x])
+                continue;
+            int link = field[(oy+y)*W + ox+x];
+            if (link<0)
+                continue;
+            int xs = link%W - ox;
+            int ys = link/W - oy;
+            if (xs<0 || ys<0 || xs>=nnf->output->width || ys>=nnf->output->height)
+                continue;
+            int dist = nnf->distance(x, y, xs, ys);
+            if (dist < nnf->field[y][x][2]) {
+                nnf->field[y][x][0] = xs;
+                nnf->field[y][x][1] = ys;
+                nnf->field[y][x][2] = dist;
+            }
+        }
+    }
+}
+
+// returns a level of pyramid of rect area, prev is the previous level of it.
+// the pixels near masked pixels of prev, or near the pixels of prev which
+// differ from cache (because of masked pixels nearby) are downsampled again.
+MaskedImage*
+PyramidCache:: crop(QRect rect, int level, MaskedImage *prev)
+{
+    MaskedImage *cached = levels.at(level-1);
+    int ox = rect.x()>>level;
+    int oy = rect.y()>>level;
+    MaskedImage *out = new MaskedImage(prev->width/2, prev->height/2);
+    for (int y=0; y<out->height; y++) {
+        memcpy(out->data + y*out->width, cached->data + (oy+y)*cached->width + ox,
+                out->width*sizeof(QRgb));
+    }
+    memset(out->mask[0], 0, out->width*out->height);
+    // find the area containing masked or changed pixels
+    MaskedImage *cached_prev = level>1 ? levels.at(level-2) : NULL;
+    int px = rect.x()>>(level-1);
+    int py = rect.y()>>(level-1);
+    int mx0 = prev->width, my0 = prev->height, mx1 = -1, my1 = -1;
+    for (int y=0; y<prev->height; y++) {
+        uchar *mask_row = prev->mask[y];
+        QRgb *row = prev->data + y*prev->width;
+        QRgb *cached_row = cached_prev ? cached_prev->data + (py+y)*cached_prev->width + px : NULL;
+        for (int x=0; x<prev->width; x++) {
+            if (mask_row[x] || (cached_row && row[x]!=cached_row[x])) {
+                mx0 = MIN(mx0, x);
+                mx1 = MAX(mx1, x);
+                my0 = MIN(my0, y);
+                my1 = MAX(my1, y);
+            }
+        }
+    }
+    if (mx1<0)
+        return out;
+    prev->downsampleRect(out, MAX((mx0-3)/2, 0), MAX((my0-3)/2, 0),
+                    MIN((mx1+2)/2+1, out->width), MIN((my1+2)/2+1, out->height));
+    return out;
+}
+
+
+// ****************** Patch Index ********************
+/* Approximate nearest patch search. Patches of an image are projected to a
+   few principal components (PCA), and a kd-tree is built on the projected
+   points. The candidates it returns are checked with the real patch distance,
+   so it only replaces the random search of PatchMatch, not propagation.
+*/
+PatchIndex:: PatchIndex(MaskedImage *image, int S)
+{
+    this->S = S;
+    int W = image->width;
+    int H = image->height;
+    int len = 3*(2*S+1)*(2*S+1);
+    // valid patches are inside the image and do not contain masked pixels,
+    // as distanceMaskedImage() adds penalty for those
+    for (int y=S+1; y<H-S-1; y++) {
+        for (int x=S+1; x<W-S-1; x++) {
+            if (!image->containsMasked(x, y, S)) {
+                pos_x.push_back(x);
+                pos_y.push_back(y);
+            }
+        }
+    }
+    int count = pos_x.size();
+    if (count < 16)
+        return;
+    // mean and covariance from a subset of patches
+    int step = MAX(count/4096, 1);
+    std::vector<float> vec(len);
+    std::vector<double> sum(len, 0), cov(len*len, 0);
+    int n = 0;
+    for (int i=0; i<count; i+=step) {
+        getPatch(image, pos_x[i], pos_y[i], vec.data(), NULL);
+        for (int a=0; a<len; a++) {
+            sum[a] += vec[a];
+            for (int b=a; b<len; b++)
+                cov[a*len+b] += vec[a]*vec[b];
+        }
+        n++;
+    }
+    mean.resize(len);
+    for (int a=0; a<len; a++)
+        mean[a] = sum[a]/n;
+    for (int a=0; a<len; a++) {
+        for (int b=a; b<len; b++) {
+            cov[a*len+b] = cov[a*len+b]/n - mean[a]*mean[b];
+            cov[b*len+a] = cov[a*len+b];
+        }
+    }
+    // principal components by power iteration with deflation
+    basis.resize(PATCH_INDEX_DIM*len);
+    std::vector<double> v(len), w(len);
+    for (int d=0; d<PATCH_INDEX_DIM; d++) {
+        for (int a=0; a<len; a++)
+            v[a] = 1.0 + (a*(d+1))%7;
+        double lambda = 0;
+        for (int iter=0; iter<50; iter++) {
+            for (int a=0; a<len; a++) {
+                w[a] = 0;
+                for (int b=0; b<len; b++)
+                    w[a] += cov[a*len+b]*v[b];
+            }
+            double norm = 0;
+            for (int a=0; a<len; a++)
+                norm += w[a]*w[a];
+            norm = sqrt(norm);
+            if (norm < 1.0e-9)
+                break;
+            for (int a=0; a<len; a++)
+                v[a] = w[a]/norm;
+            lambda = norm;
+        }
+        for (int a=0; a<len; a++) {
+            basis[d*len+a] = v[a];
+            for (int b=0; b<len; b++)
+                cov[a*len+b] -= lambda*v[a]*v[b];
+        }
+    }
+    // project all patches
+    points.resize(count*PATCH_INDEX_DIM);
+    #pragma omp parallel
+    {
+        std::vector<float> patch(len);
+        #pragma omp for
+        for (int i=0; i<count; i++) {
+            getPatch(image, pos_x[i], pos_y[i], patch.data(), NULL);
+            project(patch.data(), &points[i*PATCH_INDEX_DIM]);
+        }
+    }
+    // build kd-tree
+    order.resize(count);
+    for (int i=0; i<count; i++)
+        order[i] = i;
+    buildTree(0, count);
+}
+
+// copy channel values of patch centered at (x,y) to vec. masked or outside
+// pixels take the mean value, so that they do not affect projection.
+void
+PatchIndex:: getPatch(MaskedImage *image, int x, int y, float *vec, const float *fill)
+{
+    int i = 0;
+    for (int dy=-S; dy<=S; dy++) {
+        int yk = y+dy;
+        for (int dx=-S; dx<=S; dx++) {
+            int xk = x+dx;
+            if (fill!=NULL && (xk<0 || xk>=image->width || yk<0 || yk>=image->height
+                                    || image->mask[yk][xk])) {
+                vec[i] = fill[i]; vec[i+1] = fill[i+1]; vec[i+2] = fill[i+2];
+            }
+            else {
+                QRgb clr = image->data[yk*image->width + xk];
+                vec[i] = qRed(clr); vec[i+1] = qGreen(clr); vec[i+2] = qBlue(clr);
+            }
+            i += 3;
+        }
+    }
+}
+
+void
+PatchIndex:: project(const float *vec, float *out)
+{
+    int len = mean.size();
+    for (int d=0; d<PATCH_INDEX_DIM; d++) {
+        const float *b = &basis[d*len];
+        float sum = 0;
+        for (int a=0; a<len; a++)
+            sum += b[a]*(vec[a]-mean[a]);
+        out[d] = sum;
+    }
+}
+
+// build node for points order[begin..end), returns index of node
+int
+PatchIndex:: buildTree(int begin, int end)
+{
+    int node_id = nodes.size();
+    nodes.push_back(KdNode());
+    if (end-begin <= PATCH_INDEX_LEAF_SIZE) {
+        nodes[node_id].dim = -1;
+        nodes[node_id].begin = begin;
+        nodes[node_id].end = end;
+        return node_id;
+    }
+    // split along the dimension of largest spread, at median
+    int dim = 0;
+    float max_spread = -1;
+    for (int d=0; d<PATCH_INDEX_DIM; d++) {
+        float lo = 1.0e30f, hi = -1.0e30f;
+        for (int i=begin; i<end; i++) {
+            float val = points[order[i]*PATCH_INDEX_DIM + d];
+            lo = MIN(lo, val);
+            hi = MAX(hi, val);
+        }
+        if (hi-lo > max_spread) {
+            max_spread = hi-lo;
+            dim = d;
+        }
+    }
+    int mid = (begin+end)/2;
+    std::nth_element(order.begin()+begin, order.begin()+mid, order.begin()+end,
+        [this, dim](int a, int b) {
+            return points[a*PATCH_INDEX_DIM + dim] < points[b*PATCH_INDEX_DIM + dim];
+        });
+    float split = points[order[mid]*PATCH_INDEX_DIM + dim];
+    int left = buildTree(begin, mid);
+    int right = buildTree(mid, end);
+    nodes[node_id].dim = dim;
+    nodes[node_id].split = split;
+    nodes[node_id].left = left;
+    nodes[node_id].right = right;
+    return node_id;
+}
+
+// find upto k patches of index similar to the patch of image at (x,y).
+// returns number of patches found, their positions are stored in xs and ys
+int
+PatchIndex:: query(MaskedImage *image, int x, int y, int *xs, int *ys, int k)
+{
+    if (nodes.empty())
+        return 0;
+    // query runs for each link in every NNF pass, so buffers of each
+    // thread are reused, instead of allocating those for every query
+    static thread_local std::vector<float> patch;
+    static thread_local std::vector<std::pair<float,int> > queue;
+    patch.resize(mean.size());
+    queue.clear();
+    float q[PATCH_INDEX_DIM];
+    getPatch(image, x, y, patch.data(), mean.data());
+    project(patch.data(), q);
+
+    // best bin first search, visits a limited number of leaves
+    float best_dist[PATCH_INDEX_MAX_K];
+    int best[PATCH_INDEX_MAX_K];
+    int found = 0;
+    k = MIN(k, PATCH_INDEX_MAX_K);
+    typedef std::pair<float,int> Branch;  // {distance to bin, node}
+    std::greater<Branch> nearer;    // min-heap of branches
+    queue.push_back(Branch(0, 0));
+    int leaves = 0;
+    while (!queue.empty() && leaves<PATCH_INDEX_MAX_LEAVES) {
+        std::pop_heap(queue.begin(), queue.end(), nearer);
+        Branch branch = queue.back();
+        queue.pop_back();
+        if (found==k && branch.first >= best_dist[found-1])
+            break;
+        int node_id = branch.second;
+        // descend to a leaf, keeping the other side for later
+        while (nodes[node_id].dim>=0) {
+            KdNode &node = nodes[node_id];
+            float diff = q[node.dim] - node.split;
+            int near = diff<0 ? node.left : node.right;
+            int far = diff<0 ? node.right : node.left;
+            queue.push_back(Branch(branch.first + diff*diff, far));
+            std::push_heap(queue.begin(), queue.end(), nearer);
+            node_id = near;
+        }
+        leaves++;
+        KdNode &leaf = nodes[node_id];
+        for (int i=leaf.begin; i<leaf.end; i++) {
+            const float *p = &points[order[i]*PATCH_INDEX_DIM];
+            float dist = 0;
+            for (int d=0; d<PATCH_INDEX_DIM; d++)
+                dist += (p[d]-q[d])*(p[d]-q[d]);
+            if (found==k && dist >= best_dist[found-1])
+                continue;
+            // insert into sorted list of best
+            int j = (found<k) ? found++ : found-1;
+            while (j>0 && best_dist[j-1] > dist) {
+                best_dist[j] = best_dist[j-1];
+                best[j] = best[j-1];
+                j--;
+            }
+            best_dist[j] = dist;
+            best[j] = order[i];
+        }
+    }
+    for (int i=0; i<found; i++) {
+        xs[i] = pos_x[best[i]];
+        ys[i] = pos_y[best[i]];
+    }
+    return found;
+}
+
+
 // distance between two patches in two images
 int distanceMaskedImage(MaskedImage *source,int xs,int ys, MaskedImage *target,int xt,int yt, int S)
 {
@@ -695,9 +1384,8 @@ int distanceMaskedImage(MaskedImage *source,int xs,int ys, MaskedImage *target,i
     long double wsum=0, ssdmax = 9*255*255;
     int xks, yks;
     int xkt, ykt;
-    long double ssd;
     long res;
-    int s_value, t_value, s_gx, t_gx, s_gy, t_gy;
+    int sW = source->width, tW = target->width;
 
     // for each pixel in the source patch
     for (int dy=-S ; dy<=S ; ++dy ) {
@@ -713,32 +1401,35 @@ int distanceMaskedImage(MaskedImage *source,int xs,int ys, MaskedImage *target,i
             if ( yks<1 || yks>=source->height-1 ) {distance++; continue;}
 
             // cannot use masked pixels as a valid source of information
-            if (source->isMasked(xks, yks)) {distance++; continue;}
+            if (source->mask[yks][xks]) {distance++; continue;}
 
             // corresponding pixel in the target patch
             if (xkt<1 || xkt>=target->width-1) {distance++; continue;}
             if (ykt<1 || ykt>=target->height-1) {distance++; continue;}
 
             // cannot use masked pixels as a valid source of information
-            if (target->isMasked(xkt, ykt)) {distance++; continue;}
-
-            ssd=0;
-            for (int band=0; band<3; ++band) {
-                // pixel values
-                s_value = source->getSample(xks, yks, band);
-                t_value = source->getSample(xkt, ykt, band);
-
-                // pixel horizontal gradients (Gx)
-                s_gx = 128+(source->getSample(xks+1, yks, band) - source->getSample(xks-1, yks, band))/2;
-                t_gx = 128+(target->getSample(xkt+1, ykt, band) - target->getSample(xkt-1, ykt, band))/2;
-
-                // pixel vertical gradients (Gy)
-                s_gy = 128+(source->getSample(xks, yks+1, band) - source->getSample(xks, yks-1, band))/2;
-                t_gy = 128+(target->getSample(xkt, ykt+1, band) - target->getSample(xkt, ykt-1, band))/2;
-
-                ssd += pow((long double)s_value-t_value , 2); // distance between values in [0,255^2]
-                ssd += pow((long double)s_gx-t_gx , 2); // distance between Gx in [0,255^2]
-                ssd += pow((long double)s_gy-t_gy , 2); // distance between Gy in [0,255^2]
+            if (target->mask[ykt][xkt]) {distance++; continue;}
+
+            QRgb *s = source->data + yks*sW + xks;
+            QRgb *t = target->data + ykt*tW + xkt;
+            // pixel values (value of target is also taken from source image)
+            QRgb s_val = s[0], t_val = source->data[ykt*sW + xkt];
+            // neighbours for horizontal (Gx) and vertical (Gy) gradients
+            QRgb s_l = s[-1], s_r = s[1], s_u = s[-sW], s_d = s[sW];
+            QRgb t_l = t[-1], t_r = t[1], t_u = t[-tW], t_d = t[tW];
+
+            int ssd = 0;
+            for (int shift=0; shift<24; shift+=8) {
+                int s_value = (s_val>>shift) & 0xff;
+                int t_value = (t_val>>shift) & 0xff;
+                int s_gx = 128+(int((s_r>>shift) & 0xff) - int((s_l>>shift) & 0xff))/2;
+                int t_gx = 128+(int((t_r>>shift) & 0xff) - int((t_l>>shift) & 0xff))/2;
+                int s_gy = 128+(int((s_d>>shift) & 0xff) - int((s_u>>shift) & 0xff))/2;
+                int t_gy = 128+(int((t_d>>shift) & 0xff) - int((t_u>>shift) & 0xff))/2;
+
+                ssd += SQR(s_value-t_value); // distance between values in [0,255^2]
+                ssd += SQR(s_gx-t_gx); // distance between Gx in [0,255^2]
+                ssd += SQR(s_gy-t_gy); // distance between Gy in [0,255^2]
             }
 
             // add pixel distance to global patch distance
@@ -752,11 +1443,274 @@ int distanceMaskedImage(MaskedImage *source,int xs,int ys, MaskedImage *target,i
 }
 
 
+// ****************** Fast Marching Inpaint ********************
+/* Telea's method ("An Image Inpainting Technique Based on the Fast Marching
+   Method", 2004). The masked region is filled from its boundary inwards, in
+   the order of distance from the boundary. Each pixel is estimated from the
+   known pixels within the radius, weighted by direction, distance and level.
+   This is much faster than PatchMatch, but only good for thin defects like
+   scratches, dust spots or wires.
+*/
+enum {
+    FMM_KNOWN,
+    FMM_BAND,
+    FMM_INSIDE
+};
+
+#define FMM_INF 1.0e6f
+
+typedef struct {
+    float T;
+    int pos;
+} FMMPoint;
+
+struct FMMCompare {
+    bool operator()(const FMMPoint &a, const FMMPoint &b) const {
+        return a.T > b.T;
+    }
+};
+
+typedef std::priority_queue<FMMPoint, std::vector<FMMPoint>, FMMCompare> FMMHeap;
+
+// solve eikonal equation |grad T| = 1 from two neighbours
+static float
+fmmSolve(int a, int b, uchar *flag, float *T)
+{
+    float sol = FMM_INF;
+    if (flag[a]==FMM_KNOWN) {
+        if (flag[b]==FMM_KNOWN) {
+            float d = 2.0f - (T[a]-T[b])*(T[a]-T[b]);
+            if (d >= 0) {
+                float r = sqrtf(d);
+                float s = (T[a]+T[b]-r)/2;
+                if (s>=T[a] && s>=T[b])
+                    sol = s;
+                else {
+                    s += r;
+                    if (s>=T[a] && s>=T[b])
+                        sol = s;
+                }
+            }
+        }
+        else
+            sol = 1+T[a];
+    }
+    else if (flag[b]==FMM_KNOWN)
+        sol = 1+T[b];
+    return sol;
+}
+
+// estimate the value of pixel (x,y) from known pixels around it
+static void
+fmmInpaintPixel(int x, int y, int W, int H, int radius, QRgb *data, uchar *flag, float *T)
+{
+    int pos = y*W+x;
+    // gradient of T (normal to the boundary)
+    float gradT_x = 0, gradT_y = 0;
+    if (x>0 && x<W-1 && flag[pos-1]!=FMM_INSIDE && flag[pos+1]!=FMM_INSIDE)
+        gradT_x = (T[pos+1]-T[pos-1])/2;
+    else if (x<W-1 && flag[pos+1]!=FMM_INSIDE)
+        gradT_x = T[pos+1]-T[pos];
+    else if (x>0 && flag[pos-1]!=FMM_INSIDE)
+        gradT_x = T[pos]-T[pos-1];
+    if (y>0 && y<H-1 && flag[pos-W]!=FMM_INSIDE && flag[pos+W]!=FMM_INSIDE)
+        gradT_y = (T[pos+W]-T[pos-W])/2;
+    else if (y<H-1 && flag[pos+W]!=FMM_INSIDE)
+        gradT_y = T[pos+W]-T[pos];
+    else if (y>0 && flag[pos-W]!=FMM_INSIDE)
+        gradT_y = T[pos]-T[pos-W];
+
+    float sum[3] = {0,0,0};
+    float wsum = 0;
+    for (int l=MAX(y-radius,0); l<=MIN(y+radius,H-1); l++) {
+        for (int k=MAX(x-radius,0); k<=MIN(x+radius,W-1); k++) {
+            int p = l*W+k;
+            if (flag[p]==FMM_INSIDE)
+                continue;
+            float rx = x-k, ry = y-l;
+            float len2 = rx*rx + ry*ry;
+            if (len2 > radius*radius || len2==0)
+                continue;
+            float dir = fabsf(rx*gradT_x + ry*gradT_y);
+            if (dir < 1.0e-6f) dir = 1.0e-6f;
+            float dst = 1.0f/(len2*sqrtf(len2));
+            float lev = 1.0f/(1.0f+fabsf(T[p]-T[pos]));
+            float w = dir*dst*lev;
+            // first order approximation using the gradient of image at (k,l)
+            QRgb clr = data[p];
+            int val[3] = {qRed(clr), qGreen(clr), qBlue(clr)};
+            bool has_l = k>0 && flag[p-1]!=FMM_INSIDE;
+            bool has_r = k<W-1 && flag[p+1]!=FMM_INSIDE;
+            bool has_u = l>0 && flag[p-W]!=FMM_INSIDE;
+            bool has_d = l<H-1 && flag[p+W]!=FMM_INSIDE;
+            for (int c=0; c<3; c++) {
+                int shift = 16-8*c;
+                float gx = 0, gy = 0;
+                if (has_l && has_r)
+                    gx = (int((data[p+1]>>shift)&0xff) - int((data[p-1]>>shift)&0xff))/2.0f;
+                else if (has_r)
+                    gx = int((data[p+1]>>shift)&0xff) - val[c];
+                else if (has_l)
+                    gx = val[c] - int((data[p-1]>>shift)&0xff);
+                if (has_u && has_d)
+                    gy = (int((data[p+W]>>shift)&0xff) - int((data[p-W]>>shift)&0xff))/2.0f;
+                else if (has_d)
+                    gy = int((data[p+W]>>shift)&0xff) - val[c];
+                else if (has_u)
+                    gy = val[c] - int((data[p-W]>>shift)&0xff);
+                sum[c] += w*(val[c] + gx*rx + gy*ry);
+            }
+            wsum += w;
+        }
+    }
+    if (wsum==0)
+        return;
+    int r = roundf(sum[0]/wsum);
+    int g = roundf(sum[1]/wsum);
+    int b = roundf(sum[2]/wsum);
+    data[pos] = qRgb(clamp(r,0,255), clamp(g,0,255), clamp(b,0,255));
+}
+
+QImage inpaintTelea(QImage input, QImage mask_img, int radius)
+{
+    QImage img = input.convertToFormat(QImage::Format_RGB32);
+    int W = img.width();
+    int H = img.height();
+    QRgb *data = (QRgb*) img.bits();
+    std::vector<uchar> flag_buf(W*H, FMM_KNOWN);
+    std::vector<float> T_buf(W*H, 0);
+    uchar *flag = flag_buf.data();
+    float *T = T_buf.data();
+    FMMHeap heap;
+
+    for (int y=0; y<H; y++) {
+        QRgb *mask_row = (QRgb*)mask_img.constScanLine(y);
+        for (int x=0; x<W; x++) {
+            if (qRed(mask_row[x])) {
+                flag[y*W+x] = FMM_INSIDE;
+                T[y*W+x] = FMM_INF;
+            }
+        }
+    }
+    // the known pixels touching the masked region form the initial band
+    for (int y=0; y<H; y++) {
+        for (int x=0; x<W; x++) {
+            int pos = y*W+x;
+            if (flag[pos]!=FMM_KNOWN)
+                continue;
+            if ((x>0 && flag[pos-1]==FMM_INSIDE) || (x<W-1 && flag[pos+1]==FMM_INSIDE) ||
+                (y>0 && flag[pos-W]==FMM_INSIDE) || (y<H-1 && flag[pos+W]==FMM_INSIDE)) {
+                flag[pos] = FMM_BAND;
+                heap.push({0, pos});
+            }
+        }
+    }
+    const int dx[4] = {-1, 0, 1, 0};
+    const int dy[4] = {0, -1, 0, 1};
+    while (!heap.empty()) {
+        FMMPoint pt = heap.top();
+        heap.pop();
+        if (flag[pt.pos]==FMM_KNOWN)
+            continue;   // already processed with smaller T
+        flag[pt.pos] = FMM_KNOWN;
+        int x = pt.pos%W, y = pt.pos/W;
+        for (int n=0; n<4; n++) {
+            int xn = x+dx[n], yn = y+dy[n];
+            if (xn<0 || xn>=W || yn<0 || yn>=H)
+                continue;
+            int pos = yn*W+xn;
+            if (flag[pos]==FMM_KNOWN)
+                continue;
+            // solve T from the four quadrants around the pixel
+            int l = xn>0 ? pos-1 : pos, r = xn<W-1 ? pos+1 : pos;
+            int u = yn>0 ? pos-W : pos, d = yn<H-1 ? pos+W : pos;
+            float t = MIN(MIN(fmmSolve(u, l, flag, T), fmmSolve(d, l, flag, T)),
+                          MIN(fmmSolve(u, r, flag, T), fmmSolve(d, r, flag, T)));
+            if (flag[pos]==FMM_INSIDE) {
+                T[pos] = t;
+                fmmInpaintPixel(xn, yn, W, H, radius, data, flag, T);
+                flag[pos] = FMM_BAND;
+                heap.push({t, pos});
+            }
+            else if (t < T[pos]) {
+                T[pos] = t;
+                heap.push({t, pos});
+            }
+        }
+    }
+    return img;
+}
+
+// returns the width of the thickest part of the mask (in pixels).
+// uses exact euclidean distance transform of the masked pixels
+int maskThickness(QImage mask_img)
+{
+    int W = mask_img.width();
+    int H = mask_img.height();
+    std::vector<uchar> mask(W*H);
+    for (int y=0; y<H; y++) {
+        QRgb *mask_row = (QRgb*)mask_img.constScanLine(y);
+        for (int x=0; x<W; x++)
+            mask[y*W+x] = qRed(mask_row[x]) ? 255 : 0;
+    }
+    // squared distance of masked pixels to nearest unmasked pixel
+    std::vector<float> dist(W*H);
+    distanceTransform(mask.data(), W, H, dist.data(), true);
+    float max_dist = 0;
+    for (int i=0; i<W*H; i++)
+        max_dist = MAX(max_dist, dist[i]);
+    if (max_dist >= W*W + H*H) // whole image is masked
+        return MAX(W,H);
+    // distance to nearest unmasked pixel is measured from both sides
+    return 2*sqrtf(max_dist) - 1;
+}
+
 // ---------------------------------------------------------------------
 //************************ Inpainting GUI *****************************-
 // _____________________________________________________________________
 
 
+// *********************** Inpaint Task ************************
+
+InpaintTask:: InpaintTask(QImage input, QImage mask, int method, int quality,
+                            std::atomic<bool> *cancel) : QRunnable()
+{
+    this->input = input;
+    this->mask = mask;
+    this->method = method;
+    this->quality = quality;
+    this->cancel = cancel;
+    this->cache = NULL;
+    this->use_index = false;
+}
+
+void
+InpaintTask:: run()
+{
+    // thin scratches and spots are filled by fast marching method
+    if (method==INPAINT_AUTO)
+        method = maskThickness(mask)<=12 ? INPAINT_FAST_MARCHING : INPAINT_PATCHMATCH;
+    QImage output;
+    if (method==INPAINT_FAST_MARCHING) {
+        output = inpaintTelea(input, mask, 5);
+    }
+    else {
+        Inpaint inp;
+        inp.setQuality(quality);
+        inp.cancel = cancel;
+        if (cache && cache->levels.isEmpty())
+            cache->build(image);
+        inp.pyramid_cache = cache;
+        inp.use_patch_index = use_index;
+        inp.cache_rect = rect;
+        inp.levelFinished = [this](QImage preview) { emit levelFinished(preview); };
+        output = inp.inpaint(input, mask, 2);
+    }
+    if (*cancel)
+        output = QImage();
+    emit inpaintFinished(output);
+}
+
 // *********************** Inpaint Dialog ************************
 
 InpaintDialog:: InpaintDialog(QImage &img, QWidget *parent) : QDialog(parent)
@@ -786,7 +1740,13 @@ InpaintDialog:: InpaintDialog(QImage &img, QWidget *parent) : QDialog(parent)
     QSettings settings(this);
     settings.beginGroup("Inpaint");
     int brush_size = settings.value("BrushSize", 16).toInt();
+    int quality = settings.value("Quality", INPAINT_BALANCED).toInt();
+    int method = settings.value("Method", INPAINT_AUTO).toInt();
+    bool use_index = settings.value("SearchIndex", false).toBool();
     settings.endGroup();
+    searchIndexBtn->setChecked(use_index);
+    methodCombo->setCurrentIndex(method);
+    qualityCombo->setCurrentIndex(quality);
 
     brushSizeLabel->setText(QString("Brush Size : %1").arg(brush_size));
 
@@ -865,13 +1825,14 @@ InpaintDialog:: scaleBy(float factor)
         return;
     scale = factor;
     if (factor == 1.0)
-        this->main_pixmap = QPixmap::fromImage(image);
+        canvas->setImage(image);
     else {
         Qt::TransformationMode mode = factor<1.0? Qt::SmoothTransformation: Qt::FastTransformation;
-        this->main_pixmap = QPixmap::fromImage(image.scaled(scale*image.width(), scale*image.height(),
+        canvas->setImage(image.scaled(scale*image.width(), scale*image.height(),
                         Qt::IgnoreAspectRatio, mode));
     }
-    canvas->setPixmap(main_pixmap);
+    canvas->clearOverlay();
+    canvas->clearBrush();
 }
 
 void
@@ -894,14 +1855,7 @@ InpaintDialog:: setBrushSize(int size)
 void
 InpaintDialog:: initMask()
 {
-    if (scale==1.0)
-        this->image_scaled = image;
-    else {
-        Qt::TransformationMode mode = scale<1.0? Qt::SmoothTransformation: Qt::FastTransformation;
-        this->image_scaled = image.scaled(main_pixmap.width(), main_pixmap.height(),
-                            Qt::IgnoreAspectRatio, mode);
-    }
-    this->mask = QImage(main_pixmap.width(), main_pixmap.height(), QImage::Format_RGB32);
+    this->mask = QImage(canvas->base.width(), canvas->base.height(), QImage::Format_RGB32);
     mask.fill(Qt::black);
     min_x = mask.width()-1;
     min_y = mask.height()-1;
@@ -969,27 +1923,23 @@ InpaintDialog:: updateMaskedArea(QPoint start, QPoint end)
     int max_mask_y = MIN(MAX(start.y(), end.y())+brush_pen.width()/2, mask.height()-1);
     int mask_w = max_mask_x-mask_x +1;
     int mask_h = max_mask_y-mask_y +1;
-    QImage img = image_scaled.copy(mask_x, mask_y, mask_w, mask_h);
-    for (int y=0; y<mask_h; ++y){
-        QRgb *img_row = (QRgb*)img.scanLine(y);
-        QRgb *mask_row = (QRgb*)mask.constScanLine(y+mask_y);
-        for (int x=0; x<mask_w; ++x) {
-            int clr = img_row[x];
-            if (qRed(mask_row[x+mask_x])) { // mask color = rgba(0,255,0,127)
-                int g = 0.5*255 + 0.5*qGreen(clr);
-                img_row[x] = qRgb(0.5*qRed(clr), g, 0.5*qBlue(clr));
-            }
-        }
+    // show masked area in green in overlay layer
+    for (int y=mask_y; y<=max_mask_y; ++y){
+        QRgb *row = (QRgb*)canvas->overlay.scanLine(y);
+        QRgb *mask_row = (QRgb*)mask.constScanLine(y);
+        for (int x=mask_x; x<=max_mask_x; ++x)
+            row[x] = qRed(mask_row[x]) ? MASK_COLOR : 0;
     }
-    painter.begin(&main_pixmap);
-    painter.drawImage(QPoint(mask_x, mask_y), img);
-    painter.end();
-    canvas->setPixmap(main_pixmap);
+    canvas->updateArea(QRect(mask_x, mask_y, mask_w, mask_h));
 }
 
 void
 InpaintDialog:: inpaint()
 {
+    if (busy) {
+        cancel_inpaint = true;
+        return;
+    }
     if (mask.isNull()) return;
     // check if there is masked pixel
     min_x = MAX(min_x, 0);
@@ -1031,36 +1981,101 @@ InpaintDialog:: inpaint()
     y = y/scale;
     w = w/scale;
     h = h/scale;
+    // align the area to the cached pyramid, so that its levels can be reused
+    int align = 1<<PYRAMID_CACHE_LEVELS;
+    w += x%align;
+    x -= x%align;
+    h += y%align;
+    y -= y%align;
     // the inpaint function has a bug that causes slight error to the
     // right and bottom boundary if width and height are odd. so make them even
     if (w%2!=0) {
-        w -= 1;
-        //decrease 1px to left if mask is closer to right boundary of image
-        if (min_x > mask.width()-max_x-1) x+=1;
+        if (x+w < image.width())
+            w += 1;
+        else {
+            w -= 1;
+            //decrease 1px to left if mask is closer to right boundary of image
+            if (min_x > mask.width()-max_x-1) x+=1;
+        }
     }
     if (h%2!=0) {
-        h -= 1;
-        if (min_y > mask.height()-max_y-1) y+=1;
+        if (y+h < image.height())
+            h += 1;
+        else {
+            h -= 1;
+            if (min_y > mask.height()-max_y-1) y+=1;
+        }
     }
     // draw mask area
-    painter.begin(&main_pixmap);
+    QRect rect(x*scale, y*scale, w*scale, h*scale);
+    painter.begin(&canvas->brush);
     painter.setPen(Qt::black);
-    painter.drawRect(x*scale, y*scale, w*scale-1, h*scale-1);
+    painter.drawRect(rect.adjusted(0,0,-1,-1));
     painter.end();
-    canvas->setPixmap(main_pixmap);
-    waitFor(30);
+    canvas->updateBrushArea(rect);
     // get mask and input image for inpaint
     QImage input_img = image.copy(x, y, w, h);
     QImage mask_img = mask.copy(x*scale, y*scale, w*scale, h*scale);
     if (scale!=1.0) mask_img = mask_img.scaled(w, h);
     // clear memory
     mask = QImage();
-    image_scaled = QImage();
     //input_img.save("input.png");
     //mask_img.save("mask.png");
-    // apply inpaint function
-    Inpaint inp;
-    QImage output = inp.inpaint(input_img, mask_img, 2);
+    // apply inpaint function in background
+    inpaint_rect = QRect(x, y, w, h);
+    busy = true;
+    cancel_inpaint = false;
+    frame->setEnabled(false);
+    canvas->setEnabled(false);
+    acceptBtn->setEnabled(false);
+    eraseBtn->setText("Stop");
+    statusbar->setText("Inpainting... click Stop to cancel");
+    // the cache is built by the task, if PatchMatch is used
+    if (pyramid_cache==NULL)
+        pyramid_cache = new PyramidCache();
+    InpaintTask *task = new InpaintTask(input_img, mask_img, methodCombo->currentIndex(),
+                                        qualityCombo->currentIndex(), &cancel_inpaint);
+    task->cache = pyramid_cache;
+    task->image = image;
+    task->rect = inpaint_rect;
+    task->use_index = searchIndexBtn->isChecked();
+    connect(task, SIGNAL(levelFinished(QImage)), this, SLOT(onInpaintPreview(QImage)));
+    connect(task, SIGNAL(inpaintFinished(QImage)), this, SLOT(onInpaintFinish(QImage)));
+    QThreadPool::globalInstance()->start(task);
+}
+
+// show the result of a coarse level over the area being inpainted
+void
+InpaintDialog:: onInpaintPreview(QImage preview)
+{
+    if (cancel_inpaint)
+        return;
+    QRect rect(inpaint_rect.x()*scale, inpaint_rect.y()*scale,
+                inpaint_rect.width()*scale, inpaint_rect.height()*scale);
+    painter.begin(&canvas->brush);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    painter.drawImage(rect, preview);
+    painter.end();
+    canvas->updateBrushArea(rect);
+}
+
+void
+InpaintDialog:: onInpaintFinish(QImage output)
+{
+    busy = false;
+    frame->setEnabled(true);
+    canvas->setEnabled(true);
+    acceptBtn->setEnabled(true);
+    eraseBtn->setText("Erase");
+    drawMaskBtn->setChecked(true);
+    if (output.isNull()) { // cancelled
+        statusbar->setText("Inpainting cancelled");
+        scaleBy(scale);
+        return;
+    }
+    statusbar->setText("Tip : To erase an area, draw over that area and click Erase");
+    int x = inpaint_rect.x();
+    int y = inpaint_rect.y();
     // add to undo stack
     redoStack.clear();
     redoBtn->setEnabled(false);
@@ -1069,7 +2084,6 @@ InpaintDialog:: inpaint()
     undoBtn->setEnabled(true);
     if (undoStack.size()>10)
         undoStack.removeFirst();
-    drawMaskBtn->setChecked(true);
     updateImageArea(x, y, output);
 }
 
@@ -1079,15 +2093,28 @@ InpaintDialog:: updateImageArea(int x, int y, QImage part)
     painter.begin(&image);
     painter.drawImage(QPoint(x,y), part);
     painter.end();
+    if (pyramid_cache)
+        pyramid_cache->update(image, QRect(x, y, part.width(), part.height()));
     scaleBy(scale);
 }
 
 void
 InpaintDialog:: done(int val)
 {
+    // wait until the background task stops
+    if (busy) {
+        cancel_inpaint = true;
+        while (busy)
+            waitFor(30);
+    }
+    delete pyramid_cache;
+    pyramid_cache = NULL;
     QSettings settings(this);
     settings.beginGroup("Inpaint");
     settings.setValue("BrushSize", brushSizeSlider->value());
+    settings.setValue("Quality", qualityCombo->currentIndex());
+    settings.setValue("Method", methodCombo->currentIndex());
+    settings.setValue("SearchIndex", searchIndexBtn->isChecked());
     settings.endGroup();
     QDialog::done(val);
 }
@@ -5,10 +5,17 @@
 #include <QSettings>
 #include <QPainter>
 #include <QMouseEvent>
+#include <QRunnable>
 #include <cmath>
 #include <chrono>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include "common.h"
 #include "canvas.h"
+#include "distance_transform.h"
 #include "ui_inpaint_dialog.h"
 
 #ifndef __PHOTOQUICK_INPAINT
@@ -17,8 +24,9 @@
 class MaskedImage
 {
 public:
-    uchar **mask;
-    QImage image;
+    uchar **mask;   // a byte plane, 1 = masked, 0 = unmasked
+    QImage image;   // Format_RGB32
+    QRgb *data;     // pixels of image, rows are contiguous
     int width, height;
     // member functions
     MaskedImage(QImage image);
@@ -33,12 +41,71 @@ public:
     int containsMasked(int x, int y, int S);
     MaskedImage* copy();
     MaskedImage* downsample();
+    void downsampleRect(MaskedImage *out, int x0, int y0, int x1, int y1);
     MaskedImage* upscale(int newW,int newH);
     ~MaskedImage();
 };
 
 int distanceMaskedImage(MaskedImage *source,int xs,int ys, MaskedImage *target,int xt,int yt, int S);
 
+// number of downsampled levels of whole image kept in PyramidCache
+#define PYRAMID_CACHE_LEVELS 3
+
+class NNF;
+
+// Downsampled levels of whole image, and the NNF links found in them,
+// reused by successive inpaint calls. only the parts changed by inpainting
+// are computed again.
+class PyramidCache
+{
+public:
+    QList<MaskedImage*> levels; // levels[i] is downsampled by 2^(i+1), has no masked pixel
+    // target to source links of previous inpaint calls in levels[i], stored as
+    // index of source pixel in levels[i] for each pixel, -1 if none
+    QList<std::vector<int> > links;
+    PyramidCache();
+    ~PyramidCache();
+    void build(QImage img);
+    void update(QImage img, QRect rect);
+    bool canCrop(QRect rect, int level);
+    MaskedImage* crop(QRect rect, int level, MaskedImage *prev);
+    void saveLinks(NNF *nnf, QRect rect, int level, const uchar *fixed);
+    void seedLinks(NNF *nnf, QRect rect, int level, const uchar *fixed);
+};
+
+// number of principal components used by PatchIndex
+#define PATCH_INDEX_DIM 8
+#define PATCH_INDEX_LEAF_SIZE 8
+// maximum number of candidates returned by a query
+#define PATCH_INDEX_MAX_K 2
+// number of kd-tree leaves checked in a query
+#define PATCH_INDEX_MAX_LEAVES 2
+
+typedef struct {
+    int dim;    // split dimension, -1 for leaf
+    float split;
+    int left, right;
+    int begin, end; // range of points in leaf
+} KdNode;
+
+// PCA + kd-tree index of the patches of an image, for nearest patch search
+class PatchIndex
+{
+public:
+    int S;
+    std::vector<int> pos_x, pos_y;  // center of each indexed patch
+    std::vector<float> mean;
+    std::vector<float> basis;       // PATCH_INDEX_DIM principal components
+    std::vector<float> points;      // projected patches
+    std::vector<int> order;         // points sorted by kd-tree leaves
+    std::vector<KdNode> nodes;
+
+    PatchIndex(MaskedImage *image, int S);
+    void getPatch(MaskedImage *image, int x, int y, float *vec, const float *fill);
+    void project(const float *vec, float *out);
+    int buildTree(int begin, int end);
+    int query(MaskedImage *image, int x, int y, int *xs, int *ys, int k);
+};
 
 class NNF
 {
@@ -50,18 +117,32 @@ public:
     // Nearest-Neighbor Field 1 pixel = { target_x, target_y, distance_scaled }
     int ***field;
     int fieldW, fieldH;
+    // minimization stops when it becomes true
+    std::atomic<bool> *cancel;
+    // links of patches marked here are fixed to same position, and not searched
+    uchar *fixed;
+    // if set, it is used instead of random search in whole output image
+    PatchIndex *index;
     // functions
     NNF(MaskedImage *input, MaskedImage *output, int patchsize);
     ~NNF();
     void randomize();
     void initializeNNF(NNF *nnf);
     void initializeNNF();
-    void minimizeNNF(int pass);
+    long long energy();
+    void minimizeNNF(int pass, double tolerance=0);
     void minimizeLinkNNF(int x, int y, int dir);
     int distance(int x,int y, int xp,int yp);
 };
 
 
+// speed/quality presets of Inpaint
+enum {
+    INPAINT_FAST,
+    INPAINT_BALANCED,
+    INPAINT_BEST
+};
+
 class Inpaint
 {
 public:
@@ -72,28 +153,81 @@ public:
     NNF *nnf_SourceToTarget;
     // Pyramid of downsampled initial images
     QList<MaskedImage*> pyramid;
+    // if set, levels of pyramid are taken from it
+    PyramidCache *pyramid_cache;
+    QRect cache_rect;   // area of input image in pyramid_cache
+    // 1 for patches of source which do not contain masked pixels
+    std::vector<uchar> fixed;
+    // search index of source patches, built for each level if enabled
+    bool use_patch_index;
+    PatchIndex *patch_index;
+    // votes {r, g, b, weight} per pixel of target, reused in each EM iteration
+    float *vote;
+    size_t vote_capacity;
+    // convergence thresholds for NNF energy and EM pixel change
+    double nnf_tolerance;
+    double em_tolerance;
+    // inpainting is abandoned when it becomes true
+    std::atomic<bool> *cancel;
+    // called with the upscaled target, after each level of pyramid is done
+    std::function<void(QImage)> levelFinished;
 
     // functions
     Inpaint();
+    void setQuality(int quality);
+    bool isCancelled();
+    void findFixedLinks(MaskedImage *source);
     QImage inpaint(QImage input, QImage mask, int radius);
     MaskedImage* ExpectationMaximization(int level);
-    void ExpectationStep(NNF* nnf, int sourceToTarget, double** vote, MaskedImage* source, int upscale);
+    void clearVote(int w, int h);
+    void ExpectationStep(NNF* nnf, int sourceToTarget, float* vote, MaskedImage* source, int upscale);
 };
 
-void weightedCopy(MaskedImage* src, int xs, int ys, double** vote, int xd,int yd, double w);
-void MaximizationStep(MaskedImage* target, double** vote);
+void weightedCopy(MaskedImage* src, int xs, int ys, float* vote, float w);
+void MaximizationStep(MaskedImage* target, float* vote);
+double pixelChange(MaskedImage *prev, MaskedImage *curr, MaskedImage *source);
 
+// Fast Marching inpaint, for thin scratches and spots
+QImage inpaintTelea(QImage input, QImage mask, int radius);
+int maskThickness(QImage mask);
+
+// inpaint methods
+enum {
+    INPAINT_AUTO,
+    INPAINT_PATCHMATCH,
+    INPAINT_FAST_MARCHING
+};
 
 //*************** Inpainting GUI *******************
 
+// runs inpainting in a thread pool, the result is sent by signals
+class InpaintTask : public QObject, public QRunnable
+{
+    Q_OBJECT
+public:
+    QImage input;
+    QImage mask;
+    int method;
+    int quality;
+    bool use_index;
+    std::atomic<bool> *cancel;
+    PyramidCache *cache;
+    QImage image;   // whole image, to build the cache if it is empty
+    QRect rect;
+
+    InpaintTask(QImage input, QImage mask, int method, int quality, std::atomic<bool> *cancel);
+    void run();
+signals:
+    void levelFinished(QImage preview);
+    void inpaintFinished(QImage output);
+};
+
 class InpaintDialog : public QDialog, public Ui_InpaintDialog
 {
     Q_OBJECT
 public:
     QImage image; // original unchanged image
-    QImage image_scaled;
-    QImage mask;  // mask of same size as pixmap
-    QPixmap main_pixmap; // scaled pixmap to draw over
+    QImage mask;  // mask of same size as canvas
     bool mouse_pressed = false;
     float scale = 1.0;
     int min_x, min_y, max_x, max_y;
@@ -105,6 +239,10 @@ public:
     PaintCanvas *canvas;
     QList<HistoryItem> undoStack; // maximum 10 steps undo
     QList<HistoryItem> redoStack;
+    bool busy = false;  // inpainting is running in background
+    std::atomic<bool> cancel_inpaint;
+    QRect inpaint_rect; // area of image being inpainted
+    PyramidCache *pyramid_cache = NULL;
 
     void setBrushSize(int size);
     void scaleBy(float factor);
@@ -125,6 +263,8 @@ public slots:
     void zoomIn();
     void zoomOut();
     void inpaint();
+    void onInpaintPreview(QImage preview);
+    void onInpaintFinish(QImage output);
     void onMousePress(QPoint pos);
     void onMouseRelease(QPoint pos);
     void onMouseMove(QPoint pos);
@@ -6,24 +6,7 @@
 //*************** Intelligent Scissor and Manual Eraser ****************
 // _____________________________________________________________________
 
-typedef unsigned int uint;
-
-class IntBuffer
-{
-public:
-    uint *data;
-    int width;
-    int height;
-    IntBuffer(int width, int height);
-    ~IntBuffer();
-};
-
-void findOptimalPath(GradMap *grad_map, IntBuffer &dp_buff,
-                    int x1, int y1, int xs, int ys);
-std::vector<QPoint> plotShortPath(IntBuffer *dp_buff, int x1, int y1,
-                    int target_x, int target_y);
-
-void floodfill(QImage &img, QPoint pos, QRgb newColor);
+void fillPolygon(std::vector<QPoint> &polygon, uchar *coverage, int w, int h);
 
 
 void updateImageArea(QImage &dst, QImage &src, int pos_x, int pos_y);
@@ -164,6 +147,8 @@ IScissorDialog:: accept()
 void
 IScissorDialog:: done(int val)// gets called after accept() or reject()
 {
+    if (path_tree)
+        delete path_tree;
     if (grad_map)
         delete grad_map;
     QDialog::done(val);
@@ -177,8 +162,10 @@ IScissorDialog:: setBgColor(int type, QRgb bg_clr)
     if (type==TRANSPERANT)
         redraw();
     else {
-        //scaleImage();
-        QImage img(image_scaled.width(), image_scaled.height(), QImage::Format_RGB32);
+        // canvas->base may already have previous bg color, so transparent
+        // image is used
+        QImage image_scaled = scaledImage();
+        QImage img(image_scaled.size(), QImage::Format_RGB32);
         QRgb clr = (type==COLOR_WHITE) ? 0xffffff : bg_clr;
         img.fill(clr);
         painter.begin(&img);
@@ -188,18 +175,26 @@ IScissorDialog:: setBgColor(int type, QRgb bg_clr)
     }
 }
 
-void
-IScissorDialog:: scaleImage()
+// image scaled to current zoom level
+QImage
+IScissorDialog:: scaledImage()
 {
     if (scale == 1.0)
-        image_scaled = image;
-    else {
-        Qt::TransformationMode tfm_mode = scale<1.0? Qt::SmoothTransformation: Qt::FastTransformation;
-        image_scaled = image.scaled(scale*image.width(), scale*image.height(),
+        return image;
+    Qt::TransformationMode tfm_mode = scale<1.0? Qt::SmoothTransformation: Qt::FastTransformation;
+    return image.scaled(scale*image.width(), scale*image.height(),
                         Qt::IgnoreAspectRatio, tfm_mode);
-    }
+}
+
+// set scaled image to canvas, and in mask mode show mask in overlay layer
+void
+IScissorDialog:: scaleImage()
+{
+    QImage image_scaled = scaledImage();
+    canvas->setImage(image_scaled);
+    canvas->clearOverlay();
+    canvas->clearBrush();
     if (mode==MASK_MODE) {
-        // draw green mask over image_scaled
         QImage mask_scaled = mask;
         if (scale != 1.0)
             mask_scaled = mask.scaled(image_scaled.width(), image_scaled.height());
@@ -208,20 +203,15 @@ IScissorDialog:: scaleImage()
         for (int y=0; y<image_scaled.height(); y++){
             QRgb *row, *mask_row;
             #pragma omp critical
-            { row = (QRgb*) image_scaled.scanLine(y);
+            { row = (QRgb*) canvas->overlay.scanLine(y);
               mask_row = (QRgb*) mask_scaled.constScanLine(y); }
             for (int x=0; x<image_scaled.width(); x++){
-                if (qRed(mask_row[x])>127){
-                    QRgb clr = row[x];
-                    int g = 127+0.5*qGreen(clr);
-                    row[x] = qRgba(0.5*qRed(clr), g, 0.5*qBlue(clr), qAlpha(clr));
-                }
+                if (qRed(mask_row[x])>127)
+                    row[x] = MASK_COLOR;
             }
         }
+        canvas->updateArea(canvas->overlay.rect());
     }
-    // it makes drawing and conversion to QPixmap faster
-    if (image.format()==QImage::Format_ARGB32)
-        image_scaled = image_scaled.convertToFormat(QImage::Format_ARGB32_Premultiplied);
 }
 
 void
@@ -230,7 +220,6 @@ IScissorDialog:: redraw()
     scaleImage();
     if (tool_type==TOOL_ISCISSOR)
         drawFullPath();
-    canvas->setImage(image_scaled);
 }
 
 void
@@ -245,6 +234,10 @@ IScissorDialog:: onToolClick(int btn_id)
         shortPath.clear();
         fullPath.clear();
         redoStack.clear();
+        if (path_tree) {
+            delete path_tree;
+            path_tree = 0;
+        }
         if (grad_map) {
             delete grad_map;
             grad_map = 0;
@@ -353,7 +346,7 @@ IScissorDialog:: onMousePress_Eraser(QPoint pos)
 void
 IScissorDialog:: onMouseRelease_Eraser(QPoint)
 {
-    redraw();
+    // canvas is already updated while drawing
     int brush_w = eraserSizeSlider->value();// == brush.width() and mask pen width
 
     min_x = MAX(min_x - brush_w/2, 0);
@@ -394,13 +387,16 @@ IScissorDialog:: onMouseMove_Eraser(QPoint pos)
         painter.setPen(pen);
         painter.drawLine(mouse_pos, pos);
         painter.end();
+        // overlapping strokes must not make it darker
         pen.setColor(QColor(0,255,0, 127));
         pen.setWidth(w*scale);
-        painter.begin(&image_scaled);
+        painter.begin(&canvas->overlay);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
         painter.setPen(pen);
         painter.drawLine(mouse_pos*scale, pos*scale);
         painter.end();
-        canvas->setImage(image_scaled);
+        int r = w*scale/2 + 2;
+        canvas->updateArea(QRect(mouse_pos*scale, pos*scale).normalized().adjusted(-r,-r,r,r));
         return;
     }
     // ERASER_MODE
@@ -416,7 +412,6 @@ IScissorDialog:: onMouseMove_Eraser(QPoint pos)
         eraseAt(xt, yt);
     }
     eraseAt(x,y);
-    canvas->setImage(image_scaled);
 }
 
 
@@ -446,6 +441,7 @@ IScissorDialog:: eraseAt(int pos_x, int pos_y)
         }
     }
     // draw over scaled image for display
+    QImage &image_scaled = canvas->base;
     int brush_w = brush_scaled.width();
     int img_w = image_scaled.width();
     int img_h = image_scaled.height();
@@ -479,6 +475,7 @@ IScissorDialog:: eraseAt(int pos_x, int pos_y)
             row[x+j] = qRgba(r,g,b, alpha);
         }
     }
+    canvas->updateArea(QRect(x, y, brush_w, brush_w));
 }
 
 void
@@ -524,7 +521,10 @@ IScissorDialog:: onMousePress_iScissor(QPoint pos)
 {
     // no seed was placed before so cant draw permanent path
     if (seed_mode == NO_SEED) {
-        if (!grad_map) grad_map = new GradMap(image);
+        if (!grad_map) {
+            grad_map = new GradMap(image);
+            path_tree = new PathTree(grad_map);
+        }
         seeds.push_back(pos);
         redoStack.clear();
         seed_mode = SEED_PLACED;
@@ -569,51 +569,39 @@ IScissorDialog:: onMouseMove_iScissor(QPoint pos)
     drawSeedToCursorPath();
 }
 
+// the path tree is kept until the seed changes, so for each mouse move
+// only the pixels not explored yet are processed
 void
 IScissorDialog:: calcShortPath(QPoint from/*seed*/, QPoint to/*cursor*/){
-    int x = to.x();
-    int y = to.y();
-    int seed_x = from.x();
-    int seed_y = from.y();
-    // Get bounding box of livewire
-    int x1 = MIN(x, seed_x); // topleft x
-    int y1 = MIN(y, seed_y);
-    int x2 = MAX(x, seed_x); // bottom right x
-    int y2 = MAX(y, seed_y);
-
-    shortPath.clear();
-    if (x1==x2) { // plot vertical line
-        for (int i=y1; i<=y2; i++)
-            shortPath.push_back(QPoint(x1, i));
-    }
-    else if (y1==y2) { // plot horizontal line
-        for (int i=x1; i<=x2; i++)
-            shortPath.push_back(QPoint(i, y1));
-    }
-    else {
-        int extend_w = (x2-x1)*0.2 + 5;
-        int extend_h = (y2-y1)*0.2 + 5;
-        if (x1==seed_x)
-            x2 = MIN(x2+extend_w, image.width()-1);
-        else
-            x1 = MAX(x1-extend_w, 0);
-        if (y1==seed_y)
-            y2 = MIN(y2+extend_h, image.height()-1);
-        else
-            y1 = MAX(y1-extend_h, 0);
+    if (path_tree->seed != from)
+        path_tree->setSeed(from);
+    path_tree->expandTo(to);
+    shortPath = path_tree->pathTo(to);
+}
 
-        IntBuffer dp_buff(x2-x1+1, y2-y1+1);
-        findOptimalPath(grad_map, dp_buff, x1, y1, seed_x, seed_y);
-        shortPath = plotShortPath(&dp_buff, x1, y1, x, y);
+// area of canvas covered by a path and seed circles on it
+static QRect
+pathRect(std::vector<QPoint> &path, float scale)
+{
+    if (path.empty())
+        return QRect();
+    int min_x = path[0].x(), max_x = min_x;
+    int min_y = path[0].y(), max_y = min_y;
+    for (QPoint pt : path) {
+        min_x = MIN(min_x, pt.x());
+        min_y = MIN(min_y, pt.y());
+        max_x = MAX(max_x, pt.x());
+        max_y = MAX(max_y, pt.y());
     }
+    return QRect(QPoint(min_x*scale, min_y*scale), QPoint(max_x*scale, max_y*scale)).adjusted(-6,-6,6,6);
 }
 
-// Draw movable last line (livewire)
+// Draw movable last line (livewire) on brush layer
 void
 IScissorDialog:: drawSeedToCursorPath()
 {
-    QPixmap pm = QPixmap::fromImage(image_scaled.copy());
-    painter.begin(&pm);
+    canvas->clearBrush();
+    painter.begin(&canvas->brush);
     QPen pen(Qt::red, 2, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
     painter.setPen(pen);
     QPoint pt1 = shortPath[0];
@@ -627,14 +615,14 @@ IScissorDialog:: drawSeedToCursorPath()
     painter.setBrush(QBrush(Qt::white));
     painter.drawEllipse(seeds.back()*scale, 4, 4);
     painter.end();
-    canvas->setPixmap(pm);
+    canvas->updateBrushArea(pathRect(shortPath, scale));
 }
 
-// draw last permanent non movable short path
+// draw last permanent non movable short path on overlay layer
 void
 IScissorDialog:: drawSeedToSeedPath()
 {
-    painter.begin(&image_scaled);
+    painter.begin(&canvas->overlay);
     QPen pen(Qt::blue, 2, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
     painter.setPen(pen);
     std::vector<QPoint> short_path = fullPath.back();
@@ -649,7 +637,8 @@ IScissorDialog:: drawSeedToSeedPath()
     painter.setBrush(QBrush(Qt::white));
     painter.drawEllipse(seeds[seeds.size()-2]*scale, 4, 4);
     painter.end();
-    canvas->setImage(image_scaled);
+    canvas->clearBrush();
+    canvas->updateArea(pathRect(short_path, scale));
 }
 
 // this is called when image is scaled
@@ -658,7 +647,7 @@ IScissorDialog:: drawFullPath()
 {
     if (fullPath.empty())
         return;
-    painter.begin(&image_scaled);
+    painter.begin(&canvas->overlay);
     QPen pen(Qt::blue, 2, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
     painter.setPen(pen);
     for (auto short_path : fullPath) {
@@ -676,6 +665,7 @@ IScissorDialog:: drawFullPath()
         painter.drawEllipse(seed*scale, 4, 4);
     }
     painter.end();
+    canvas->updateArea(canvas->overlay.rect());
 }
 
 void
@@ -732,49 +722,162 @@ IScissorDialog:: checkPathClosed()
     }
 }
 
-// generate mask by floodfill inside path boundary
+// generate mask by filling the closed path, inside or outside of the path
+// depending upon where user clicked
 void
 IScissorDialog:: getMaskedImage(QPoint clicked)
 {
-    QRgb white = qRgb(255,255,255);
-    QRgb black = qRgb(0,0,0);
-
-    if (mode==ERASER_MODE) {
-        mask = QImage(image.width(), image.height(), QImage::Format_ARGB32);
-        mask.fill(black);
+    int w = image.width();
+    int h = image.height();
+    // path may start before the seed where loop was closed, skip that tail
+    uint start = 0;
+    while (start+1 < seeds.size() && seeds[start] != seeds.back())
+        start++;
+    if (start+1 >= seeds.size())
+        start = 0;
+    // each short path goes from next seed to previous seed
+    std::vector<QPoint> polygon;
+    for (uint i=start; i<fullPath.size(); i++)
+        polygon.insert(polygon.end(), fullPath[i].rbegin(), fullPath[i].rend());
+
+    std::vector<uchar> coverage(w*h);
+    fillPolygon(polygon, coverage.data(), w, h);
+    if (mode==ERASER_MODE && smoothEdgesBtn->isChecked()) {
+        // only the pixels within feather radius of the path change, and
+        // margin of pathRect() is larger than the radius, so feather that area
+        QRect box = pathRect(polygon, 1) & QRect(0, 0, w, h);
+        int box_w = box.width();
+        int box_h = box.height();
+        std::vector<uchar> part(box_w*box_h);
+        for (int y=0; y<box_h; y++)
+            memcpy(part.data() + y*box_w, coverage.data() + (box.y()+y)*w + box.x(), box_w);
+        featherMask(part.data(), box_w, box_h, 3);
+        for (int y=0; y<box_h; y++)
+            memcpy(coverage.data() + (box.y()+y)*w + box.x(), part.data() + y*box_w, box_w);
     }
-    for (auto points : fullPath) {
-        for (QPoint pt : points) {
-            mask.setPixel(pt, white);
-        }
-    }
-    //mask.save("mask.png");
-    floodfill(mask, clicked, white);
-    for (auto points : fullPath) {
-        for (QPoint pt : points) {
-            mask.setPixel(pt, black);
+    // clicked outside of the loop
+    bool outside = coverage[clicked.y()*w + clicked.x()] < 128;
+
+    if (mode==MASK_MODE) {
+        #pragma omp parallel for
+        for (int y=0; y<h; y++) {
+            QRgb *row;
+            #pragma omp critical
+            { row = (QRgb*)mask.scanLine(y); }
+            uchar *cov_row = coverage.data() + y*w;
+            for (int x=0; x<w; x++) {
+                if ((cov_row[x] > 127) != outside)
+                    row[x] = qRgb(255,255,255);
+            }
         }
-    }
-    if (mode != ERASER_MODE)
         return;
-    if (smoothEdgesBtn->isChecked())
-        gaussianBlur(mask, 3);
-
+    }
     if (image.format() != QImage::Format_ARGB32)
         image = image.convertToFormat(QImage::Format_ARGB32);
 
-    for (int y=0; y<image.height(); y++){
-        QRgb *row = (QRgb*)image.scanLine(y);
-        QRgb *mask_row = (QRgb*)mask.constScanLine(y);
-        for (int x=0; x<image.width(); x++){
+    #pragma omp parallel for
+    for (int y=0; y<h; y++){
+        QRgb *row;
+        #pragma omp critical
+        { row = (QRgb*)image.scanLine(y); }
+        uchar *cov_row = coverage.data() + y*w;
+        for (int x=0; x<w; x++){
             int clr = row[x];
-            // black regions of mask are made transperant in image
-            int alpha = qAlpha(clr) - (255-qRed(mask_row[x]));
+            int cov = outside ? 255-cov_row[x] : cov_row[x];
+            // uncovered regions are made transperant in image
+            int alpha = qAlpha(clr) - (255-cov);
             if (alpha<0) alpha = 0;
             row[x] = qRgba(qRed(clr), qGreen(clr), qBlue(clr), alpha);
         }
     }
-    mask = QImage();// clear memory in eraser mode
+}
+
+// number of sub-scanlines per pixel row, for antialiasing
+#define FILL_SUBSAMPLES 4
+
+typedef struct {
+    float x0, y0, y1;   // y0 < y1
+    float dxdy;
+} PolygonEdge;
+
+// Scanline fill of closed polygon using even-odd rule.
+// points are pixel centers, output is coverage of each pixel (0-255).
+void fillPolygon(std::vector<QPoint> &polygon, uchar *coverage, int w, int h)
+{
+    memset(coverage, 0, w*h);
+    int n = polygon.size();
+    std::vector<PolygonEdge> edges;
+    int y_min = h, y_max = -1;
+    for (int i=0; i<n; i++) {
+        QPoint p0 = polygon[i], p1 = polygon[(i+1)%n];
+        y_min = MIN(y_min, p0.y());
+        y_max = MAX(y_max, p0.y());
+        if (p0.y()==p1.y())
+            continue;   // horizontal edges never cross a scanline
+        if (p0.y() > p1.y())
+            std::swap(p0, p1);
+        PolygonEdge edge;
+        edge.x0 = p0.x() + 0.5f;
+        edge.y0 = p0.y() + 0.5f;
+        edge.y1 = p1.y() + 0.5f;
+        edge.dxdy = (p1.x()-p0.x())/(float)(p1.y()-p0.y());
+        edges.push_back(edge);
+    }
+    std::sort(edges.begin(), edges.end(), [](const PolygonEdge &a, const PolygonEdge &b){
+        return a.y0 < b.y0; });
+    y_min = MAX(y_min, 0);
+    y_max = MIN(y_max, h-1);
+
+    std::vector<int> active;
+    std::vector<float> crossings;
+    // area covered in each pixel, and change of full coverage from previous pixel
+    std::vector<float> partial(w+1), full(w+1);
+    uint next_edge = 0;
+    for (int y=y_min; y<=y_max; y++)
+    {
+        std::fill(partial.begin(), partial.end(), 0);
+        std::fill(full.begin(), full.end(), 0);
+        for (int s=0; s<FILL_SUBSAMPLES; s++)
+        {
+            float ys = y + (s+0.5f)/FILL_SUBSAMPLES;
+            // update active edge list
+            while (next_edge < edges.size() && edges[next_edge].y0 <= ys)
+                active.push_back(next_edge++);
+            crossings.clear();
+            for (uint i=0; i<active.size(); ) {
+                PolygonEdge &edge = edges[active[i]];
+                if (edge.y1 <= ys) {
+                    active[i] = active.back();
+                    active.pop_back();
+                    continue;
+                }
+                crossings.push_back(edge.x0 + (ys-edge.y0)*edge.dxdy);
+                i++;
+            }
+            std::sort(crossings.begin(), crossings.end());
+            // fill between pairs of crossings
+            for (uint i=0; i+1<crossings.size(); i+=2) {
+                float xa = clamp(crossings[i], 0.0f, (float)w);
+                float xb = clamp(crossings[i+1], 0.0f, (float)w);
+                int ia = xa, ib = xb;
+                if (ia==ib) {
+                    partial[ia] += xb-xa;
+                    continue;
+                }
+                partial[ia] += ia+1-xa;
+                full[ia+1] += 1;
+                full[ib] -= 1;
+                partial[ib] += xb-ib;
+            }
+        }
+        uchar *row = coverage + y*w;
+        float sum = 0;
+        for (int x=0; x<w; x++) {
+            sum += full[x];
+            int val = roundf((sum + partial[x])*255/FILL_SUBSAMPLES);
+            row[x] = MIN(val, 255);
+        }
+    }
 }
 
 
@@ -805,148 +908,142 @@ const int link_offset[8][2] =
   {  1, -1 },
   { -1, -1 },
 };
-// we use left 24 bytes to store pixel cost, and rest 4 bytes to store link dir
+// we use left 28 bits to store pixel cost, and rest 4 bits to store link dir
 #define  PIXEL_COST(x)     ((x) >> 4)
 #define  PIXEL_DIR(x)      ((x) & 0xf)
 
-#define PACK(x, y)      ((((y) & 0xff) << 8) | ((x) & 0xff))
-#define OFFSET(pixel)   ((int8_t)((pixel) & 0xff) + \
-                        ((int8_t)(((pixel) & 0xff00) >> 8)) * buff_w)
-
+// state of pixels in PathTree
+enum {
+    PIXEL_UNVISITED,
+    PIXEL_QUEUED,
+    PIXEL_FINISHED
+};
 
-void findOptimalPath(GradMap *grad_map, IntBuffer &dp_buff,
-                    int x1, int y1, int xs, int ys)
+PathTree:: PathTree(GradMap *grad_map)
 {
-    uint  pixel[8];
-    int  cum_cost[8];
-    int  link_cost[8];
-    int  pixel_cost[8];
-    int link, offset;
-    int  buff_w = dp_buff.width;
-    int  buff_h = dp_buff.height;
-
-    uint *data = dp_buff.data;
+    this->grad_map = grad_map;
+    width = grad_map->width;
+    height = grad_map->height;
+    tiles_x = (width+GRAD_TILE_SIZE-1)/GRAD_TILE_SIZE;
+    tiles_y = (height+GRAD_TILE_SIZE-1)/GRAD_TILE_SIZE;
+    tiles.resize(tiles_x*tiles_y, NULL);
+    seed = QPoint(-1,-1);
+}
 
-    /*  what directions are we filling the array in according to?  */
-    int dirx = (xs == x1) ? 1 : -1;
-    int diry = (ys == y1) ? 1 : -1;
-    int linkdir = (dirx * diry);
+PathTree:: ~PathTree()
+{
+    clear();
+}
 
-    int y = ys;
+void
+PathTree:: clear()
+{
+    for (PathTile* &tile : tiles) {
+        if (tile) {
+            free(tile);
+            tile = NULL;
+        }
+    }
+    queue = decltype(queue)();
+}
 
-    for (int i = 0; i < buff_h; i++)
-    {
-      int x = xs;
+// returns tile containing the pixel, allocates it if not allocated
+PathTile*
+PathTree:: getTile(int x, int y)
+{
+    PathTile* &tile = tiles[(y/GRAD_TILE_SIZE)*tiles_x + x/GRAD_TILE_SIZE];
+    if (tile==NULL) {
+        tile = (PathTile*) malloc(sizeof(PathTile));
+        if (tile==NULL) {
+            printf("could not allocate enough memory for path tree");
+            exit(1);
+        }
+        memset(tile->state, PIXEL_UNVISITED, sizeof(tile->state));
+    }
+    return tile;
+}
 
-      uint *d = data + (y-y1) * buff_w + (x-x1);
+#define TILE_INDEX(x, y)  (((y)%GRAD_TILE_SIZE)*GRAD_TILE_SIZE + (x)%GRAD_TILE_SIZE)
 
-      for (int j = 0; j < buff_w; j++)
-        {
-          for (int k = 0; k < 8; k++)
-            pixel[k] = 0;
-
-          /*  Find the valid neighboring pixels  */
-          /*  the previous pixel  */
-          if (j)
-            pixel[((dirx == 1) ? 4 : 0)] = PACK(-dirx, 0);
-
-          /*  the previous row of pixels  */
-          if (i)
-            {
-              pixel[((diry == 1) ? 5 : 1)] = PACK(0, -diry);
-
-              link = (linkdir == 1) ? 3 : 2;
-              if (j)
-                pixel[((diry == 1) ? (link + 4) : link)] = PACK(-dirx, -diry);
-
-              link = (linkdir == 1) ? 2 : 3;
-              if (j != buff_w - 1)
-                pixel[((diry == 1) ? (link + 4) : link)] = PACK(dirx, -diry);
-            }
+// clear previous tree and start a new one from seed
+void
+PathTree:: setSeed(QPoint seed_pos)
+{
+    clear();
+    seed = seed_pos;
+    if (seed.x()<0 || seed.x()>=width || seed.y()<0 || seed.y()>=height)
+        return;
+    PathTile *tile = getTile(seed.x(), seed.y());
+    int i = TILE_INDEX(seed.x(), seed.y());
+    tile->node[i] = SEED_POINT;
+    tile->state[i] = PIXEL_QUEUED;
+    queue.push(std::make_pair(0, seed.y()*width + seed.x()));
+}
 
-          /*  find the minimum cost of going through each neighbor to reach the
-           *  seed point...
-           */
-          int min_cost = INT32_MAX;
-          link = -1;
-          for (int k = 0; k < 8; k ++)
-            if (pixel[k])
-              {
-                link_cost[k] = grad_map->linkCost(xs + j*dirx, ys + i*diry, k);
-                offset = OFFSET (pixel [k]);
-                pixel_cost[k] = PIXEL_COST (d[offset]);
-                cum_cost[k] = pixel_cost[k] + link_cost[k];
-                if (cum_cost[k] < min_cost)
-                  {
-                    min_cost = cum_cost[k];
-                    link = k;
-                  }
-              }
-          /*  If anything can be done...  */
-          if (link >= 0)
-            {
-              //  set the cumulative cost of this pixel and the new direction
-              *d = (cum_cost[link] << 4) + link;
-
-              /*  possibly change the links from the other pixels to this pixel...
-               *  these changes occur if a neighboring pixel will receive a lower
-               *  cumulative cost by going through this pixel.
-               */
-              for (int k = 0; k < 8; k ++)
-                if (pixel[k] && k != link)
-                  {
-                    /*  if the cumulative cost at the neighbor is greater than
-                     *  the cost through the link to the current pixel, change the
-                     *  neighbor's link to point to the current pixel.
-                     */
-                    int new_cost = link_cost[k] + cum_cost[link];
-                    if (pixel_cost[k] > new_cost)
-                    {
-                      /*  reverse the link direction   /--------------------\ */
-                      offset = OFFSET (pixel[k]);
-                      d[offset] = (new_cost << 4) + ((k > 3) ? k - 4 : k + 4);
-                    }
-                  }
-            }
-          /*  Set the seed point  */
-          else if (!i && !j)
-            {
-              *d = SEED_POINT;
-            }
-          /*  increment the data pointer and the x counter  */
-          d += dirx;
-          x += dirx;
+// run Dijkstra's algorithm until the shortest path to target is found
+void
+PathTree:: expandTo(QPoint target)
+{
+    if (target.x()<0 || target.x()>=width || target.y()<0 || target.y()>=height)
+        return;
+    PathTile *target_tile = getTile(target.x(), target.y());
+    int target_i = TILE_INDEX(target.x(), target.y());
+    while (target_tile->state[target_i]!=PIXEL_FINISHED && !queue.empty())
+    {
+        std::pair<uint,int> item = queue.top();
+        queue.pop();
+        int x = item.second%width;
+        int y = item.second/width;
+        PathTile *tile = getTile(x, y);
+        int i = TILE_INDEX(x, y);
+        if (tile->state[i]==PIXEL_FINISHED)
+            continue;   // an outdated entry with higher cost
+        tile->state[i] = PIXEL_FINISHED;
+        uint cost = item.first;
+        for (int k=0; k<8; k++) {
+            int nx = x + link_offset[k][0];
+            int ny = y + link_offset[k][1];
+            if (nx<0 || nx>=width || ny<0 || ny>=height)
+                continue;
+            PathTile *ntile = getTile(nx, ny);
+            int ni = TILE_INDEX(nx, ny);
+            if (ntile->state[ni]==PIXEL_FINISHED)
+                continue;
+            // link from neighbour back to this pixel is the opposite direction
+            int back = (k > 3) ? k - 4 : k + 4;
+            uint new_cost = cost + grad_map->linkCost(nx, ny, back);
+            if (ntile->state[ni]==PIXEL_UNVISITED)
+                ntile->state[ni] = PIXEL_QUEUED;
+            else if (PIXEL_COST(ntile->node[ni]) <= new_cost)
+                continue;
+            ntile->node[ni] = (new_cost << 4) + back;
+            queue.push(std::make_pair(new_cost, ny*width + nx));
         }
-      /*  increment the y counter  */
-      y += diry;
     }
 }
 
+// returns the path from target to seed, target must be expanded before
 std::vector<QPoint>
-            plotShortPath(IntBuffer *dp_buff, int x1, int y1, int target_x, int target_y)
+PathTree:: pathTo(QPoint target)
 {
-    int width = dp_buff->width;
-
-    std::vector<QPoint> shortPath;
-    /*  Start the data pointer at the correct location  */
-    uint *data = (uint *) dp_buff->data + (target_y - y1)*width + (target_x - x1);
-
-    int x = target_x;
-    int y = target_y;
-
+    std::vector<QPoint> path;
+    int x = target.x();
+    int y = target.y();
+    if (x<0 || x>=width || y<0 || y>=height || tiles[(y/GRAD_TILE_SIZE)*tiles_x + x/GRAD_TILE_SIZE]==NULL
+            || getTile(x,y)->state[TILE_INDEX(x,y)]!=PIXEL_FINISHED) {
+        path.push_back(seed);
+        return path;
+    }
     while (1)
     {
-        shortPath.push_back(QPoint(x,y));
-
-        int link = PIXEL_DIR (*data);
+        path.push_back(QPoint(x,y));
+        int link = PIXEL_DIR(getTile(x,y)->node[TILE_INDEX(x,y)]);
         if (link == SEED_POINT)
-            return shortPath;
-
+            return path;
         x += link_offset[link][0];
         y += link_offset[link][1];
-        data += link_offset[link][1] * width + link_offset[link][0];
     }
-    return shortPath; // never reaches here
+    return path; // never reaches here
 }
 
 
@@ -955,69 +1052,105 @@ GradMap:: GradMap(QImage img)
 {
     width = img.width();
     height = img.height();
-    grad_mag = (uchar*)malloc(width*height);
-    short int *grad_tmp = (short int*) malloc(width*height*sizeof(short int));
-    // create gradient map using sobel filter
-    int max_grad = 0;
-    QRgb *data = (QRgb*)img.constScanLine(0);
-    #pragma omp parallel for
-    for (int y=1; y<height-1; y++) {
-        QRgb *row1 = data + (y*width);// current row
-        QRgb *row0 = row1 - width; // prev row
-        QRgb *row2 = row1 + width; // next row
-        for (int x=1; x<width-1; x++) {
-            int clr00 = row0[x-1];
-            int clr01 = row0[x];
-            int clr02 = row0[x+1];
-            int clr10 = row1[x-1];
-            int clr12 = row1[x+1];
-            int clr20 = row2[x-1];
-            int clr21 = row2[x];
-            int clr22 = row2[x+1];
-
-            short int grad_x, grad_y, grad_x_g, grad_y_g, grad_x_b, grad_y_b;
-
-            grad_x = qRed(clr00) + 2*qRed(clr10) + qRed(clr20) -
-                    (qRed(clr02) + 2*qRed(clr12) + qRed(clr22));
-            grad_y = qRed(clr00) + 2*qRed(clr01) + qRed(clr02) -
-                    (qRed(clr20) + 2*qRed(clr21) + qRed(clr22));
-            int grad = sqrt(grad_x*grad_x + grad_y*grad_y);
-            // green channel
-            grad_x_g = qGreen(clr00) + 2*qGreen(clr10) + qGreen(clr20) -
-                    (qGreen(clr02) + 2*qGreen(clr12) + qGreen(clr22));
-            grad_y_g = qGreen(clr00) + 2*qGreen(clr01) + qGreen(clr02) -
-                    (qGreen(clr20) + 2*qGreen(clr21) + qGreen(clr22));
-            int grad_g = sqrt(grad_x_g*grad_x_g + grad_y_g*grad_y_g);
-            // blue channel
-            grad_x_b = qBlue(clr00) + 2*qBlue(clr10) + qBlue(clr20) -
-                    (qBlue(clr02) + 2*qBlue(clr12) + qBlue(clr22));
-            grad_y_b = qBlue(clr00) + 2*qBlue(clr01) + qBlue(clr02) -
-                    (qBlue(clr20) + 2*qBlue(clr21) + qBlue(clr22));
-            int grad_b = sqrt(grad_x_b*grad_x_b + grad_y_b*grad_y_b);
-
-            // use maximum value among 3 channels
-            grad = MAX(grad, MAX(grad_g, grad_b));
-            if (grad > max_grad)
-                max_grad = grad;
-            grad_tmp[y*width + x] = grad;
-        }
+    // calcTile() reads pixels as QRgb
+    if (img.depth()!=32)
+        img = img.convertToFormat(QImage::Format_RGB32);
+    image = img;
+    tiles_x = (width+GRAD_TILE_SIZE-1)/GRAD_TILE_SIZE;
+    tiles_y = (height+GRAD_TILE_SIZE-1)/GRAD_TILE_SIZE;
+    tiles.resize(tiles_x*tiles_y, NULL);
+    lru_pos.resize(tiles_x*tiles_y);
+    last_tile = -1;
+    last_data = NULL;
+}
+
+// returns cost tile, calculates it (and the missing tiles around it) if required
+uchar*
+GradMap:: getTile(int tile_id)
+{
+    if (tiles[tile_id]) {
+        lru.splice(lru.begin(), lru, lru_pos[tile_id]);
+        return tiles[tile_id];
+    }
+    // path search grows in all directions, so neighbour tiles are needed soon
+    int tx = tile_id%tiles_x, ty = tile_id/tiles_x;
+    std::vector<int> missing;
+    for (int j=MAX(ty-1,0); j<=MIN(ty+1,tiles_y-1); j++)
+        for (int i=MAX(tx-1,0); i<=MIN(tx+1,tiles_x-1); i++)
+            if (tiles[j*tiles_x+i]==NULL)
+                missing.push_back(j*tiles_x+i);
+    // free least recently used tiles
+    while (!lru.empty() && lru.size()+missing.size() > GRAD_CACHE_TILES) {
+        int id = lru.back();
+        lru.pop_back();
+        free(tiles[id]);
+        tiles[id] = NULL;
+        if (id==last_tile)
+            last_tile = -1;
+    }
+    for (int id : missing) {
+        tiles[id] = (uchar*) malloc(GRAD_TILE_SIZE*GRAD_TILE_SIZE);
+        lru.push_front(id);
+        lru_pos[id] = lru.begin();
     }
     #pragma omp parallel for
-    for (int y=1; y<height-1; y++) {
-        for (int x=1; x<width-1; x++) {
-            grad_mag[y*width + x] = (1 - grad_tmp[y*width + x]/(float)max_grad)*255;
+    for (uint n=0; n<missing.size(); n++)
+        calcTile(missing[n], tiles[missing[n]]);
+    lru.splice(lru.begin(), lru, lru_pos[tile_id]);
+    return tiles[tile_id];
+}
+
+#define GRAD_SCALES 2
+
+// calculate cost of each pixel of a tile.
+// Sobel gradient is calculated at pixel distance 1 and 2. The larger scale
+// gives stronger response on soft edges, the smaller one locates sharp edges.
+void
+GradMap:: calcTile(int tile_id, uchar *out)
+{
+    const int T = GRAD_TILE_SIZE;
+    const int B = GRAD_SCALES;      // border required around tile
+    const int PT = T + 2*B;         // size of padded tile
+    int x0 = (tile_id%tiles_x)*T;
+    int y0 = (tile_id/tiles_x)*T;
+    // copy the channels of tile area, replicating the image border pixels
+    std::vector<short> chan(3*PT*PT);
+    short *red = chan.data(), *green = red + PT*PT, *blue = green + PT*PT;
+    for (int j=0; j<PT; j++) {
+        int y = clamp(y0+j-B, 0, height-1);
+        QRgb *row = (QRgb*)image.constScanLine(y);
+        for (int i=0; i<PT; i++) {
+            QRgb clr = row[clamp(x0+i-B, 0, width-1)];
+            red[j*PT+i] = qRed(clr);
+            green[j*PT+i] = qGreen(clr);
+            blue[j*PT+i] = qBlue(clr);
         }
     }
-    // duplicate top and bottom border pixels
-    memcpy(grad_mag+1, grad_mag+(width+1), width-2);
-    memcpy(grad_mag+(width*(height-1)+1), grad_mag+(width*(height-2)+1), width-2);
-    // duplicate left and right border
-    for (int i=0; i<height; i++){
-        uchar *row = grad_mag + (i*width);
-        row[0] = row[1];
-        row[width-1] = row[width-2];
+    // max gradient at each pixel among the channels and scales
+    int grad[T];
+    for (int j=0; j<T; j++) {
+        for (int i=0; i<T; i++)
+            grad[i] = 0;
+        for (int s=1; s<=GRAD_SCALES; s++) {
+            for (int c=0; c<3; c++) {
+                short *r1 = chan.data() + c*PT*PT + (j+B)*PT + B;
+                short *r0 = r1 - s*PT;
+                short *r2 = r1 + s*PT;
+                #pragma omp simd
+                for (int i=0; i<T; i++) {
+                    int gx = r0[i-s] + 2*r1[i-s] + r2[i-s] - (r0[i+s] + 2*r1[i+s] + r2[i+s]);
+                    int gy = r0[i-s] + 2*r0[i] + r0[i+s] - (r2[i-s] + 2*r2[i] + r2[i+s]);
+                    // larger scale is weighted less, so that it does not shift sharp edges
+                    int g = sqrtf(gx*gx + gy*gy) * (s==1 ? 1.0f : 0.75f);
+                    grad[i] = MAX(grad[i], g);
+                }
+            }
+        }
+        // a sharp black-white edge has gradient 1020, but usual edges are
+        // much weaker, so cost saturates at half of it
+        for (int i=0; i<T; i++)
+            out[j*T+i] = 255 - MIN(grad[i], 510)/2;
     }
-    free(grad_tmp);
 }
 
 #define SQRT2 1.414213562
@@ -1028,80 +1161,20 @@ GradMap:: linkCost(int x, int y, int link)
 {
     x += link_offset[link][0];
     y += link_offset[link][1];
-    return (link_weight[link] * grad_mag[y*width + x]);
+    int tile_id = (y/GRAD_TILE_SIZE)*tiles_x + x/GRAD_TILE_SIZE;
+    if (tile_id != last_tile) {
+        last_data = getTile(tile_id);
+        last_tile = tile_id;
+    }
+    return (link_weight[link] * last_data[(y%GRAD_TILE_SIZE)*GRAD_TILE_SIZE + x%GRAD_TILE_SIZE]);
 }
 
 GradMap:: ~GradMap()
 {
-    free(grad_mag);
+    for (uchar *tile : tiles)
+        free(tile);
 }
 
-// Integer Buffer
-IntBuffer:: IntBuffer(int w, int h) : width(w), height(h)
-{
-    data = (uint*) malloc(w*h*sizeof(uint));
-}
-
-IntBuffer:: ~IntBuffer()
-{
-    free(data);
-}
-
-/* Stack Based Scanline Floodfill
-   Source : http://lodev.org/cgtutor/floodfill.html#Scanline_Floodfill_Algorithm_With_Stack
-*/
-void floodfill(QImage &img, QPoint pos, QRgb newColor)
-{
-    QRgb oldColor = img.pixel(pos);
-    if (oldColor==newColor)
-        return;
-
-    int x = pos.x();
-    int y = pos.y();
-    int w = img.width();
-    int h = img.height();
-
-    std::vector<QPoint> q;
-    bool spanAbove, spanBelow;
-    QRgb *row, *row_prev, *row_next;
-    q.push_back(QPoint(x, y));
-
-    while(!q.empty())
-    {
-        QPoint pt = q.back();
-        q.pop_back();
-        x = pt.x();
-        y = pt.y();
-        row = (QRgb*)img.scanLine(y);
-        row_prev = (QRgb*)img.constScanLine(y-1);
-        row_next = (QRgb*)img.constScanLine(y+1);
-        while (x >= 0 && row[x] == oldColor) x--;
-        x++;
-        spanAbove = spanBelow = 0;
-        while (x < w && row[x] == oldColor )
-        {
-            row[x] = newColor;
-            if(!spanAbove && y > 0 && row_prev[x] == oldColor){
-                q.push_back(QPoint(x, y - 1));
-                spanAbove = 1;
-            }
-            else if (spanAbove && y > 0 && row_prev[x] != oldColor){
-                spanAbove = 0;
-            }
-            if(!spanBelow && y < h - 1 && row_next[x] == oldColor){
-                q.push_back(QPoint(x, y + 1));
-                spanBelow = 1;
-            }
-            else if(spanBelow && y < h - 1 && row_next[x] != oldColor){
-                spanBelow = 0;
-            }
-            x++;
-        }
-    }
-}
-
-
-
 BgColorDialog:: BgColorDialog(QWidget *parent) : QDialog(parent)
 {
     this->resize(250, 120);
@@ -5,6 +5,9 @@
 #include <QPainter>
 #include <QTimer>
 #include <vector>
+#include <queue>
+#include <list>
+#include <algorithm>
 #include <QColorDialog>
 #include <QButtonGroup>
 #include <QComboBox>
@@ -12,45 +15,90 @@
 #include <cmath>
 #include "common.h"
 #include "filters.h"
+#include "distance_transform.h"
 #include "ui_iscissor_dialog.h"
 /*
 How drawing works in Scissor :
- first it scales image to create image_scaled,
- when placing seeds, draws seed to seed permanent path on image_scaled and
- when showing temporary seed to cursor path, it copies image_scaled and draws over it
- finally it creates a temporary mask, floodfill it and make unmasked areas
- in image transperant
+ first it scales image and sets it as base layer of canvas,
+ when placing seeds, draws seed to seed permanent path on overlay layer and
+ temporary seed to cursor path on brush layer, which is cleared on each move.
+ finally it fills the closed path polygon into a coverage buffer, and makes
+ unmasked areas in image transperant
 
 Mask mode :
- when mouse is clicked inside loop, mask is generated, and image_scaled is
- updated and shown to canvas.
+ when mouse is clicked inside loop, mask is generated, and overlay layer
+ is updated from it.
 
 How drawing works in Eraser :
  First brush is created, and that is scaled to make brush_scaled.
- Image is scaled to make image_scaled (ARGB_Premultiplied).
- When mouse is dragged, brush is drawn on image, and brush_scaled is drawn on image_scaled.
- On mouse release, image_scaled is regenerated, and shown on canvas.
+ Image is scaled and set as base layer of canvas (ARGB_Premultiplied).
+ When mouse is dragged, brush is drawn on image, and brush_scaled is drawn on
+ base layer. Only the area under brush is repainted.
 
 Mask mode :
  The brush is solid white brush which is drawn on mask.
- Brush_scaled is a semi-transperant green brush, drawn on image_scaled
- On mouse release image_scaled is generated from mask and image.
+ A semi-transperant green brush is drawn on overlay layer.
 */
 
 #ifndef __PHOTOQUICK_ISCISSOR
 #define __PHOTOQUICK_ISCISSOR
 
+// GradMap and PathTree store data in square tiles of this size
+#define GRAD_TILE_SIZE 64
+// maximum number of gradient tiles kept in memory (64x64 bytes each)
+#define GRAD_CACHE_TILES 4096
+
+// Gradient magnitude based cost of pixels. The cost is calculated only for
+// the tiles around the pixels being used, and least recently used tiles
+// are freed when the cache is full.
 class GradMap
 {
 public:
     int width;
     int height;
-    uchar *grad_mag;
+    QImage image;
+    int tiles_x, tiles_y;
+    std::vector<uchar*> tiles;  // NULL if the tile is not calculated
+    std::list<int> lru;         // tile ids, most recently used first
+    std::vector<std::list<int>::iterator> lru_pos;
+    int last_tile;              // id of last used tile
+    uchar *last_data;
     GradMap(QImage image);
+    uchar* getTile(int tile_id);
+    void calcTile(int tile_id, uchar *out);
     int linkCost(int x, int y, int link);
     ~GradMap();
 };
 
+typedef struct {
+    uint node[GRAD_TILE_SIZE*GRAD_TILE_SIZE];   // cumulative cost << 4 | link
+    uchar state[GRAD_TILE_SIZE*GRAD_TILE_SIZE];
+} PathTile;
+
+// Shortest path tree from a seed point, grown lazily by Dijkstra's algorithm.
+// path from any explored pixel to the seed is found by following the links.
+// tiles are allocated as the tree grows over them.
+class PathTree
+{
+public:
+    GradMap *grad_map;
+    int width;
+    int height;
+    int tiles_x, tiles_y;
+    QPoint seed;
+    std::vector<PathTile*> tiles;
+    std::priority_queue<std::pair<uint,int>, std::vector<std::pair<uint,int>>,
+                        std::greater<std::pair<uint,int>> > queue;
+
+    PathTree(GradMap *grad_map);
+    ~PathTree();
+    void clear();
+    PathTile* getTile(int x, int y);
+    void setSeed(QPoint seed);
+    void expandTo(QPoint target);
+    std::vector<QPoint> pathTo(QPoint target);
+};
+
 typedef enum {
     TOOL_ISCISSOR=1,
     TOOL_ERASER=2
@@ -84,7 +132,6 @@ public:
 
     QImage image; // original unchanged image
     QImage mask;
-    QImage image_scaled;
     float scale;
     QPainter painter;
     PaintCanvas *canvas;
@@ -94,6 +141,7 @@ public:
 
     int tool_type = 0;
 
+    QImage scaledImage();
     void scaleImage();
     void redraw();
 
@@ -115,6 +163,7 @@ public:
 
     // Scissor related variables and functions
     GradMap *grad_map = 0;
+    PathTree *path_tree = 0;
 
     SeedMode seed_mode = NO_SEED;
     std::vector<QPoint> seeds;
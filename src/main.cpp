@@ -448,22 +448,40 @@ Window:: autoResizeAndSave()
 {
     if (data.image.isNull())
         return;
-    float res1 = data.image.width();
-    float size1 = getJpgFileSize(data.image)/1024.0;
-    float res2 = res1/2;
-    QImage scaled = data.image.scaledToWidth(res2, Qt::SmoothTransformation);
-    float size2 = getJpgFileSize(scaled)/1024.0;
+    // file sizes are predicted from a few small tiles, and full encoding
+    // is done only to verify the result
+    JpegSizeModel model(data.image);
+    float size1 = model.predict(1.0)/1024.0;
     bool ok;
     float sizeOut = QInputDialog::getInt(this, "File Size", "File Size below (kB) :", size1/2, 1, size1, 1, &ok);
     if (not ok)
         return;
-    float resOut = log10(res1/res2)/log10(size1/size2) * log10(sizeOut/size1) + log10(res1);
-    resOut = pow(10, resOut);
-    scaled = data.image.scaledToWidth(resOut, Qt::SmoothTransformation);
-    size2 = getJpgFileSize(scaled)/1024.0;
-    for (float frac=0.95; size2>sizeOut; frac-=0.05){
-        scaled = data.image.scaledToWidth(resOut*frac, Qt::SmoothTransformation);
-        size2 = getJpgFileSize(scaled)/1024.0;
+    int max_size = sizeOut*1024;
+    float scale = model.fitScale(max_size);
+    int width = MAX(roundf(data.image.width()*scale), 1.0f);
+    scale = width/float(data.image.width());
+    // use the remaining size for better quality than default (75)
+    int quality = -1;
+    int lo = 75, hi = 95;
+    while (lo < hi) {
+        int mid = (lo+hi+1)/2;
+        if (model.predict(scale, mid) <= max_size)
+            lo = mid;
+        else
+            hi = mid-1;
+    }
+    if (lo > 75)
+        quality = lo;
+    QImage scaled = width<data.image.width() ?
+                data.image.scaledToWidth(width, Qt::SmoothTransformation) : data.image;
+    int filesize = getJpgFileSize(scaled, quality);
+    // prediction is not exact, so correct the scale using actual size
+    while (filesize > max_size && width > 1) {
+        quality = -1;
+        width = MIN(width-1, int(width*sqrtf(float(max_size)/filesize)*0.98f));
+        width = MAX(width, 1);
+        scaled = data.image.scaledToWidth(width, Qt::SmoothTransformation);
+        filesize = getJpgFileSize(scaled, quality);
     }
     // ensure that saved image is jpg
     QFileInfo fi(data.filename);
@@ -472,7 +490,7 @@ Window:: autoResizeAndSave()
     QString path = dir + "/" + basename + ".jpg";
     path = getNewFileName(path);
 
-    if (scaled.save(path))
+    if (scaled.save(path, "JPG", quality))
         showNotification("Image Saved !", QFileInfo(path).fileName());
     else {
         showNotification("Failed to Save !", QFileInfo(path).fileName());
@@ -517,6 +535,51 @@ bool isMonochrome(QImage img)
     return true;
 }
 
+// saves image in a pdf page of size pdf_w x pdf_h (in points), image is
+// fit inside the page and centered
+void savePdf(QImage image, QString path, float pdf_w, float pdf_h)
+{
+    // get image dimension and position
+    int img_w = pdf_w;
+    int img_h = round((pdf_w/image.width())*image.height());
+    if (img_h > pdf_h) {
+        img_h = pdf_h;
+        img_w = round((pdf_h/image.height())*image.width());
+    }
+    int x = (pdf_w-img_w)/2;
+    int y = (pdf_h-img_h)/2;
+
+    // remove transperancy
+    if (image.format()==QImage::Format_ARGB32) {
+        image = removeTransparency(image);
+    }
+    if (isMonochrome(image))
+        image = image.convertToFormat(QImage::Format_Mono);
+
+    std::string path_str = path.toUtf8().constData();
+
+    PdfDocument doc;
+    PdfPage *page = doc.newPage(pdf_w, pdf_h);
+    PdfObject *img;
+
+    QBuffer buff;
+    buff.open(QIODevice::WriteOnly);
+    // using PNG compression is best for Monochrome images
+    if (image.format()==QImage::Format_Mono) {
+        image.save(&buff, "PNG");
+        img = doc.addImage(buff.data().data(), buff.size(), image.width(), image.height(), PDF_IMG_PNG);
+    }
+    // Embed image as whole JPEG image
+    else {
+        image.save(&buff, "JPG");
+        img = doc.addImage(buff.data().data(), buff.size(), image.width(), image.height(), PDF_IMG_JPEG);
+    }
+    buff.close();
+
+    page->drawImage(img, x, y, img_w, img_h);
+    doc.save(path_str);
+}
+
 void
 Window:: exportToPdf()
 {
@@ -562,50 +625,12 @@ Window:: exportToPdf()
         pdf_w = pdf_h;
         pdf_h = tmp;
     }
-    // get image dimension and position
-    int img_w = pdf_w;
-    int img_h = round((pdf_w/image.width())*image.height());
-    if (img_h > pdf_h) {
-        img_h = pdf_h;
-        img_w = round((pdf_h/image.height())*image.width());
-    }
-    int x = (pdf_w-img_w)/2;
-    int y = (pdf_h-img_h)/2;
-
-    // remove transperancy
-    if (image.format()==QImage::Format_ARGB32) {
-        image = removeTransparency(image);
-    }
-    if (isMonochrome(image))
-        image = image.convertToFormat(QImage::Format_Mono);
-
     QFileInfo fi(data.filename);
     QString dir = fi.dir().path();
     QString basename = fi.completeBaseName();
     QString path = dir + "/" + basename + ".pdf";
     path = getNewFileName(path);
-    std::string path_str = path.toUtf8().constData();
-
-    PdfDocument doc;
-    PdfPage *page = doc.newPage(pdf_w, pdf_h);
-    PdfObject *img;
-
-    QBuffer buff;
-    buff.open(QIODevice::WriteOnly);
-    // using PNG compression is best for Monochrome images
-    if (image.format()==QImage::Format_Mono) {
-        image.save(&buff, "PNG");
-        img = doc.addImage(buff.data().data(), buff.size(), image.width(), image.height(), PDF_IMG_PNG);
-    }
-    // Embed image as whole JPEG image
-    else {
-        image.save(&buff, "JPG");
-        img = doc.addImage(buff.data().data(), buff.size(), image.width(), image.height(), PDF_IMG_JPEG);
-    }
-    buff.close();
-
-    page->drawImage(img, x, y, img_w, img_h);
-    doc.save(path_str);
+    savePdf(image, path, pdf_w, pdf_h);
     showNotification("PDF Saved !", QFileInfo(path).fileName());
 }
 
@@ -963,11 +988,17 @@ Window:: addMaskWidget()
     maskWidget->setLayout(maskLayout);
     QPushButton *invertMaskBtn = new QPushButton("Invert Mask", maskWidget);
     QPushButton *clearMaskBtn = new QPushButton("Clear Mask", maskWidget);
+    QPushButton *growMaskBtn = new QPushButton("Grow", maskWidget);
+    QPushButton *shrinkMaskBtn = new QPushButton("Shrink", maskWidget);
+    maskLayout->addWidget(growMaskBtn);
+    maskLayout->addWidget(shrinkMaskBtn);
     maskLayout->addWidget(invertMaskBtn);
     maskLayout->addWidget(clearMaskBtn);
     connect(clearMaskBtn, SIGNAL(clicked()), this, SLOT(removeMaskWidget()));
     connect(clearMaskBtn, SIGNAL(clicked()), maskWidget, SLOT(deleteLater()));
     connect(invertMaskBtn, SIGNAL(clicked()), canvas, SLOT(invertMask()));
+    connect(growMaskBtn, SIGNAL(clicked()), this, SLOT(growMask()));
+    connect(shrinkMaskBtn, SIGNAL(clicked()), this, SLOT(shrinkMask()));
     statusbar->addPermanentWidget(maskWidget);
     // allow only filters, and disable all other buttons
     disableButtons(FILE_BUTTON, true);
@@ -983,6 +1014,24 @@ Window:: removeMaskWidget()
     disableButtons(EDIT_BUTTON, false);
 }
 
+void
+Window:: growMask()
+{
+    bool ok;
+    int radius = QInputDialog::getInt(this, "Grow Mask", "Enter Radius :", 5, 1, 1000, 1, &ok);
+    if (not ok) return;
+    canvas->growMask(radius);
+}
+
+void
+Window:: shrinkMask()
+{
+    bool ok;
+    int radius = QInputDialog::getInt(this, "Shrink Mask", "Enter Radius :", 5, 1, 1000, 1, &ok);
+    if (not ok) return;
+    canvas->shrinkMask(radius);
+}
+
 void
 Window:: lensDistort()
 {
@@ -1561,6 +1610,9 @@ QString getNewFileName(QString filename)
 
 int main(int argc, char *argv[])
 {
+    // process files without showing window
+    if (isBatchMode(argc, argv))
+        return batchMain(argc, argv);
     QApplication app(argc, argv);
     app.setOrganizationName("photoquick");
     app.setApplicationName("photoquick");
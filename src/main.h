@@ -30,6 +30,7 @@
 #include "iscissor.h"
 #include "filters.h"
 #include "pdfwriter.h"
+#include "batch.h"
 #include "ui_mainwindow.h"
 
 #ifndef __PHOTOQUICK_MAIN
@@ -96,6 +97,8 @@ public slots:
     void magicEraser();
     void iScissor();
     void removeMaskWidget();
+    void growMask();
+    void shrinkMask();
     // color filters
     void toGrayScale();
     void adjustColorLevels();
@@ -146,5 +149,6 @@ public slots:
 
 QString getNextFileName(QString current);
 QString getNewFileName(QString filename);
+void savePdf(QImage image, QString path, float pdf_w, float pdf_h);
 
 #endif /* __PHOTOQUICK_MAIN */
@@ -560,16 +560,22 @@ CollagePaper:: clean()
 
 CollageItem:: CollageItem(QString filename) : x(0), y(0)
 {
-    QImage img = loadImage(filename);
+    // only a preview is kept, the original image is loaded again when required
+    QSize size = getImageSize(filename);
+    QImage img;
+    if (size.width() > 600 and size.height() > 600)
+        img = loadImage(filename, QSize(600, 600));
+    else
+        img = loadImage(filename);
     if (img.isNull()) {
         isValid_ = false;
         return;
     }
     // resize it
     pixmap = QPixmap::fromImage(img);
-    img_w = pixmap.width();
-    img_h = pixmap.height();
-    if (img_w > 600 and img_h > 600)
+    img_w = size.isValid() ? size.width() : pixmap.width();
+    img_h = size.isValid() ? size.height() : pixmap.height();
+    if (pixmap.width() > 600 and pixmap.height() > 600)
         pixmap = pixmap.scaled(600, 600, Qt::KeepAspectRatio,Qt::SmoothTransformation);
     this->filename = filename;
     this->image_ = QImage();     // null image
@@ -4,7 +4,7 @@ DEPENDPATH += .
 INCLUDEPATH += .
 QMAKE_CXXFLAGS = -fopenmp -std=c++11
 QMAKE_LFLAGS += -s
-LIBS += -lgomp
+LIBS += -lgomp -ljpeg
 
 greaterThan(QT_MAJOR_VERSION, 4) {
     QT += widgets printsupport
@@ -0,0 +1,196 @@
+/* This file is a part of photoquick program, which is GPLv3 licensed */
+
+#include "strip_stream.h"
+#include <cstring>
+
+static void stripErrorExit(j_common_ptr cinfo)
+{
+    StripJpegError *err = (StripJpegError*) cinfo->err;
+    longjmp(err->setjmp_buffer, 1);
+}
+
+static void stripOutputMessage(j_common_ptr) {}
+
+
+StripStream:: StripStream(QList<BatchOp> ops, int quality, int dpi)
+{
+    this->ops = ops;
+    this->quality = quality;
+    this->dpi = dpi;
+    halo = 0;
+    infile = outfile = NULL;
+    row_buf = NULL;
+    band_top = band_rows = 0;
+}
+
+int
+StripStream:: opHalo(BatchOp &op, int img_w)
+{
+    if (op.name=="grayscale" or op.name=="mirror")
+        return 0;
+    if (op.name=="blur" or op.name=="box" or op.name=="median")
+        return MAX(int(op.args[0]), 0);
+    if (op.name=="sharpen")// uses box blur of radius 1
+        return 1;
+    if (op.name=="despeckle")// each of the 16 Hull() passes spreads 2 rows
+        return 32;
+    if (op.name=="threshold")// default window size of adaptiveThreshold()
+        return MAX(16, img_w/32)/2 + 1;
+    return -1;
+}
+
+bool
+StripStream:: canStream(QString filename, QString format, QList<BatchOp> ops)
+{
+    if (format!="jpg" and format!="jpeg")
+        return false;
+    FILE *f = qfopen(filename, "rb");
+    if (not f)
+        return false;
+    JpegInfo info;
+    bool ok = jpeg_read_info(f, info);
+    fseek(f, 0, SEEK_SET);
+    // autorotation can not be done in strips
+    int orientation = getOrientation(f);
+    fclose(f);
+    if (orientation > 1)
+        return false;
+    // CMYK jpeg is not supported
+    if (not ok or (info.components!=1 and info.components!=3))
+        return false;
+    if (info.width*(qint64)info.height < STRIP_STREAM_MIN_PIXELS)
+        return false;
+    for (int i=0; i<ops.count(); i++) {
+        if (opHalo(ops[i], info.width) < 0)
+            return false;
+    }
+    return true;
+}
+
+bool
+StripStream:: run(QString in_filename, QString out_filename)
+{
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    src.err = jpeg_std_error(&err.pub);
+    dst.err = &err.pub;
+    err.pub.error_exit = stripErrorExit;
+    err.pub.output_message = stripOutputMessage;
+    infile = qfopen(in_filename, "rb");
+    outfile = qfopen(out_filename, "wb");
+    bool ok = false;
+    // same as non-strip path, exif is created again with new dpi
+    if (infile and dpi>0) {
+        ExifInfo exif;
+        exif_read(exif, infile);
+        fseek(infile, 0, SEEK_SET);
+        BatchTask::setExifDpi(exif, dpi);
+        exif_data = create_exif_data(exif, NULL, 0);
+        exif_free(exif);
+    }
+    if (infile and outfile) {
+        if (setjmp(err.setjmp_buffer)==0) {
+            process();
+            ok = true;
+        }
+    }
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+    if (infile) fclose(infile);
+    if (outfile) fclose(outfile);
+    free(row_buf);
+    row_buf = NULL;
+    band = QImage();
+    work = QImage();
+    return ok;
+}
+
+// Local objects having destructor must not be used here, as libjpeg may
+// longjmp() out of this function on error
+void
+StripStream:: process()
+{
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    jpeg_stdio_src(&src, infile);
+    jpeg_save_markers(&src, JPEG_APP0+1, 0xffff);// exif
+    jpeg_read_header(&src, TRUE);
+    src.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&src);
+    int w = src.output_width;
+    int h = src.output_height;
+
+    jpeg_stdio_dest(&dst, outfile);
+    dst.image_width = w;
+    dst.image_height = h;
+    dst.input_components = 3;
+    dst.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&dst);
+    jpeg_set_quality(&dst, quality<0 ? 75 : quality, TRUE);
+    if (dpi>0) {
+        dst.write_JFIF_header = TRUE;
+        dst.density_unit = 1;// dots per inch
+        dst.X_density = dpi;
+        dst.Y_density = dpi;
+    }
+    jpeg_start_compress(&dst, TRUE);
+    if (not exif_data.empty()) {
+        jpeg_write_marker(&dst, JPEG_APP0+1, (const JOCTET*)exif_data.data(), exif_data.size());
+    }
+    else {
+        // pixels are not rotated, so exif is copied as it is, with orientation
+        for (jpeg_saved_marker_ptr m=src.marker_list; m!=NULL; m=m->next) {
+            if (m->marker==JPEG_APP0+1)
+                jpeg_write_marker(&dst, m->marker, m->data, m->data_length);
+        }
+    }
+
+    halo = 0;
+    for (int i=0; i<ops.count(); i++)
+        halo += opHalo(ops[i], w);
+    row_buf = (JSAMPLE*) malloc(w*3);
+    band = QImage(w, MIN(STRIP_HEIGHT+2*halo, h), QImage::Format_RGB32);
+    band_top = band_rows = 0;
+
+    for (int y0=0; y0<h; y0+=STRIP_HEIGHT) {
+        int y1 = MIN(y0+STRIP_HEIGHT, h);
+        int top = MAX(y0-halo, 0);
+        int bottom = MIN(y1+halo, h);
+        // discard rows above halo of this strip
+        int drop = top - band_top;
+        if (drop > 0) {
+            band_rows -= drop;
+            memmove(band.scanLine(0), band.constScanLine(drop), band_rows*band.bytesPerLine());
+            band_top = top;
+        }
+        while (band_top+band_rows < bottom)
+            readRow(band_top+band_rows);
+        // filters use image height, so exact number of rows are copied
+        work = band.copy(0, 0, w, band_rows);
+        for (int i=0; i<ops.count(); i++)
+            BatchTask::applyOp(work, ops[i]);
+        for (int y=y0; y<y1; y++) {
+            QRgb *row = (QRgb*) work.constScanLine(y-band_top);
+            for (int x=0; x<w; x++) {
+                row_buf[3*x] = qRed(row[x]);
+                row_buf[3*x+1] = qGreen(row[x]);
+                row_buf[3*x+2] = qBlue(row[x]);
+            }
+            jpeg_write_scanlines(&dst, &row_buf, 1);
+        }
+    }
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+}
+
+// decode next row of input jpeg, and append to band
+void
+StripStream:: readRow(int image_row)
+{
+    jpeg_read_scanlines(&src, &row_buf, 1);
+    QRgb *row = (QRgb*) band.scanLine(image_row-band_top);
+    for (int x=0; x<(int)src.output_width; x++) {
+        row[x] = qRgb(row_buf[3*x], row_buf[3*x+1], row_buf[3*x+2]);
+    }
+    band_rows++;
+}
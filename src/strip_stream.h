@@ -0,0 +1,60 @@
+#pragma once
+/* Apply filters on huge jpeg images strip by strip, without loading whole image */
+#include <QImage>
+#include <QList>
+#include <cstdio>
+#include <csetjmp>
+#include <jpeglib.h>
+#include "batch.h"
+
+#ifndef __PHOTOQUICK_STRIP_STREAM
+#define __PHOTOQUICK_STRIP_STREAM
+
+// number of output rows produced at a time
+#define STRIP_HEIGHT 256
+// images larger than this are processed in strips, if possible
+#define STRIP_STREAM_MIN_PIXELS 40000000
+
+// libjpeg calls exit() on error by default, we jump back instead
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+} StripJpegError;
+
+/* Reads rows of input jpeg into a band of STRIP_HEIGHT rows, plus halo rows
+   above and below, that neighbourhood filters need. Filters are applied on
+   the band, and rows without halo are encoded to output jpeg. So memory used
+   is O(width x (STRIP_HEIGHT + 2*halo)) instead of O(width x height).
+*/
+class StripStream
+{
+public:
+    QList<BatchOp> ops;
+    int quality;
+    int dpi;            // saved in jfif and exif if > 0
+    int halo;           // sum of halo rows of all operations
+
+    StripStream(QList<BatchOp> ops, int quality, int dpi);
+    // number of rows above and below needed to filter a row, -1 if the
+    // operation is not local to a few rows (e.g resize, auto contrast)
+    static int opHalo(BatchOp &op, int img_w);
+    // check if the file and operations can be processed in strips
+    static bool canStream(QString filename, QString format, QList<BatchOp> ops);
+    bool run(QString in_filename, QString out_filename);
+private:
+    // these are members, because longjmp() does not call destructors
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    StripJpegError err;
+    FILE *infile, *outfile;
+    JSAMPLE *row_buf;
+    QImage band;        // rows from band_top to band_top+band_rows of input
+    QImage work;        // filtered copy of band
+    int band_top, band_rows;
+    std::string exif_data;  // exif with changed dpi, empty if not changed
+
+    void process();
+    void readRow(int image_row);
+};
+
+#endif /* __PHOTOQUICK_STRIP_STREAM */
@@ -27,7 +27,7 @@ Crop:: Crop(Canvas *canvas, QStatusBar *statusbar) : QObject(canvas),
 {
     mouse_pressed = false;
     canvas->drag_to_scroll = false;
-    pixmap = canvas->pixmap()->copy();
+    pixmap = *canvas->pixmap();
     scaleX = float(pixmap.width())/canvas->data->image.width();
     scaleY = float(pixmap.height())/canvas->data->image.height();
     topleft = QPoint(0,0);
@@ -86,6 +86,7 @@ Crop:: Crop(Canvas *canvas, QStatusBar *statusbar) : QObject(canvas),
     connect(cropnowBtn, SIGNAL(clicked()), this, SLOT(crop()));
     connect(cropcancelBtn, SIGNAL(clicked()), this, SLOT(finish()));
     crop_widgets << cropinfoBtn << stepLabel << stepSpin << setRatioBtn << spacer << cropnowBtn << cropcancelBtn;
+    canvas->setOverlay(this);
     drawCropBox();
 }
 
@@ -188,30 +189,35 @@ Crop:: onMouseMove(QPoint pos)
     drawCropBox();
 }
 
+// called by canvas to draw the crop box over image
 void
-Crop:: drawCropBox()
+Crop:: drawOverlay(QPainter &painter)
 {
-    int r1, r3, width, height, left, top;
-    QPoint p1t, p2t;
-    QPixmap pm, pm_box;
-
-    p1t = p1 * scaleX;
-    p2t = (p2 - QPoint(1,1)) * scaleX;
-    r1 = drag_box_w - 1;
-    r3 = drag_box_w - 3;
-    pm = pixmap.copy();
-    pm_box = pm.copy(p1t.x(), p1t.y(), p2t.x()-p1t.x(), p2t.y()-p1t.y());
-    QPainter painter(&pm);
-    painter.fillRect(0,0, pm.width(), pm.height(), QColor(127,127,127,127));
-    painter.drawPixmap(p1t.x(), p1t.y(), pm_box);
+    QPoint p1t = p1 * scaleX;
+    QPoint p2t = (p2 - QPoint(1,1)) * scaleX;
+    int r1 = drag_box_w - 1;
+    int r3 = drag_box_w - 3;
+    // darken the area outside crop box
+    QRegion outside = QRegion(pixmap.rect()) - QRegion(p1t.x(), p1t.y(), p2t.x()-p1t.x(), p2t.y()-p1t.y());
+    painter.setClipRegion(outside);
+    painter.fillRect(pixmap.rect(), QColor(127,127,127,127));
+    painter.setClipping(false);
     painter.drawRect(p1t.x(), p1t.y(), p2t.x()-p1t.x(), p2t.y()-p1t.y());
     painter.drawRect(p1t.x(), p1t.y(), r1, r1);
     painter.drawRect(p2t.x(), p2t.y(), -r1, -r1);
     painter.setPen(Qt::white);
     painter.drawRect(p1t.x()+1, p1t.y()+1, r3, r3);
     painter.drawRect(p2t.x()-1, p2t.y()-1, -r3, -r3);
-    painter.end();
-    canvas->setPixmap(pm);
+}
+
+void
+Crop:: drawCropBox()
+{
+    int width, height, left, top;
+    // outside of crop box only changes within old and new box
+    QPoint p1t = p1 * scaleX;
+    QPoint p2t = (p2 - QPoint(1,1)) * scaleX;
+    canvas->updateOverlay(QRect(p1t, p2t).adjusted(-2,-2,2,2));
     QString text = "Resolution : %1x%2+%3+%4";
     if (crop_mode==FIXED_RESOLUTION)
     {
@@ -268,6 +274,7 @@ Crop:: crop()
 void
 Crop:: finish()
 {
+    canvas->setOverlay(NULL);
     canvas->showScaled();
     canvas->drag_to_scroll = true;
     // remove buttons
@@ -422,6 +429,51 @@ CropResolutionDialog(QWidget *parent, int w, int h) : QDialog(parent)
     connect(btnBox, SIGNAL(accepted()), this, SLOT(accept()));
 }
 
+// ******************************************************************* |
+//                         Warp Preview
+// ------------------------------------------------------------------- |
+
+WarpPreview:: WarpPreview(Canvas *canvas, QPixmap pixmap)
+{
+    // the viewport of scrollarea does not scroll its children except canvas
+    label = new QLabel(canvas->parentWidget());
+    label->setFrameStyle(QFrame::Box | QFrame::Plain);
+    label->setLineWidth(1);
+    label->hide();
+    int w = pixmap.width();
+    if (MAX(pixmap.width(), pixmap.height()) > WARP_PREVIEW_SIZE)
+        pixmap = pixmap.scaled(WARP_PREVIEW_SIZE, WARP_PREVIEW_SIZE, Qt::KeepAspectRatio,
+                                                    Qt::SmoothTransformation);
+    proxy = pixmap.toImage();
+    proxy = proxy.convertToFormat(proxy.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    scale = float(proxy.width())/w;
+}
+
+WarpPreview:: ~WarpPreview()
+{
+    label->deleteLater();
+}
+
+void
+WarpPreview:: show(QImage img)
+{
+    if (img.isNull())
+        return;
+    if (MAX(img.width(), img.height()) > WARP_PREVIEW_SIZE)
+        img = img.scaled(WARP_PREVIEW_SIZE, WARP_PREVIEW_SIZE, Qt::KeepAspectRatio);
+    label->setPixmap(QPixmap::fromImage(img));
+    label->resize(img.width() + 2, img.height() + 2);
+    label->move(label->parentWidget()->width() - label->width() - 8, 8);
+    label->show();
+    label->raise();
+}
+
+void
+WarpPreview:: hide()
+{
+    label->hide();
+}
+
 // ******************************************************************* |
 //                         Perspective Transform
 // ------------------------------------------------------------------- |
@@ -434,7 +486,7 @@ PerspectiveTransform(Canvas *canvas, QStatusBar *statusbar) : QObject(canvas),
     fisometric = false;
     canvas->drag_to_scroll = false;
     clk_radius = 60;
-    pixmap = canvas->pixmap()->copy();
+    pixmap = *canvas->pixmap();
     scaleX = float(pixmap.width())/canvas->data->image.width();
     scaleY = float(pixmap.height())/canvas->data->image.height();
     for (i = 0; i < n; i++)
@@ -450,15 +502,20 @@ PerspectiveTransform(Canvas *canvas, QStatusBar *statusbar) : QObject(canvas),
     // add buttons
     checkIso = new QCheckBox("Isometric?", statusbar);
     statusbar->addPermanentWidget(checkIso);
+    previewCheck = new QCheckBox("Preview", statusbar);
+    statusbar->addPermanentWidget(previewCheck);
     cropnowBtn = new QPushButton("Exec Now", statusbar);
     statusbar->addPermanentWidget(cropnowBtn);
     cropcancelBtn = new QPushButton("Cancel", statusbar);
     statusbar->addPermanentWidget(cropcancelBtn);
     connect(checkIso, SIGNAL(clicked()), this, SLOT(isomode()));
+    connect(previewCheck, SIGNAL(clicked()), this, SLOT(updatePreview()));
     connect(cropnowBtn, SIGNAL(clicked()), this, SLOT(transform()));
     connect(cropcancelBtn, SIGNAL(clicked()), this, SLOT(finish()));
-    crop_widgets << checkIso << cropnowBtn << cropcancelBtn;
+    crop_widgets << checkIso << previewCheck << cropnowBtn << cropcancelBtn;
+    preview = new WarpPreview(canvas, pixmap);
     statusbar->showMessage("Drag corners to fit edges around tilted image/document");
+    canvas->setOverlay(this);
     drawCropBox();
 }
 
@@ -506,18 +563,25 @@ PerspectiveTransform:: onMouseMove(QPoint pos)
 
 void
 PerspectiveTransform:: drawCropBox()
+{
+    int r = clk_radius;
+    canvas->updateOverlay(p.boundingRect().toAlignedRect().adjusted(-r,-r,r,r));
+    updatePreview();
+}
+
+// called by canvas to draw the corners over image
+void
+PerspectiveTransform:: drawOverlay(QPainter &painter)
 {
     float start, span;
     int i, n, r, r2, j0, j1, j2, j3;
-    QPixmap pm = pixmap.copy();
-    QPainter painter(&pm);
     QPolygonF polygon;
-    painter.drawPolygon(p);
     r = clk_radius;
     r2 = r / 2;
     n = p.count();
     if (n == 4)
     {
+        painter.drawPolygon(p);
         for (i = 0; i < n; i++)
         {
             j0 = i;
@@ -532,8 +596,6 @@ PerspectiveTransform:: drawCropBox()
         polygon.clear();
         polygon << (p[0] + QPointF(1,1)) << (p[1] + QPointF(-1,1)) << (p[2] + QPointF(-1,-1)) << (p[3] + QPointF(1,-1));
         painter.drawPolygon(polygon);
-        painter.end();
-        canvas->setPixmap(pm);
     }
 }
 
@@ -541,60 +603,79 @@ void
 PerspectiveTransform:: isomode()
 {
     fisometric = !fisometric;
+    updatePreview();
+}
+
+// warp the proxy image with the same transform, this is fast enough
+// to be done on each mouse move
+void
+PerspectiveTransform:: updatePreview()
+{
+    if (not previewCheck->isChecked()) {
+        preview->hide();
+        return;
+    }
+    QPolygonF proxy_p;
+    for (int i = 0; i < p.count(); i++)
+        proxy_p << p[i] * preview->scale;
+    preview->show(perspectiveWarp(preview->proxy, proxy_p, fisometric));
 }
 
 void
 PerspectiveTransform:: transform()
 {
     int i, n;
-    float min_w, min_h, max_w, max_h;
-    QPointF mxy, sxy;
-    QPolygonF mapFrom, mapTo;
-    QTransform tfm, trueMtx;
-    QImage img;
     n = p.count();
     if (n == 4)
     {
         for (i = 0; i < n; i++)
             p[i] = QPointF(p[i].x() / scaleX, p[i].y() / scaleY);
-        if (fisometric)
-        {
-            mxy = meanx2(p);
-            sxy = stdevx2(p);
-            min_w = mxy.x() - sxy.x();
-            min_h = mxy.y() - sxy.y();
-            max_w = mxy.x() + sxy.x();
-            max_h = mxy.y() + sxy.y();
-        }
-        else
-        {
-            min_w = 0;
-            min_h = 0;
-            max_w = MAX(p[1].x() - p[0].x(), p[2].x() - p[3].x());
-            max_h = MAX(p[3].y() - p[0].y(), p[2].y() - p[1].y());
-        }
-        mapFrom << p[0] << p[1] << p[2] << p[3];
-        mapTo << QPointF(min_w, min_h) << QPointF(max_w, min_h) << QPointF(max_w, max_h) << QPointF(min_w, max_h);
-        QTransform::quadToQuad(mapFrom, mapTo, tfm);
-        img = canvas->data->image.transformed(tfm, Qt::SmoothTransformation);
-        trueMtx = QImage::trueMatrix(tfm,canvas->data->image.width(),canvas->data->image.height());
-        if (fisometric)
-        {
-            canvas->data->image = img.copy();
-        }
-        else
-        {
-            pt[0] = trueMtx.map(p[0]);
-            pt[2] = trueMtx.map(p[2]);
-            canvas->data->image = img.copy(QRect(QPoint(pt[0].x(),pt[0].y()), QPoint(pt[2].x(),pt[2].y())));
-        }
+        canvas->data->image = perspectiveWarp(canvas->data->image, p, fisometric);
     }
     finish();
 }
 
+QImage perspectiveWarp(QImage image, QPolygonF p, bool isometric)
+{
+    float min_w, min_h, max_w, max_h;
+    QPointF mxy, sxy, p0, p2;
+    QPolygonF mapFrom, mapTo;
+    QTransform tfm, trueMtx;
+    QImage img;
+    if (isometric)
+    {
+        mxy = meanx2(p);
+        sxy = stdevx2(p);
+        min_w = mxy.x() - sxy.x();
+        min_h = mxy.y() - sxy.y();
+        max_w = mxy.x() + sxy.x();
+        max_h = mxy.y() + sxy.y();
+    }
+    else
+    {
+        min_w = 0;
+        min_h = 0;
+        max_w = MAX(p[1].x() - p[0].x(), p[2].x() - p[3].x());
+        max_h = MAX(p[3].y() - p[0].y(), p[2].y() - p[1].y());
+    }
+    mapFrom << p[0] << p[1] << p[2] << p[3];
+    mapTo << QPointF(min_w, min_h) << QPointF(max_w, min_h) << QPointF(max_w, max_h) << QPointF(min_w, max_h);
+    if (not QTransform::quadToQuad(mapFrom, mapTo, tfm))
+        return image;
+    img = image.transformed(tfm, Qt::SmoothTransformation);
+    if (isometric)
+        return img;
+    trueMtx = QImage::trueMatrix(tfm, image.width(), image.height());
+    p0 = trueMtx.map(p[0]);
+    p2 = trueMtx.map(p[2]);
+    return img.copy(QRect(QPoint(p0.x(),p0.y()), QPoint(p2.x(),p2.y())));
+}
+
 void
 PerspectiveTransform:: finish()
 {
+    delete preview;
+    canvas->setOverlay(NULL);
     canvas->showScaled();
     canvas->drag_to_scroll = true;
     // remove buttons
@@ -690,7 +771,7 @@ DeWarping(Canvas *canvas, QStatusBar *statusbar, int count) : QObject(canvas),
     fequalarea = false;
     clk_radius = 10;
     canvas->drag_to_scroll = false;
-    pixmap = canvas->pixmap()->copy();
+    pixmap = *canvas->pixmap();
     scaleX = float(pixmap.width())/canvas->data->image.width();
     scaleY = float(pixmap.height())/canvas->data->image.height();
     dxt = (pixmap.width() - 1) / (n + 1);
@@ -726,16 +807,21 @@ DeWarping(Canvas *canvas, QStatusBar *statusbar, int count) : QObject(canvas),
     statusbar->addPermanentWidget(LagrangeCheck);
     EqualAreaCheck = new QCheckBox("Equal Area?", statusbar);
     statusbar->addPermanentWidget(EqualAreaCheck);
+    previewCheck = new QCheckBox("Preview", statusbar);
+    statusbar->addPermanentWidget(previewCheck);
     cropnowBtn = new QPushButton("DeWarp Now", statusbar);
     statusbar->addPermanentWidget(cropnowBtn);
     cropcancelBtn = new QPushButton("Cancel", statusbar);
     statusbar->addPermanentWidget(cropcancelBtn);
     connect(LagrangeCheck, SIGNAL(clicked()), this, SLOT(LagrangeMode()));
     connect(EqualAreaCheck, SIGNAL(clicked()), this, SLOT(EqualAreaMode()));
+    connect(previewCheck, SIGNAL(clicked()), this, SLOT(updatePreview()));
     connect(cropnowBtn, SIGNAL(clicked()), this, SLOT(transform()));
     connect(cropcancelBtn, SIGNAL(clicked()), this, SLOT(finish()));
-    crop_widgets << EqualAreaCheck << LagrangeCheck << cropnowBtn << cropcancelBtn;
+    crop_widgets << previewCheck << EqualAreaCheck << LagrangeCheck << cropnowBtn << cropcancelBtn;
+    preview = new WarpPreview(canvas, pixmap);
     statusbar->showMessage("Set node for high and down contors image/document");
+    canvas->setOverlay(this);
     drawDeWarpLine();
 }
 
@@ -803,18 +889,27 @@ DeWarping:: onMouseMove(QPoint pos)
 void
 DeWarping:: drawDeWarpLine()
 {
-    int i, n, r, r2, rs2;
     float area;
-    QPixmap pm = pixmap.copy();
-    QPainter painter(&pm);
-    n = lnh.count();
-    r = clk_radius;
-    r2 = r - 1;
-    rs2 = r * 0.707107f;
+    int r = clk_radius + 1;
     area = calcArea(lnh);
     ylnh = area / pixmap.width();
     area = calcArea(lnd);
     ylnd = area / pixmap.width();
+    QRectF rect = lnh.boundingRect() | lnd.boundingRect();
+    rect |= QRectF(0, MIN(ylnh, ylnd), pixmap.width(), fabs(ylnh-ylnd));
+    canvas->updateOverlay(rect.toAlignedRect().adjusted(-r,-r,r,r));
+    updatePreview();
+}
+
+// called by canvas to draw the lines over image
+void
+DeWarping:: drawOverlay(QPainter &painter)
+{
+    int i, n, r, r2, rs2;
+    n = lnh.count();
+    r = clk_radius;
+    r2 = r - 1;
+    rs2 = r * 0.707107f;
     painter.setPen(Qt::gray);
     for (i = 2; i < n - 2; i++)
     {
@@ -840,36 +935,47 @@ DeWarping:: drawDeWarpLine()
     painter.setPen(Qt::red);
     painter.drawRect(0, ylnh, pixmap.width(), 0);
     painter.drawRect(0, ylnd, pixmap.width(), 0);
-    painter.end();
-    canvas->setPixmap(pm);
 }
 
 void
 DeWarping:: LagrangeMode()
 {
     flagrange = !flagrange;
+    updatePreview();
 }
 
 void
 DeWarping:: EqualAreaMode()
 {
     fequalarea = !fequalarea;
+    updatePreview();
+}
+
+// remap the proxy image with the lines scaled to its size
+void
+DeWarping:: updatePreview()
+{
+    if (not previewCheck->isChecked()) {
+        preview->hide();
+        return;
+    }
+    float k = preview->scale;
+    QPolygonF proxy_lnh, proxy_lnd;
+    for (int i = 0; i < lnh.count(); i++) {
+        proxy_lnh << lnh[i] * k;
+        proxy_lnd << lnd[i] * k;
+    }
+    preview->show(dewarpImage(preview->proxy, proxy_lnh, proxy_lnd, ylnh * k, ylnd * k,
+                                flagrange, fequalarea));
 }
 
 void
 DeWarping:: transform()
 {
-    int i, n, y, x, w, h, ih, id;
-//    int ic; // InterpolateLagrangePolynomial
-    float yh, yd, dyh, dyd, yk0, yk1, yk2, oy;
-//    QPolygonF lni; // InterpolateLagrangePolynomial
+    int i, n;
     n = lnh.count();
     if (n > 4)
     {
-        QImage img = canvas->data->image.copy();
-        QRgb *row;
-        w = img.width();
-        h = img.height();
         for (i = 0; i < n; i++)
         {
             lnh[i] = QPointF(lnh[i].x() / scaleX, lnh[i].y() / scaleY);
@@ -877,89 +983,107 @@ DeWarping:: transform()
         }
         ylnh /= scaleY;
         ylnd /= scaleY;
-        ih = id = 2;
-        dyh = (float)(lnh[ih].y() - lnh[ih - 1].y()) / (lnh[ih].x() - lnh[ih - 1].x());
-        dyd = (float)(lnd[id].y() - lnd[id - 1].y()) / (lnd[id].x() - lnd[id - 1].x());
-        for (x = 0; x < w; x++)
+        canvas->data->image = dewarpImage(canvas->data->image, lnh, lnd, ylnh, ylnd,
+                                                        flagrange, fequalarea);
+    }
+    finish();
+}
+
+QImage dewarpImage(QImage image, QPolygonF lnh, QPolygonF lnd, float ylnh, float ylnd,
+                                bool akima, bool equal_area)
+{
+    int n, y, x, w, h, ih, id;
+//    int i, ic; // InterpolateLagrangePolynomial
+    float yh, yd, dyh, dyd, yk0, yk1, yk2, oy;
+//    QPolygonF lni; // InterpolateLagrangePolynomial
+    n = lnh.count();
+    QImage img = image.copy();
+    QRgb *row;
+    w = img.width();
+    h = img.height();
+    ih = id = 2;
+    dyh = (float)(lnh[ih].y() - lnh[ih - 1].y()) / (lnh[ih].x() - lnh[ih - 1].x());
+    dyd = (float)(lnd[id].y() - lnd[id - 1].y()) / (lnd[id].x() - lnd[id - 1].x());
+    for (x = 0; x < w; x++)
+    {
+        if (x >= lnh[ih].x() and ih < n - 2)
         {
-            if (x >= lnh[ih].x())
-            {
-                ih++;
-                dyh = (float)(lnh[ih].y() - lnh[ih - 1].y()) / (lnh[ih].x() - lnh[ih - 1].x());
-            }
-            if (x >= lnd[id].x())
-            {
-                id++;
-                dyd = (float)(lnd[id].y() - lnd[id - 1].y()) / (lnd[id].x() - lnd[id - 1].x());
-            }
-            if (flagrange)
+            ih++;
+            dyh = (float)(lnh[ih].y() - lnh[ih - 1].y()) / (lnh[ih].x() - lnh[ih - 1].x());
+        }
+        if (x >= lnd[id].x() and id < n - 2)
+        {
+            id++;
+            dyd = (float)(lnd[id].y() - lnd[id - 1].y()) / (lnd[id].x() - lnd[id - 1].x());
+        }
+        if (akima)
+        {
+            /* // InterpolateLagrangePolynomial
+            lni.clear();
+            ic = (ih < 3) ? 3 : (ih > n - 3) ? (n - 3) : ih;
+            for (i = ic - 2; i < ic + 2; i++)
+                lni << lnh[i];
+            yh = InterpolateLagrangePolynomial (x, lni);
+            lni.clear();
+            ic = (id < 3) ? 3 : (id > n - 3) ? (n - 3) : id;
+            for (i = ic - 2; i < ic + 2; i++)
+                lni << lnd[i];
+            yd = InterpolateLagrangePolynomial (x, lni);
+            yh = (yh < 1.0f) ? 1.0f : ((yh < h - 1) ? yh : (h - 1));
+            yd = (yd < 1.0f) ? 1.0f : ((yd < h - 1) ? yd : (h - 1));
+            */
+            yh = InterpolateAkima (x, lnh);
+            yd = InterpolateAkima (x, lnd);
+            yh = (yh < 1.0f) ? 1.0f : ((yh < h - 1) ? yh : (h - 1));
+            yd = (yd < 1.0f) ? 1.0f : ((yd < h - 1) ? yd : (h - 1));
+        }
+        else
+        {
+            yh = (float)lnh[ih - 1].y() + dyh * (x - lnh[ih - 1].x());
+            yd = (float)lnd[id - 1].y() + dyd * (x - lnd[id - 1].x());
+        }
+        yk0 = yd / ylnd;
+        yk1 = (yh - yd) / (ylnh - ylnd);
+        yk2 = (h - yh) / (h - ylnh);
+        if (equal_area)
+        {
+            for (y = 0; y < MIN((int)(ylnd + 1.0f), h); y++)
             {
-                /* // InterpolateLagrangePolynomial
-                lni.clear();
-                ic = (ih < 3) ? 3 : (ih > n - 3) ? (n - 3) : ih;
-                for (i = ic - 2; i < ic + 2; i++)
-                    lni << lnh[i];
-                yh = InterpolateLagrangePolynomial (x, lni);
-                lni.clear();
-                ic = (id < 3) ? 3 : (id > n - 3) ? (n - 3) : id;
-                for (i = ic - 2; i < ic + 2; i++)
-                    lni << lnd[i];
-                yd = InterpolateLagrangePolynomial (x, lni);
-                yh = (yh < 1.0f) ? 1.0f : ((yh < h - 1) ? yh : (h - 1));
-                yd = (yd < 1.0f) ? 1.0f : ((yd < h - 1) ? yd : (h - 1));
-                */
-                yh = InterpolateAkima (x, lnh);
-                yd = InterpolateAkima (x, lnd);
-                yh = (yh < 1.0f) ? 1.0f : ((yh < h - 1) ? yh : (h - 1));
-                yd = (yd < 1.0f) ? 1.0f : ((yd < h - 1) ? yd : (h - 1));
+                row = (QRgb*)img.scanLine(y);
+                oy = (float)y * yk0;
+                row[x] = InterpolateBiCubic (image, oy, (float)x);
             }
-            else
+            for (y = (int)(ylnd + 1.0f); y < MIN((int)(ylnh + 1.0f), h); y++)
             {
-                yh = (float)lnh[ih - 1].y() + dyh * (x - lnh[ih - 1].x());
-                yd = (float)lnd[id - 1].y() + dyd * (x - lnd[id - 1].x());
+                row = (QRgb*)img.scanLine(y);
+                oy = yd + (float)(y - ylnd) * yk1;
+                row[x] = InterpolateBiCubic (image, oy, (float)x);
             }
-            yk0 = yd / ylnd;
-            yk1 = (yh - yd) / (ylnh - ylnd);
-            yk2 = (h - yh) / (h - ylnh);
-            if (fequalarea)
+            for (y = (int)(ylnh + 1.0f); y < h; y++)
             {
-                for (y = 0; y < (int)(ylnd + 1.0f); y++)
-                {
-                    row = (QRgb*)img.constScanLine(y);
-                    oy = (float)y * yk0;
-                    row[x] = InterpolateBiCubic (canvas->data->image, oy, (float)x);
-                }
-                for (y = (int)(ylnd + 1.0f); y < (int)(ylnh + 1.0f); y++)
-                {
-                    row = (QRgb*)img.constScanLine(y);
-                    oy = yd + (float)(y - ylnd) * yk1;
-                    row[x] = InterpolateBiCubic (canvas->data->image, oy, (float)x);
-                }
-                for (y = (int)(ylnh + 1.0f); y < h; y++)
-                {
-                    row = (QRgb*)img.constScanLine(y);
-                    oy = yh + (float)(y - ylnh) * yk2;
-                    row[x] = InterpolateBiCubic (canvas->data->image, oy, (float)x);
-                }
+                row = (QRgb*)img.scanLine(y);
+                oy = yh + (float)(y - ylnh) * yk2;
+                row[x] = InterpolateBiCubic (image, oy, (float)x);
             }
-            else
+        }
+        else
+        {
+            for (y = 0; y < h; y++)
             {
-                for (y = 0; y < h; y++)
-                {
-                    row = (QRgb*)img.constScanLine(y);
-                    oy = yd + (float)(y - ylnd) * yk1;
-                    row[x] = InterpolateBiCubic (canvas->data->image, oy, (float)x);
-                }
+                row = (QRgb*)img.scanLine(y);
+                oy = yd + (float)(y - ylnd) * yk1;
+                row[x] = InterpolateBiCubic (image, oy, (float)x);
             }
         }
-        canvas->data->image = img.copy();
     }
-    finish();
+    return img;
 }
 
 void
 DeWarping:: finish()
 {
+    delete preview;
+    canvas->setOverlay(NULL);
     canvas->showScaled();
     canvas->drag_to_scroll = true;
     // remove buttons
@@ -983,7 +1107,7 @@ DeOblique(Canvas *canvas, QStatusBar *statusbar) : QObject(canvas),
     float xt, yt;
     mouse_pressed = false;
     canvas->drag_to_scroll = false;
-    pixmap = canvas->pixmap()->copy();
+    pixmap = *canvas->pixmap();
     scaleX = float(pixmap.width())/canvas->data->image.width();
     scaleY = float(pixmap.height())/canvas->data->image.height();
     wt = pixmap.width() - 1;
@@ -1001,6 +1125,7 @@ DeOblique(Canvas *canvas, QStatusBar *statusbar) : QObject(canvas),
     connect(cropcancelBtn, SIGNAL(clicked()), this, SLOT(finish()));
     crop_widgets << cropnowBtn << cropcancelBtn;
     statusbar->showMessage("Drag corners to fit edges around tilted image/document");
+    canvas->setOverlay(this);
     drawCropBox();
 }
 
@@ -1073,8 +1198,13 @@ DeOblique:: onMouseMove(QPoint pos)
 void
 DeOblique:: drawCropBox()
 {
-    QPixmap pm = pixmap.copy();
-    QPainter painter(&pm);
+    canvas->updateOverlay(p.boundingRect().toAlignedRect().adjusted(-2,-2,2,2));
+}
+
+// called by canvas to draw the lines over image
+void
+DeOblique:: drawOverlay(QPainter &painter)
+{
     painter.drawLine(p[0], p[1]);
     painter.drawLine(p[2], p[3]);
     painter.setPen(Qt::white);
@@ -1082,8 +1212,6 @@ DeOblique:: drawCropBox()
     painter.drawLine(p[0] - QPointF(0,1), p[1]  - QPointF(0,1));
     painter.drawLine(p[2] + QPointF(1,0), p[3]  + QPointF(1,0));
     painter.drawLine(p[2] - QPointF(1,0), p[3]  - QPointF(1,0));
-    painter.end();
-    canvas->setPixmap(pm);
 }
 
 void
@@ -1109,6 +1237,7 @@ DeOblique:: transform()
 void
 DeOblique:: finish()
 {
+    canvas->setOverlay(NULL);
     canvas->showScaled();
     canvas->drag_to_scroll = true;
     // remove buttons
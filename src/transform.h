@@ -24,8 +24,25 @@ typedef enum {
     FIXED_RESOLUTION
 } CropMode;
 
+// maximum width or height of the proxy image used for warp preview
+#define WARP_PREVIEW_SIZE 360
+
+// an inset in the top right corner of the viewport showing the result of a
+// warp tool, computed from a downscaled copy of the displayed pixmap
+class WarpPreview
+{
+public:
+    QLabel *label;
+    QImage proxy;   // pixmap scaled down to fit WARP_PREVIEW_SIZE
+    float scale;    // proxy size / pixmap size
+    WarpPreview(Canvas *canvas, QPixmap pixmap);
+    ~WarpPreview();
+    void show(QImage img);
+    void hide();
+};
+
 // the crop manager
-class Crop : public QObject
+class Crop : public QObject, public CanvasOverlay
 {
     Q_OBJECT
 public:
@@ -40,6 +57,7 @@ public:
     QPushButton *cropnowBtn, *cropcancelBtn, *cropinfoBtn;
     QLabel *stepLabel;
     QSpinBox *stepSpin;
+    void drawOverlay(QPainter &painter);
 
 private:
     QPixmap pixmap;
@@ -99,17 +117,19 @@ public:
 // _____________________________________________________________________
 // perspective transform manager
 
-class PerspectiveTransform : public QObject
+class PerspectiveTransform : public QObject, public CanvasOverlay
 {
     Q_OBJECT
 public:
     PerspectiveTransform(Canvas *canvas, QStatusBar *statusbar);
     Canvas *canvas;
-    QCheckBox *checkIso;
+    QCheckBox *checkIso, *previewCheck;
     QPushButton *cropnowBtn, *cropcancelBtn;
     QStatusBar *statusbar;
+    void drawOverlay(QPainter &painter);
 private:
     QPixmap pixmap;
+    WarpPreview *preview;
     bool mouse_pressed, fisometric;
     QPolygonF pt, p;
     QPoint clk_pos;
@@ -122,6 +142,7 @@ private slots:
     void onMouseRelease(QPoint pos);
     void onMouseMove(QPoint pos);
     void isomode();
+    void updatePreview();
     void transform();
     void finish();
 signals:
@@ -148,17 +169,19 @@ public slots:
 // _____________________________________________________________________
 // simple dewarping transform manager
 
-class DeWarping : public QObject
+class DeWarping : public QObject, public CanvasOverlay
 {
     Q_OBJECT
 public:
     Canvas *canvas;
     QStatusBar *statusbar;
-    QCheckBox *LagrangeCheck, *EqualAreaCheck;
+    QCheckBox *LagrangeCheck, *EqualAreaCheck, *previewCheck;
     QPushButton *cropnowBtn, *cropcancelBtn;
     DeWarping(Canvas *canvas, QStatusBar *statusbar, int count);
+    void drawOverlay(QPainter &painter);
 private:
     QPixmap pixmap;
+    WarpPreview *preview;
     bool mouse_pressed, flagrange, fequalarea;
     QPolygonF lnht, lnh, lndt, lnd;
     QPoint clk_pos;
@@ -172,6 +195,7 @@ private slots:
     void onMouseMove(QPoint pos);
     void LagrangeMode();
     void EqualAreaMode();
+    void updatePreview();
     void transform();
     void finish();
 signals:
@@ -181,7 +205,7 @@ signals:
 // _____________________________________________________________________
 // perspective transform manager
 
-class DeOblique : public QObject
+class DeOblique : public QObject, public CanvasOverlay
 {
     Q_OBJECT
 public:
@@ -189,6 +213,7 @@ public:
     Canvas *canvas;
     QPushButton *cropnowBtn, *cropcancelBtn;
     QStatusBar *statusbar;
+    void drawOverlay(QPainter &painter);
 private:
     QPixmap pixmap;
     bool mouse_pressed;
@@ -209,6 +234,11 @@ signals:
 };
 
 // transformation begin
+// warp the quad p of img to a rectangle, p is in img coordinates
+QImage perspectiveWarp(QImage img, QPolygonF p, bool isometric);
+// straighten the lines lnh and lnd of img to horizontal lines at ylnh and ylnd
+QImage dewarpImage(QImage img, QPolygonF lnh, QPolygonF lnd, float ylnh, float ylnd,
+                                bool akima, bool equal_area);
 QPointF meanx2(QPolygonF p);
 QPointF stdevx2(QPolygonF p);
 void calcArc(QPointF center, QPointF from, QPointF to, QPointF through,